@@ -0,0 +1,73 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// StringPiece points to a range of bytes owned by someone else (typically a
+// line of a connection buffer), so that it can be passed around without being
+// copied. The bytes must outlive the StringPiece, and are not NUL-terminated.
+
+#ifndef BASE_STRINGPIECE_H__
+#define BASE_STRINGPIECE_H__
+
+#include "base/basictypes.h"
+#include <string.h>
+#include <string>
+
+using std::string;
+
+class StringPiece {
+ public:
+  StringPiece() : data_(NULL), length_(0) {}
+  StringPiece(const char* data, uint32 length)
+    : data_(data), length_(length) {}
+  StringPiece(const char* str) : data_(str), length_(strlen(str)) {}
+  StringPiece(const string& str) : data_(str.data()), length_(str.size()) {}
+
+  // Accessors; begin() and end() are iterators over the bytes.
+  const char* data() const { return data_; }
+  uint32 size() const { return length_; }
+  bool empty() const { return length_ == 0; }
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + length_; }
+  char operator[](uint32 i) const { return data_[i]; }
+
+  void set(const char* data, uint32 length) {
+    data_ = data;
+    length_ = length;
+  }
+  void clear() {
+    data_ = NULL;
+    length_ = 0;
+  }
+
+  // Returns a copy of the bytes.
+  string as_string() const { return string(data_, length_); }
+
+  bool operator==(const StringPiece& other) const {
+    return length_ == other.length_ &&
+        (length_ == 0 || memcmp(data_, other.data_, length_) == 0);
+  }
+  bool operator!=(const StringPiece& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  // Copy and assignment are allowed (and cheap).
+  const char* data_;
+  uint32 length_;
+};
+
+#endif  // BASE_STRINGPIECE_H__
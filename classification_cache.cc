@@ -0,0 +1,253 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "classification_cache.h"
+#include <ctype.h>
+
+const int ClassificationCache::kNumShards;
+const int ClassificationCache::kDefaultSize;
+const uint32 ClassificationCache::kMaxUrlLength;
+
+// A cached classification. The key is stored normalized, as the method
+// followed by the url and the host.
+struct ClassificationCache::Entry {
+  uint32 hash;
+  int protocol;
+  uint32 method_length;
+  uint32 url_length;
+  string key;
+  int32 mark;
+
+  // Hash bucket chaining, and LRU list (most recently used first).
+  Entry* next_in_bucket;
+  Entry* lru_prev;
+  Entry* lru_next;
+};
+
+struct ClassificationCache::Shard {
+  Mutex lock;
+  vector<Entry*> buckets;
+  Entry* lru_head;
+  Entry* lru_tail;
+  int size;
+  int64 hits;
+  int64 misses;
+};
+
+// Returns true if the normalized @p key equals the @p piece.
+static bool equals_normalized(const char* key, const StringPiece& piece) {
+  for (uint32 i = 0; i < piece.size(); ++i) {
+    if (key[i] != tolower(piece[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends the normalized @p piece to the @p key.
+static void append_normalized(const StringPiece& piece, string* key) {
+  for (uint32 i = 0; i < piece.size(); ++i) {
+    key->push_back(tolower(piece[i]));
+  }
+}
+
+ClassificationCache::ClassificationCache(int size)
+  : shards_(), shard_capacity_((size + kNumShards - 1) / kNumShards) {
+  CHECK(size > 0);
+  uint32 num_buckets = 1;
+  while (num_buckets < static_cast<uint32>(shard_capacity_)) {
+    num_buckets *= 2;
+  }
+  for (int i = 0; i < kNumShards; ++i) {
+    Shard* shard = new Shard();
+    shard->buckets.resize(num_buckets, NULL);
+    shard->lru_head = shard->lru_tail = NULL;
+    shard->size = 0;
+    shard->hits = shard->misses = 0;
+    shards_.push_back(shard);
+  }
+}
+
+ClassificationCache::~ClassificationCache() {
+  Clear();
+  for (int i = 0; i < kNumShards; ++i) {
+    delete shards_[i];
+  }
+}
+
+int ClassificationCache::size() {
+  int size = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    MutexLock ml(&shards_[i]->lock);
+    size += shards_[i]->size;
+  }
+  return size;
+}
+
+uint32 ClassificationCache::get_hash(int protocol, const StringPiece& method,
+                                     const StringPiece& url,
+                                     const StringPiece& host) {
+  // FNV-1a, over the protocol, the method, a separator, the url, a separator,
+  // and the host.
+  uint32 hash = 2166136261U;
+  hash = (hash ^ protocol) * 16777619U;
+  for (uint32 i = 0; i < method.size(); ++i) {
+    hash = (hash ^ static_cast<uint8>(tolower(method[i]))) * 16777619U;
+  }
+  hash = (hash ^ ' ') * 16777619U;
+  for (uint32 i = 0; i < url.size(); ++i) {
+    hash = (hash ^ static_cast<uint8>(tolower(url[i]))) * 16777619U;
+  }
+  hash = (hash ^ ' ') * 16777619U;
+  for (uint32 i = 0; i < host.size(); ++i) {
+    hash = (hash ^ static_cast<uint8>(tolower(host[i]))) * 16777619U;
+  }
+  return hash;
+}
+
+ClassificationCache::Entry* ClassificationCache::find_locked(
+    Shard* shard, uint32 hash, int protocol,
+    const StringPiece& method, const StringPiece& url,
+    const StringPiece& host) {
+  Entry* entry = shard->buckets[(hash / kNumShards) &
+                                (shard->buckets.size() - 1)];
+  for (; entry; entry = entry->next_in_bucket) {
+    if (entry->hash == hash && entry->protocol == protocol &&
+        entry->method_length == method.size() &&
+        entry->url_length == url.size() &&
+        entry->key.size() == method.size() + url.size() + host.size() &&
+        equals_normalized(entry->key.data(), method) &&
+        equals_normalized(entry->key.data() + method.size(), url) &&
+        equals_normalized(entry->key.data() + method.size() + url.size(),
+                          host)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+void ClassificationCache::unlink_locked(Shard* shard, Entry* entry) {
+  (entry->lru_prev ? entry->lru_prev->lru_next : shard->lru_head) =
+      entry->lru_next;
+  (entry->lru_next ? entry->lru_next->lru_prev : shard->lru_tail) =
+      entry->lru_prev;
+}
+
+void ClassificationCache::push_front_locked(Shard* shard, Entry* entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  (shard->lru_head ? shard->lru_head->lru_prev : shard->lru_tail) = entry;
+  shard->lru_head = entry;
+}
+
+bool ClassificationCache::Lookup(int protocol, const StringPiece& method,
+                                 const StringPiece& url,
+                                 const StringPiece& host, int32* mark) {
+  if (url.size() + host.size() > kMaxUrlLength) {
+    return false;
+  }
+
+  uint32 hash = get_hash(protocol, method, url, host);
+  Shard* shard = get_shard(hash);
+  MutexLock ml(&shard->lock);
+  Entry* entry = find_locked(shard, hash, protocol, method, url, host);
+  if (entry == NULL) {
+    shard->misses++;
+    return false;
+  }
+
+  shard->hits++;
+  if (entry != shard->lru_head) {
+    unlink_locked(shard, entry);
+    push_front_locked(shard, entry);
+  }
+  *mark = entry->mark;
+  return true;
+}
+
+void ClassificationCache::Insert(int protocol, const StringPiece& method,
+                                 const StringPiece& url,
+                                 const StringPiece& host, int32 mark) {
+  if (url.size() + host.size() > kMaxUrlLength) {
+    return;
+  }
+
+  uint32 hash = get_hash(protocol, method, url, host);
+  Shard* shard = get_shard(hash);
+  MutexLock ml(&shard->lock);
+  Entry* entry = find_locked(shard, hash, protocol, method, url, host);
+  if (entry != NULL) {
+    // Another thread classified the same key concurrently.
+    entry->mark = mark;
+    return;
+  }
+
+  // Recycles the least recently used entry if the shard is full.
+  if (shard->size >= shard_capacity_) {
+    entry = shard->lru_tail;
+    unlink_locked(shard, entry);
+    Entry** link = &shard->buckets[(entry->hash / kNumShards) &
+                                   (shard->buckets.size() - 1)];
+    while (*link != entry) {
+      link = &(*link)->next_in_bucket;
+    }
+    *link = entry->next_in_bucket;
+    entry->key.clear();
+  } else {
+    entry = new Entry();
+    shard->size++;
+  }
+
+  entry->hash = hash;
+  entry->protocol = protocol;
+  entry->method_length = method.size();
+  entry->url_length = url.size();
+  append_normalized(method, &entry->key);
+  append_normalized(url, &entry->key);
+  append_normalized(host, &entry->key);
+  entry->mark = mark;
+  Entry** bucket =
+      &shard->buckets[(hash / kNumShards) & (shard->buckets.size() - 1)];
+  entry->next_in_bucket = *bucket;
+  *bucket = entry;
+  push_front_locked(shard, entry);
+}
+
+void ClassificationCache::Clear() {
+  for (int i = 0; i < kNumShards; ++i) {
+    Shard* shard = shards_[i];
+    MutexLock ml(&shard->lock);
+    while (shard->lru_head) {
+      Entry* entry = shard->lru_head;
+      shard->lru_head = entry->lru_next;
+      delete entry;
+    }
+    shard->lru_tail = NULL;
+    shard->buckets.assign(shard->buckets.size(), NULL);
+    shard->size = 0;
+  }
+}
+
+void ClassificationCache::GetStats(int64* hits, int64* misses) {
+  *hits = *misses = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    MutexLock ml(&shards_[i]->lock);
+    *hits += shards_[i]->hits;
+    *misses += shards_[i]->misses;
+  }
+}
@@ -0,0 +1,94 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef CLASSIFICATION_CACHE_H__
+#define CLASSIFICATION_CACHE_H__
+
+#include "base/basictypes.h"
+#include "base/mutex.h"
+#include "base/stringpiece.h"
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Bounded cache of classification marks, keyed by (protocol, method, url,
+// host).
+// Since the classification rules are case-insensitive, keys are normalized to
+// lower case, so that urls differing only by their case share an entry.
+// The cache is split in independently locked shards (selected by the hash of
+// the key), each evicting its least recently used entries when full. Urls
+// longer than kMaxUrlLength (with their host) are not cached.
+class ClassificationCache {
+ public:
+  static const int kNumShards = 16;
+  static const int kDefaultSize = 65536;
+  static const uint32 kMaxUrlLength = 1024;
+
+  // Creates a cache of at most @p size entries (rounded up to a multiple of
+  // the number of shards).
+  explicit ClassificationCache(int size);
+  ~ClassificationCache();
+
+  // Maximal and current number of entries.
+  int capacity() const { return shard_capacity_ * kNumShards; }
+  int size();
+
+  // Sets @p mark to the cached mark of the @p protocol / @p method / @p url /
+  // @p host, and returns true, or returns false if the key is not cached.
+  bool Lookup(int protocol, const StringPiece& method, const StringPiece& url,
+              const StringPiece& host, int32* mark);
+
+  // Caches the @p mark of the @p protocol / @p method / @p url / @p host.
+  void Insert(int protocol, const StringPiece& method, const StringPiece& url,
+              const StringPiece& host, int32 mark);
+
+  // Drops all the entries (for when the rules change).
+  void Clear();
+
+  // Returns the number of successful and failed lookups.
+  void GetStats(int64* hits, int64* misses);
+
+ private:
+  struct Entry;
+  struct Shard;
+
+  // Returns the hash of the normalized key.
+  static uint32 get_hash(int protocol, const StringPiece& method,
+                         const StringPiece& url, const StringPiece& host);
+
+  // Returns the entry of the key in the @p shard, or NULL. The shard's lock
+  // must be held.
+  static Entry* find_locked(Shard* shard, uint32 hash, int protocol,
+                            const StringPiece& method, const StringPiece& url,
+                            const StringPiece& host);
+
+  // Unlinks the @p entry from the LRU list of the @p shard, and inserts it
+  // at the front of that list.
+  static void unlink_locked(Shard* shard, Entry* entry);
+  static void push_front_locked(Shard* shard, Entry* entry);
+
+  Shard* get_shard(uint32 hash) { return shards_[hash % kNumShards]; }
+
+  vector<Shard*> shards_;
+  int shard_capacity_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ClassificationCache);
+};
+
+#endif  // CLASSIFICATION_CACHE_H__
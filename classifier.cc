@@ -20,64 +20,82 @@
 #include "base/scoped_ptr.h"
 #include "classifier.h"
 #include "conntrack.h"
+#include "object_pool.h"
+#include "protocol_parser.h"
+#include "serializer.h"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
 
 //
-// Common regexps and helpers used for http/ftp protocol matching.
+// Common helpers used for http/ftp protocol matching (the line parsers are
+// in protocol_parser.h).
 //
-static const boost::regex http_request_line(
-    "^([a-z]+) (.*) HTTP(/.*)?\r?$",
-    boost::regex_constants::extended | boost::regex_constants::icase);
-static const boost::regex http_header_line(
-    "^[^ ]+: .*\r?$",
-    boost::regex_constants::extended | boost::regex_constants::icase);
-static const boost::regex http_response_line(
-    "^HTTP(/[0-9\\.]+)? [0-9]+",
-    boost::regex_constants::extended | boost::regex_constants::icase);
-
-static const boost::regex ftp_server_line(
-    "^2[0-9][0-9] .*$",
-    boost::regex_constants::extended | boost::regex_constants::icase);
-static const boost::regex ftp_request_line(
-    "^\\s*(RETR|STOR|STOU|APPE|REST) (.*)\r?$",
-    boost::regex_constants::extended | boost::regex_constants::icase);
-
-// Puts the line starting at @p start_pos in the @p buffer, and returns
-// the next line position, or returns string::npos if no line is found.
-// A line can end with any of \r and \n.
-size_t get_line(const string& buffer, size_t start_pos, string* line) {
+// Points @p line to the line starting at @p start_pos in the @p buffer
+// (without copying it), and returns the next line position, or returns 0 if
+// no line is found. A line can end with any of \r and \n.
+uint32 get_line(const StreamBuffer& buffer, uint32 start_pos,
+                StringPiece* line) {
   CHECK(line != NULL);
-  size_t eol_index = buffer.find_first_of("\r\n", start_pos);
-
-  if (eol_index != string::npos) {
-    line->assign(buffer.substr(start_pos, eol_index - start_pos));
-    return eol_index + 1;
+  const char* data = buffer.data() + start_pos;
+  const char* eol = FindLineEnd(data, buffer.size() - start_pos);
+  if (eol == NULL) {
+    return 0;
   }
-  return string::npos;
-}
-
-// Puts the first line in the @p buffer, and returns true, or returns false
-// if no line is found.
-bool get_first_line(const string& buffer, string* line) {
-  return get_line(buffer, 0, line) != string::npos;
+  line->set(data, eol - data);
+  return start_pos + line->size() + 1;
 }
 
 //
 // Implementation of the ConnectionClassifier class.
 //
+static ObjectPool connection_classifier_pool("ConnectionClassifier",
+                                             sizeof(ConnectionClassifier));
+
+void* ConnectionClassifier::operator new(size_t size) {
+  CHECK(size == sizeof(ConnectionClassifier));
+  return connection_classifier_pool.Allocate();
+}
+
+void ConnectionClassifier::operator delete(void* connection_classifier) {
+  connection_classifier_pool.Free(connection_classifier);
+}
+
+const uint32 ConnectionClassifier::kMaxPendingRequests;
+const uint32 ConnectionClassifier::kMaxMethodLength;
+const uint32 ConnectionClassifier::kMaxSkippedBytes;
+
 ConnectionClassifier::ConnectionClassifier(
     Classifier* classifier, Connection* connection)
   : classifier_(classifier),
     connection_(connection),
     connection_type_(UNKNOWN),
+    egress_detector_(),
+    ingress_detector_(),
     egress_buffer_hint_(0),
     ingress_buffer_hint_(0),
+    egress_needed_(true),
+    ingress_needed_(true),
     direction_hint_(INGRESS_IS_UNKNOWN),
     classified_(false),
-    mark_(Classifier::kNoMatchYet) {
+    mark_(Classifier::kNoMatchYet),
+    http_requests_(true),
+    http_responses_(false),
+    http_responses_tracked_(true),
+    http_pending_(0),
+    http_pending_head_(0),
+    http_pending_connect_(0) {
+  classifier_->Acquire();
+}
+
+ConnectionClassifier::~ConnectionClassifier() {
+  classifier_->Release();
 }
 
 void ConnectionClassifier::reverse_connection() {
   std::swap(egress_buffer_hint_, ingress_buffer_hint_);
+  std::swap(egress_needed_, ingress_needed_);
+  egress_detector_.Swap(&ingress_detector_);
 
   if (direction_hint_ == INGRESS_IS_SERVER) {
     direction_hint_ = INGRESS_IS_CLIENT;
@@ -98,15 +116,24 @@ bool ConnectionClassifier::update() {
 
     // If the guess_protocol() wasn't able to guess the protocol, let's have
     // a no match yet; if guess_protocol() was able identify the connection
-    // is *not* an http/ftp connection, stops the classification with a NoMatch.
+    // is *not* an http/ftp connection, or if no rule exists for its protocol
+    // (hence no request can match), stops the classification with a NoMatch.
     if (connection_type_ == UNKNOWN) {
       mark_ = Classifier::kNoMatchYet;
-    } else if (connection_type_ == OTHER) {
+    } else if (connection_type_ == OTHER ||
+               (connection_type_ == HTTP &&
+                !classifier_->has_rules(ClassificationRule::HTTP)) ||
+               (connection_type_ == FTP &&
+                !classifier_->has_rules(ClassificationRule::FTP))) {
       mark_ = Classifier::kNoMatch;
       classified_ = true;
     }
   }
 
+  if (classified_) {
+    return true;
+  }
+
   // If the connection is of known&handled protocol, redirects to the
   // appropriate protocol handler.
   if (connection_type_ == HTTP) {
@@ -119,72 +146,47 @@ bool ConnectionClassifier::update() {
 }
 
 ConnectionProtocol ConnectionClassifier::guess_protocol() {
-  // Indicates whether the protocol-specific matchers were able to rule
-  // negatively with enough evidences or not.
-  bool enough_material = true;
+  // Nothing is consumed until the protocol is known, hence the buffers hold
+  // all the bytes sent so far.
+  const StreamBuffer& ingress = connection_->buffer_ingress();
+  const StreamBuffer& egress = connection_->buffer_egress();
+  ProtocolDetector::Result ingress_result =
+      ingress_detector_.Update(ingress.data(), ingress.size());
+  ProtocolDetector::Result egress_result =
+      egress_detector_.Update(egress.data(), egress.size());
 
   // Looks for http-specific patterns.
-  if (connection_->buffer_ingress().size() > 0) {
-    string line;
-    if (get_line(connection_->buffer_ingress(), ingress_buffer_start(), &line)) {
-      if (http_parse_request_line(line, NULL, NULL)) {
-        return HTTP;
-      }
-      if (http_parse_response_line(line)) {
-        return HTTP;
-      }
-    } else {
-      enough_material = false;
-    }
+  if (ingress_result == ProtocolDetector::DETECT_HTTP_REQUEST ||
+      egress_result == ProtocolDetector::DETECT_HTTP_RESPONSE) {
+    direction_hint_ = INGRESS_IS_CLIENT;
+    return HTTP;
   }
-  if (connection_->buffer_egress().size() > 0) {
-    string line;
-    if (get_line(connection_->buffer_egress(), egress_buffer_start(), &line)) {
-      if (http_parse_request_line(line, NULL, NULL)) {
-        return HTTP;
-      }
-      if (http_parse_response_line(line)) {
-        return HTTP;
-      }
-    } else {
-      enough_material = false;
-    }
+  if (ingress_result == ProtocolDetector::DETECT_HTTP_RESPONSE ||
+      egress_result == ProtocolDetector::DETECT_HTTP_REQUEST) {
+    direction_hint_ = INGRESS_IS_SERVER;
+    return HTTP;
   }
 
   // Looks for ftp-specific patterns.
-  bool got_lines =
-      connection_->buffer_ingress().size() > 0 &&
-      connection_->buffer_egress().size() > 0;
-  if (connection_->buffer_ingress().size() > 0) {
-    string line;
-    if (get_line(connection_->buffer_ingress(), ingress_buffer_start(), &line)) {
-      if (boost::regex_match(line, ftp_server_line)) {
-        direction_hint_ = INGRESS_IS_SERVER;
-        return FTP;
-      }
-    } else {
-      got_lines = false;
-    }
-  }
-  
-  if (connection_->buffer_egress().size() > 0) {
-    string line;
-    if (get_line(connection_->buffer_egress(), egress_buffer_start(), &line)) {
-      if (boost::regex_match(line, ftp_server_line)) {
-        direction_hint_ = INGRESS_IS_CLIENT;
-        return FTP;
-      }
-    } else {
-      got_lines = false;
-    }
+  if (ingress_result == ProtocolDetector::DETECT_FTP_SERVER) {
+    direction_hint_ = INGRESS_IS_SERVER;
+    return FTP;
   }
-  
-  if (!got_lines) {
-    enough_material = false;
+  if (egress_result == ProtocolDetector::DETECT_FTP_SERVER) {
+    direction_hint_ = INGRESS_IS_CLIENT;
+    return FTP;
   }
 
-  // Default processing when no match is found.
-  if (enough_material) {
+  // The side speaking first (the http client, or the ftp server) decides:
+  // the connection is something else once a direction was ruled out, unless
+  // the other one may still match.
+  bool ingress_pending = (ingress_result == ProtocolDetector::DETECT_PENDING &&
+                          ingress_detector_.position() > 0);
+  bool egress_pending = (egress_result == ProtocolDetector::DETECT_PENDING &&
+                         egress_detector_.position() > 0);
+  if ((ingress_result == ProtocolDetector::DETECT_NONE ||
+       egress_result == ProtocolDetector::DETECT_NONE) &&
+      !ingress_pending && !egress_pending) {
     return OTHER;
   }
   return UNKNOWN;
@@ -192,30 +194,37 @@ ConnectionProtocol ConnectionClassifier::guess_protocol() {
 
 void ConnectionClassifier::update_ftp() {
   // Note: connection direction is already known (set by guess_protocol).
+  // Only the client requests are looked at.
   if (direction_hint_ == INGRESS_IS_CLIENT) {
     egress_buffer_hint_ = connection_->bytes_egress();
+    egress_needed_ = false;
     ftp_handle_buffer(true);
   } else {
     ingress_buffer_hint_ = connection_->bytes_ingress();
+    ingress_needed_ = false;
     ftp_handle_buffer(false);
   }
 }
 
 void ConnectionClassifier::ftp_handle_buffer(bool ingress) {
-  const string& buffer =
+  const StreamBuffer& buffer =
       (ingress ? connection_->buffer_ingress() : connection_->buffer_egress());
-  size_t next_line = (ingress ? ingress_buffer_start() : egress_buffer_start());
-  
-  size_t processed = 0;
-  string line;
-  for (; (next_line = get_line(buffer, next_line, &line)) != string::npos;) {
-    processed = next_line;
-    
-    string method, url;
+  uint32 buffer_start =
+      (ingress ? ingress_buffer_start() : egress_buffer_start());
+  uint32 next_line = buffer_start;
+
+  uint32 processed = 0;
+  StringPiece line;
+  while ((next_line = get_line(buffer, next_line, &line)) != 0) {
+    processed = next_line - buffer_start;
+
+    StringPiece method, url;
     if (ftp_parse_request_line(line, &method, &url)) {
-      DLOG("FTP found with m=%s, u=%s", method.c_str(), url.c_str());
+      DLOG("FTP found with m=%.*s, u=%.*s",
+           static_cast<int>(method.size()), method.data(),
+           static_cast<int>(url.size()), url.data());
       mark_ = classifier_->get_classification(ClassificationRule::FTP,
-                                              method, url);
+                                              method, url, StringPiece());
     }
   }
   
@@ -226,79 +235,184 @@ void ConnectionClassifier::ftp_handle_buffer(bool ingress) {
   }
 }
 
-bool ConnectionClassifier::ftp_parse_request_line(const string& line,
-                                                  string* method,
-                                                  string* url) const {
-  boost::smatch what;
-  if (!boost::regex_match(line, what, ftp_request_line)) {
-    return false;
-  }
-
-  if (method) {
-    method->assign(what[1]);
-  }
-  if (url) {
-    url->assign(what[2]);
-  }
-  return true;
+bool ConnectionClassifier::ftp_parse_request_line(const StringPiece& line,
+                                                  StringPiece* method,
+                                                  StringPiece* url) const {
+  return ParseFtpRequestLine(line, method, url);
 }
 
 void ConnectionClassifier::update_http() {
-  // The http classifier is only using the very first line of the buffer,
-  // so both the hints should be equal to 0.
-  CHECK(egress_buffer_hint_ == 0);
-  CHECK(ingress_buffer_hint_ == 0);
-
-  if (ingress_buffer_length() > 0 && direction_hint_ != INGRESS_IS_SERVER) {
-    http_handle_buffer(true);
-  }
-  if (egress_buffer_length() > 0 && direction_hint_ != INGRESS_IS_CLIENT) {
-    http_handle_buffer(false);
+  // Note: connection direction is already known (set by guess_protocol).
+  // Requests are handled first, so that their responses can be matched.
+  bool client_is_ingress = (direction_hint_ == INGRESS_IS_CLIENT);
+  http_handle_requests(client_is_ingress);
+  if (!classified_) {
+    http_handle_responses(!client_is_ingress);
   }
 }
 
-void ConnectionClassifier::http_handle_buffer(bool ingress) {
-  const string& buffer =
+void ConnectionClassifier::http_handle_requests(bool ingress) {
+  const StreamBuffer& buffer =
       (ingress ? connection_->buffer_ingress() : connection_->buffer_egress());
+  uint32& buffer_hint = (ingress ? ingress_buffer_hint_ : egress_buffer_hint_);
+  if (buffer_hint >= static_cast<uint32>(ingress ?
+                                         connection_->bytes_ingress() :
+                                         connection_->bytes_egress())) {
+    return;
+  }
 
-  string line;
-  if (get_first_line(buffer, &line)) {
-    string method, url;
-    if (http_parse_request_line(line, &method, &url)) {
-      DLOG("HTTP found with m=%s, u=%s", method.c_str(), url.c_str());
-      mark_ = classifier_->get_classification(ClassificationRule::HTTP,
-                                              method, url);
-      direction_hint_ = (ingress ? INGRESS_IS_CLIENT : INGRESS_IS_SERVER);
-      classified_ = true;
-    } else if (http_parse_response_line(line)) {
-      direction_hint_ = (ingress ? INGRESS_IS_SERVER : INGRESS_IS_CLIENT);
-    } else {
-      DLOG("Not an HTTP connection (incriminated line: '%s').", line.c_str());
+  // Consumed bytes (up to the end of the last request line) are dropped from
+  // the buffer by the connection, and the rest of the bodies are not even
+  // stored.
+  while (!classified_) {
+    uint32 buffer_start =
+        (ingress ? ingress_buffer_start() : egress_buffer_start());
+    uint32 consumed;
+    StringPiece line, method, url;
+    HttpStream::Event event =
+        http_requests_.Parse(buffer.data() + buffer_start,
+                             buffer.size() - buffer_start, &consumed, &line);
+    buffer_hint += consumed;
+    if (event == HttpStream::NEED_DATA) {
+      if (http_requests_.in_start_line()) {
+        http_check_oversize_request(
+            StringPiece(buffer.data() + buffer_start + consumed,
+                        buffer.size() - buffer_start - consumed));
+      } else {
+        buffer_hint += http_requests_.SkipBody(kMaxSkippedBytes);
+      }
+      break;
+    }
+
+    // Once the framing is lost, the next requests can't be found anymore.
+    if (event == HttpStream::ERROR ||
+        !http_parse_request_line(line, &method, &url)) {
+      DLOG("Lost the HTTP framing after %u requests.",
+           http_requests_.messages());
       mark_ = Classifier::kNoMatch;
       classified_ = true;
+      break;
+    }
+
+    DLOG("HTTP found with m=%.*s, u=%.*s",
+         static_cast<int>(method.size()), method.data(),
+         static_cast<int>(url.size()), url.data());
+    mark_ = classifier_->get_classification(ClassificationRule::HTTP,
+                                            method, url,
+                                            http_requests_.host());
+    if (mark_ != Classifier::kNoMatch) {
+      classified_ = true;
+      break;
+    }
+
+    // Remembers the requests whose responses are framed differently.
+    if (http_pending_ == kMaxPendingRequests) {
+      http_responses_tracked_ = false;
+    } else {
+      ClassificationRule::Method plain_method =
+          ClassificationRule::get_method(method);
+      if (plain_method == ClassificationRule::METHOD_HEAD) {
+        http_pending_head_ |= 1U << http_pending_;
+      } else if (plain_method == ClassificationRule::METHOD_CONNECT) {
+        http_pending_connect_ |= 1U << http_pending_;
+      }
+      ++http_pending_;
     }
   }
 }
 
-bool ConnectionClassifier::http_parse_request_line(const string& line,
-                                                   string* method,
-                                                   string* url) const {
-  boost::smatch what;
-  if (!boost::regex_match(line, what, http_request_line)) {
-    return false;
+void ConnectionClassifier::http_check_oversize_request(
+    const StringPiece& partial_line) {
+  // Lines whose method is not followed by a space yet can't be checked.
+  const char* space = reinterpret_cast<const char*>(
+      memchr(partial_line.data(), ' ',
+             std::min(partial_line.size(), kMaxMethodLength + 1)));
+  if (space == NULL) {
+    return;
   }
 
-  if (method) {
-    method->assign(what[1]);
+  StringPiece method(partial_line.data(), space - partial_line.data());
+  StringPiece partial_url(space + 1, partial_line.end() - space - 1);
+  int32 mark = classifier_->get_oversize_classification(method, partial_url);
+  if (mark != Classifier::kNoMatchYet) {
+    DLOG("HTTP found with m=%.*s, and an url of more than %u bytes",
+         static_cast<int>(method.size()), method.data(),
+         static_cast<uint32>(partial_url.size()));
+    mark_ = mark;
+    classified_ = true;
   }
-  if (url) {
-    url->assign(what[2]);
+}
+
+void ConnectionClassifier::http_handle_responses(bool ingress) {
+  const StreamBuffer& buffer =
+      (ingress ? connection_->buffer_ingress() : connection_->buffer_egress());
+  uint32& buffer_hint = (ingress ? ingress_buffer_hint_ : egress_buffer_hint_);
+  bool& needed = (ingress ? ingress_needed_ : egress_needed_);
+  if (buffer_hint >= static_cast<uint32>(ingress ?
+                                         connection_->bytes_ingress() :
+                                         connection_->bytes_egress())) {
+    return;
   }
-  return true;
+
+  while (http_responses_tracked_) {
+    uint32 buffer_start =
+        (ingress ? ingress_buffer_start() : egress_buffer_start());
+    uint32 consumed;
+    StringPiece line;
+    HttpStream::Event event =
+        http_responses_.Parse(buffer.data() + buffer_start,
+                              buffer.size() - buffer_start, &consumed, &line);
+    buffer_hint += consumed;
+    if (event == HttpStream::NEED_DATA) {
+      if (!http_responses_.until_close()) {
+        buffer_hint += http_responses_.SkipBody(kMaxSkippedBytes);
+        return;
+      }
+
+      // The rest of the direction is the body of the last response.
+      http_responses_tracked_ = false;
+      break;
+    }
+
+    int status;
+    if (event == HttpStream::ERROR || http_pending_ == 0 ||
+        !ParseHttpStatusLine(line, &status)) {
+      DLOG("Lost the HTTP responses framing after %u responses.",
+           http_responses_.messages());
+      http_responses_tracked_ = false;
+      break;
+    }
+
+    // Switching protocols, and successful CONNECT requests, turn the
+    // connection into a tunnel, which can't be classified anymore.
+    bool head = http_pending_head_ & 1;
+    bool connect = http_pending_connect_ & 1;
+    if (status == 101 || (connect && status / 100 == 2)) {
+      classified_ = true;
+      return;
+    }
+
+    // Interim responses are followed by the final response of the request.
+    if (status / 100 == 1 || head || status == 204 || status == 304) {
+      http_responses_.set_no_body();
+    }
+    if (status / 100 != 1) {
+      http_pending_head_ >>= 1;
+      http_pending_connect_ >>= 1;
+      --http_pending_;
+    }
+  }
+
+  // Untracked responses are not stored anymore.
+  buffer_hint = (ingress ? connection_->bytes_ingress() :
+                 connection_->bytes_egress());
+  needed = false;
 }
 
-bool ConnectionClassifier::http_parse_response_line(const string& line) const {
-  return boost::regex_match(line, http_response_line);
+bool ConnectionClassifier::http_parse_request_line(const StringPiece& line,
+                                                   StringPiece* method,
+                                                   StringPiece* url) const {
+  return ParseHttpRequestLine(line, method, url);
 }
 
 
@@ -331,12 +445,33 @@ ClassificationRule::ClassificationRule(Protocol protocol, int32 mark)
   : protocol_(protocol),
     mark_(mark),
     method_(NULL),
-    url_(NULL) {
+    url_(NULL),
+    plain_method_(METHOD_OTHER),
+    url_min_length_(0),
+    url_prefix_(),
+    url_suffix_(),
+    url_host_(),
+    url_list_(NULL) {
   if (protocol != HTTP && protocol != FTP) {
     LOG(FATAL, "ClassificationRule only accepts HTTP and FTP as protocols.");
   }
 }
 
+ClassificationRule::Method ClassificationRule::get_method(
+    const StringPiece& method) {
+  static const char* kMethodNames[NUM_METHODS] = {
+    "", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "TRACE", "CONNECT",
+    "RETR", "STOR", "STOU", "APPE", "REST",
+  };
+  for (int m = METHOD_OTHER + 1; m < NUM_METHODS; ++m) {
+    if (method.size() == strlen(kMethodNames[m]) &&
+        strncasecmp(method.data(), kMethodNames[m], method.size()) == 0) {
+      return static_cast<Method>(m);
+    }
+  }
+  return METHOD_OTHER;
+}
+
 void ClassificationRule::initialize_regex(scoped_ptr<boost::regex>& regex,
                                           const string& text) {
   regex.reset(new boost::regex(
@@ -349,34 +484,168 @@ void ClassificationRule::initialize_regex(scoped_ptr<boost::regex>& regex,
   }
 }
 
+bool ClassificationRule::is_valid_regex(const string& text) {
+  boost::regex regex(
+      text,
+      boost::regex_constants::extended |
+          boost::regex_constants::icase |
+          boost::regex_constants::no_except);
+  return regex.status() == 0;
+}
+
 bool ClassificationRule::match(Protocol protocol,
-                               const string& method,
-                               const string& url) {
-  return (protocol_ == protocol) &&
-      (!method_.get() || boost::regex_match(method, *method_)) &&
-      (!url_.get() || boost::regex_match(url, *url_));
+                               const StringPiece& method,
+                               const StringPiece& url,
+                               const StringPiece& host) {
+  CHECK(method_pattern_.empty() == !method_.get());
+  CHECK(url_pattern_.empty() == !url_.get());
+  if (protocol_ != protocol) {
+    return false;
+  }
+  if (plain_method_ != METHOD_OTHER) {
+    if (get_method(method) != plain_method_) {
+      return false;
+    }
+  } else if (method_.get() &&
+             !boost::regex_match(method.begin(), method.end(), *method_)) {
+    return false;
+  }
+  return match_url_predicates(url, host) &&
+      (!url_.get() || boost::regex_match(url.begin(), url.end(), *url_));
 }
 
+bool ClassificationRule::match_url_predicates(const StringPiece& url,
+                                              const StringPiece& host) const {
+  if (url.size() < url_min_length_) {
+    return false;
+  }
+  if (!url_prefix_.empty() &&
+      (url.size() < url_prefix_.size() ||
+       strncasecmp(url.data(), url_prefix_.data(), url_prefix_.size()) != 0)) {
+    return false;
+  }
+  if (!url_suffix_.empty() &&
+      (url.size() < url_suffix_.size() ||
+       strncasecmp(url.end() - url_suffix_.size(), url_suffix_.data(),
+                   url_suffix_.size()) != 0)) {
+    return false;
+  }
+  if (!url_host_.empty() &&
+      (host.size() != url_host_.size() ||
+       strncasecmp(host.data(), url_host_.data(), host.size()) != 0)) {
+    return false;
+  }
+  return !url_list_.get() || url_list_->Match(url, host);
+}
+
+bool ClassificationRule::set_url_list(const string& path) {
+  UrlList* list = UrlList::Open(path);
+  if (list == NULL) {
+    return false;
+  }
+  url_list_.reset(list);
+  return true;
+}
+
+
 string ClassificationRule::str() const {
   string rule = StringPrintf("mark=%d proto=%s",
                              mark_,
                              protocol_ == HTTP ? "http" : "ftp");
-  if (url_.get()) {
+  if (!url_pattern_.empty()) {
     rule.append(" url=");
-    rule.append(url_->str());
+    rule.append(url_pattern_);
+  }
+  if (url_min_length_ > 0) {
+    rule.append(StringPrintf(" url_maxsize=%u", url_min_length_ - 1));
+  }
+  if (!url_prefix_.empty()) {
+    rule.append(" url_prefix=");
+    rule.append(url_prefix_);
+  }
+  if (!url_suffix_.empty()) {
+    rule.append(" url_suffix=");
+    rule.append(url_suffix_);
+  }
+  if (!url_host_.empty()) {
+    rule.append(" url_host=");
+    rule.append(url_host_);
   }
-  if (method_.get()) {
+  if (url_list_.get()) {
+    rule.append(" url_list=");
+    rule.append(url_list_->path());
+  }
+  if (!method_pattern_.empty()) {
     rule.append(" method=");
-    rule.append(method_->str());
+    rule.append(method_pattern_);
   }
 
   return rule;
 }
 
+void ClassificationRule::Save(Serializer* out) const {
+  out->WriteUint8(protocol_);
+  out->WriteInt32(mark_);
+  out->WriteString(method_pattern_);
+  out->WriteUint8(plain_method_);
+  out->WriteString(url_pattern_);
+  out->WriteUint32(url_min_length_);
+  out->WriteString(url_prefix_);
+  out->WriteString(url_suffix_);
+  out->WriteString(url_host_);
+  out->WriteString(url_list_.get() ? url_list_->path() : "");
+}
+
+ClassificationRule* ClassificationRule::Load(Deserializer* in) {
+  uint8 protocol, plain_method;
+  int32 mark;
+  string url_list;
+  if (!in->ReadUint8(&protocol) || !in->ReadInt32(&mark) ||
+      (protocol != HTTP && protocol != FTP)) {
+    return NULL;
+  }
+  scoped_ptr<ClassificationRule> rule(
+      new ClassificationRule(static_cast<Protocol>(protocol), mark));
+  if (!in->ReadString(&rule->method_pattern_) ||
+      !in->ReadUint8(&plain_method) || plain_method >= NUM_METHODS ||
+      !in->ReadString(&rule->url_pattern_) ||
+      !in->ReadUint32(&rule->url_min_length_) ||
+      !in->ReadString(&rule->url_prefix_) ||
+      !in->ReadString(&rule->url_suffix_) ||
+      !in->ReadString(&rule->url_host_) ||
+      !in->ReadString(&url_list) ||
+      (!url_list.empty() && !rule->set_url_list(url_list))) {
+    return NULL;
+  }
+  rule->plain_method_ = static_cast<Method>(plain_method);
+  return rule.release();
+}
+
+bool ClassificationRule::compile_regexes(bool method, bool url) {
+  if ((method && !is_valid_regex(method_pattern_)) ||
+      (url && !is_valid_regex(url_pattern_))) {
+    return false;
+  }
+  if (method) {
+    initialize_regex(method_, method_pattern_);
+  }
+  if (url) {
+    initialize_regex(url_, url_pattern_);
+  }
+  return true;
+}
+
 //
 // Implementation of the Classifier class.
 //
-Classifier::Classifier() {
+Classifier::Classifier()
+  : rules_(), host_rules_(false), compiled_(false), use_automata_(false),
+    use_prefilter_(false),
+    method_matchers_(), url_matchers_(),
+    url_prefiltered_(), prefilter_hits_(0), prefilter_misses_(0),
+    cache_(NULL), ref_counter_(1) {
+  protocol_rules_[ClassificationRule::HTTP] = false;
+  protocol_rules_[ClassificationRule::FTP] = false;
 }
 
 Classifier::~Classifier() {
@@ -387,15 +656,348 @@ Classifier::~Classifier() {
   rules_.clear();
 }
 
+void Classifier::Compile(bool use_automata, bool use_prefilter) {
+  CHECK(!compiled_);
+  use_automata_ = use_automata;
+  use_prefilter_ = use_prefilter;
+  method_matchers_.resize(rules_.size(), MATCHER_NONE);
+  url_matchers_.resize(rules_.size(), MATCHER_NONE);
+  url_prefiltered_.resize(rules_.size(), false);
+  for (uint r = 0; r < rules_.size(); ++r) {
+    const ClassificationRule* rule = rules_[r];
+    CompiledRules* compiled = &compiled_rules_[rule->protocol()];
+    if (rule->plain_method() != ClassificationRule::METHOD_OTHER) {
+      method_matchers_[r] = MATCHER_PLAIN;
+    } else if (!rule->method_pattern().empty()) {
+      method_matchers_[r] = (use_automata &&
+          compiled->methods.Add(r, rule->method_pattern())) ?
+          MATCHER_AUTOMATON : MATCHER_REGEX;
+    }
+    if (!rule->url_pattern().empty()) {
+      url_matchers_[r] = (use_automata &&
+          compiled->urls.Add(r, rule->url_pattern())) ?
+          MATCHER_AUTOMATON : MATCHER_REGEX;
+    }
+  }
+
+  // Rules too large for an automaton fall back to the boost::regex.
+  for (int p = 0; p < 2; ++p) {
+    CompiledRules* compiled = &compiled_rules_[p];
+    vector<int> rejected;
+    compiled->methods.Compile(&rejected);
+    for (uint i = 0; i < rejected.size(); ++i) {
+      method_matchers_[rejected[i]] = MATCHER_REGEX;
+    }
+    rejected.clear();
+    compiled->urls.Compile(&rejected);
+    for (uint i = 0; i < rejected.size(); ++i) {
+      url_matchers_[rejected[i]] = MATCHER_REGEX;
+    }
+  }
+  int method_regexes = 0, method_plains = 0;
+  int url_regexes = 0, url_literals = 0, url_predicates = 0;
+  for (uint r = 0; r < rules_.size(); ++r) {
+    CompiledRules* compiled = &compiled_rules_[rules_[r]->protocol()];
+    for (int m = 0; m < ClassificationRule::NUM_METHODS; ++m) {
+      if (url_matchers_[r] != MATCHER_AUTOMATON &&
+          (method_matchers_[r] != MATCHER_PLAIN ||
+           rules_[r]->plain_method() == m)) {
+        compiled->other_urls[m].push_back(r);
+      }
+    }
+
+    // Registers the required literals of the remaining url regexps.
+    string literal;
+    if (use_prefilter && url_matchers_[r] == MATCHER_REGEX &&
+        LiteralPrefilter::GetRequiredLiteral(rules_[r]->url_pattern(),
+                                             &literal)) {
+      compiled->url_literals.Add(r, literal);
+      url_prefiltered_[r] = true;
+      url_literals++;
+    }
+    method_regexes += (method_matchers_[r] == MATCHER_REGEX);
+    method_plains += (method_matchers_[r] == MATCHER_PLAIN);
+    url_predicates += rules_[r]->has_url_predicates();
+    url_regexes += (url_matchers_[r] == MATCHER_REGEX);
+  }
+  compiled_rules_[0].url_literals.Compile();
+  compiled_rules_[1].url_literals.Compile();
+  compile_size_rules();
+  compiled_ = true;
+
+  LOG(INFO, "Compiled the rules into %d method and %d url automata "
+            "(%d method and %d url regexps are matched separately, %d of the "
+            "latter with a literal prefilter; %d plain methods are indexed, "
+            "and %d rules have url predicates checked first).",
+      compiled_rules_[0].methods.num_automata() +
+          compiled_rules_[1].methods.num_automata(),
+      compiled_rules_[0].urls.num_automata() +
+          compiled_rules_[1].urls.num_automata(),
+      method_regexes, url_regexes, url_literals, method_plains,
+      url_predicates);
+}
+
+void Classifier::Save(Serializer* out) const {
+  CHECK(compiled_);
+  out->WriteUint8(use_automata_);
+  out->WriteUint8(use_prefilter_);
+  out->WriteUint32(rules_.size());
+  for (uint r = 0; r < rules_.size(); ++r) {
+    rules_[r]->Save(out);
+    out->WriteUint8(method_matchers_[r]);
+    out->WriteUint8(url_matchers_[r]);
+    out->WriteUint8(url_prefiltered_[r]);
+  }
+  for (int p = 0; p < 2; ++p) {
+    const CompiledRules& compiled = compiled_rules_[p];
+    compiled.methods.Save(out);
+    compiled.urls.Save(out);
+    for (int m = 0; m < ClassificationRule::NUM_METHODS; ++m) {
+      out->WriteVector(compiled.other_urls[m]);
+    }
+    compiled.url_literals.Save(out);
+  }
+}
+
+bool Classifier::Load(Deserializer* in) {
+  CHECK(!compiled_ && rules_.empty());
+  uint8 use_automata, use_prefilter;
+  uint32 num_rules;
+  if (!in->ReadUint8(&use_automata) || !in->ReadUint8(&use_prefilter) ||
+      !in->ReadUint32(&num_rules)) {
+    return false;
+  }
+  use_automata_ = use_automata;
+  use_prefilter_ = use_prefilter;
+
+  // Rules: only the regexps matched with boost::regex are compiled.
+  for (uint32 r = 0; r < num_rules; ++r) {
+    ClassificationRule* rule = ClassificationRule::Load(in);
+    if (!rule) {
+      return false;
+    }
+    rules_.push_back(rule);
+    host_rules_ |= !rule->url_host().empty() || rule->url_list();
+    protocol_rules_[rule->protocol()] = true;
+
+    uint8 method_matcher, url_matcher, url_prefiltered;
+    if (!in->ReadUint8(&method_matcher) || method_matcher > MATCHER_PLAIN ||
+        !in->ReadUint8(&url_matcher) || url_matcher > MATCHER_REGEX ||
+        !in->ReadUint8(&url_prefiltered) ||
+        (method_matcher == MATCHER_NONE) != rule->method_pattern().empty() ||
+        (url_matcher == MATCHER_NONE) != rule->url_pattern().empty() ||
+        !rule->compile_regexes(method_matcher == MATCHER_REGEX,
+                               url_matcher == MATCHER_REGEX)) {
+      return false;
+    }
+    method_matchers_.push_back(static_cast<ConstraintMatcher>(method_matcher));
+    url_matchers_.push_back(static_cast<ConstraintMatcher>(url_matcher));
+    url_prefiltered_.push_back(url_prefiltered);
+  }
+
+  for (int p = 0; p < 2; ++p) {
+    CompiledRules* compiled = &compiled_rules_[p];
+    if (!compiled->methods.Load(in, num_rules) ||
+        !compiled->urls.Load(in, num_rules)) {
+      return false;
+    }
+    for (int m = 0; m < ClassificationRule::NUM_METHODS; ++m) {
+      if (!in->ReadVector(&compiled->other_urls[m])) {
+        return false;
+      }
+      for (uint i = 0; i < compiled->other_urls[m].size(); ++i) {
+        if (compiled->other_urls[m][i] < 0 ||
+            compiled->other_urls[m][i] >= static_cast<int>(num_rules)) {
+          return false;
+        }
+      }
+    }
+    if (!compiled->url_literals.Load(in, num_rules)) {
+      return false;
+    }
+  }
+  compile_size_rules();
+  compiled_ = true;
+  return true;
+}
+
+void Classifier::LogStats() {
+  LOG(INFO, "Classifier: url prefilter avoided %ld regexp evaluations, and "
+            "let %ld through.",
+      static_cast<long>(Acquire_Load(&prefilter_misses_)),
+      static_cast<long>(Acquire_Load(&prefilter_hits_)));
+  if (cache_.get()) {
+    int64 hits, misses;
+    cache_->GetStats(&hits, &misses);
+    LOG(INFO, "Classifier: cache has %d/%d entries, %lld hits and %lld "
+              "misses (%.1f%% hit rate).",
+        cache_->size(), cache_->capacity(), static_cast<long long>(hits),
+        static_cast<long long>(misses),
+        hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+  }
+}
+
 int32 Classifier::get_classification(ClassificationRule::Protocol protocol,
-                                     const string& method,
-                                     const string& url) {
+                                     const StringPiece& method,
+                                     const StringPiece& url,
+                                     const StringPiece& host_header) {
+  // The host is only parsed when some rule needs it.
+  StringPiece host;
+  if (host_rules_ && !ParseUrlHost(url, &host)) {
+    ParseHostHeader(host_header, &host);
+  }
+
+  int32 mark;
+  if (cache_.get() && cache_->Lookup(protocol, method, url, host, &mark)) {
+    return mark;
+  }
+
+  mark = get_rules_classification(protocol, method, url, host);
+  if (cache_.get()) {
+    cache_->Insert(protocol, method, url, host, mark);
+  }
+  return mark;
+}
+
+int32 Classifier::get_oversize_classification(
+    const StringPiece& method, const StringPiece& partial_url) const {
+  ClassificationRule::Method plain_method =
+      ClassificationRule::get_method(method);
+  const CompiledRules& compiled = compiled_rules_[ClassificationRule::HTTP];
+  int rule = (compiled_ ? compiled.size_rules[plain_method] :
+              find_size_rule(ClassificationRule::HTTP, plain_method));
+  if (rule < 0 ||
+      !HasHttpUrlLength(partial_url, rules_[rule]->url_min_length())) {
+    return kNoMatchYet;
+  }
+  return rules_[rule]->mark();
+}
+
+int Classifier::find_size_rule(ClassificationRule::Protocol protocol,
+                               ClassificationRule::Method method) const {
+  for (uint r = 0; r < rules_.size(); ++r) {
+    const ClassificationRule* rule = rules_[r];
+    if (rule->protocol() != protocol ||
+        (rule->plain_method() != ClassificationRule::METHOD_OTHER &&
+         rule->plain_method() != method)) {
+      continue;
+    }
+
+    // The rule may match the request: it decides iff the url size is its
+    // only constraint (but the plain method of the request).
+    bool size_only = rule->url_min_length() > 0 &&
+        rule->url_pattern().empty() && rule->url_prefix().empty() &&
+        rule->url_suffix().empty() && rule->url_host().empty() &&
+        !rule->url_list() &&
+        (rule->method_pattern().empty() ||
+         rule->plain_method() != ClassificationRule::METHOD_OTHER);
+    return size_only ? static_cast<int>(r) : -1;
+  }
+  return -1;
+}
+
+void Classifier::compile_size_rules() {
+  for (int p = 0; p < 2; ++p) {
+    for (int m = 0; m < ClassificationRule::NUM_METHODS; ++m) {
+      compiled_rules_[p].size_rules[m] = find_size_rule(
+          static_cast<ClassificationRule::Protocol>(p),
+          static_cast<ClassificationRule::Method>(m));
+    }
+  }
+}
+
+int32 Classifier::get_rules_classification(
+    ClassificationRule::Protocol protocol,
+    const StringPiece& method,
+    const StringPiece& url,
+    const StringPiece& host) {
+  if (compiled_) {
+    return get_compiled_classification(protocol, method, url, host);
+  }
+
   for (vector<ClassificationRule*>::const_iterator it = rules_.begin();
        it != rules_.end(); ++it) {
-    if ((*it)->match(protocol, method, url)) {
+    if ((*it)->match(protocol, method, url, host)) {
       return (*it)->mark();
     }
   }
 
   return kNoMatch;
 }
+
+int32 Classifier::get_compiled_classification(
+    ClassificationRule::Protocol protocol,
+    const StringPiece& method,
+    const StringPiece& url,
+    const StringPiece& host) {
+  const CompiledRules& compiled = compiled_rules_[protocol];
+  const ClassificationRule::Method plain_method =
+      ClassificationRule::get_method(method);
+  const vector<int>& other_urls = compiled.other_urls[plain_method];
+  vector<int> urls, methods, literals;
+  compiled.urls.Match(url.data(), url.size(), &urls);
+  compiled.methods.Match(method.data(), method.size(), &methods);
+  bool literals_matched = false;
+  int prefilter_hits = 0, prefilter_misses = 0;
+  int32 mark = kNoMatch;
+
+  // Candidate rules are the rules whose url matched the automaton, and the
+  // rules of the request's method bucket whose url is not matched by the
+  // automaton; they are checked in increasing order, so that the first
+  // matching rule wins.
+  vector<int>::const_iterator matched = urls.begin();
+  vector<int>::const_iterator other = other_urls.begin();
+  while (matched != urls.end() || other != other_urls.end()) {
+    int r;
+    if (other == other_urls.end() ||
+        (matched != urls.end() && *matched < *other)) {
+      r = *matched++;
+    } else {
+      r = *other++;
+    }
+
+    const ClassificationRule* rule = rules_[r];
+    if (method_matchers_[r] == MATCHER_PLAIN &&
+        rule->plain_method() != plain_method) {
+      continue;
+    }
+    if (rule->has_url_predicates() && !rule->match_url_predicates(url, host)) {
+      continue;
+    }
+    if (url_prefiltered_[r]) {
+      // The url literals are only looked for once a rule needs them.
+      if (!literals_matched) {
+        compiled.url_literals.Match(url.data(), url.size(), &literals);
+        literals_matched = true;
+      }
+      if (!std::binary_search(literals.begin(), literals.end(), r)) {
+        prefilter_misses++;
+        continue;
+      }
+      prefilter_hits++;
+    }
+    if (url_matchers_[r] == MATCHER_REGEX &&
+        !boost::regex_match(url.begin(), url.end(), *rule->url_regex())) {
+      continue;
+    }
+    if (method_matchers_[r] == MATCHER_AUTOMATON &&
+        !std::binary_search(methods.begin(), methods.end(), r)) {
+      continue;
+    }
+    if (method_matchers_[r] == MATCHER_REGEX &&
+        !boost::regex_match(method.begin(), method.end(),
+                            *rule->method_regex())) {
+      continue;
+    }
+    mark = rule->mark();
+    break;
+  }
+
+  if (prefilter_hits) {
+    AtomicIncrement(&prefilter_hits_, prefilter_hits);
+  }
+  if (prefilter_misses) {
+    AtomicIncrement(&prefilter_misses_, prefilter_misses);
+  }
+  return mark;
+}
@@ -18,9 +18,18 @@
 #ifndef CLASSIFIER_H__
 #define CLASSIFIER_H__
 
+#include "base/atomicops.h"
 #include "base/basictypes.h"
+#include "base/logging.h"
 #include "base/scoped_ptr.h"
+#include "base/stringpiece.h"
 #include "base/util.h"
+#include "classification_cache.h"
+#include "http_stream.h"
+#include "literal_prefilter.h"
+#include "protocol_parser.h"
+#include "regex_set.h"
+#include "url_list.h"
 #include <vector>
 #include <boost/regex.hpp>
 
@@ -28,6 +37,8 @@ using std::string;
 using std::vector;
 class Connection;
 class Classifier;
+class Deserializer;
+class Serializer;
 
 enum ConnectionProtocol {
   UNKNOWN = 0,
@@ -45,17 +56,44 @@ enum ClientServerMode {
 // Classifies a connection based on its ingress & egress buffer. It works
 // directly with the Connection object, and uses its buffers to realize the
 // classification.
+// Every request of persistent (keep-alive, possibly pipelined) HTTP
+// connections is classified, until one matches a rule: the mark of the
+// connection is then definitive. Until then, the connection has no definitive
+// mark, hence neither the classified cache nor the saved connmark apply to it;
+// connections of a protocol without any rule are definitively unmatched at
+// once.
 class ConnectionClassifier {
  public:
+  // Maximal number of pipelined requests whose responses are tracked,
+  // maximal length of the methods of incomplete requests lines checked for
+  // oversize urls, and maximal number of body bytes skipped at once.
+  static const uint32 kMaxPendingRequests = 32;
+  static const uint32 kMaxMethodLength = 16;
+  static const uint32 kMaxSkippedBytes = 1 << 30;
+
   // Constructs the object from the Classifier (the url classifier), and a
   // conntrack Connection.
+  // The ConnectionClassifier holds a reference on the Classifier.
   ConnectionClassifier(Classifier* classifier, Connection* connection);
+  ~ConnectionClassifier();
+
+  // ConnectionClassifiers are allocated from a dedicated ObjectPool.
+  static void* operator new(size_t size);
+  static void operator delete(void* connection_classifier);
 
-  // Classification mark and buffer hints accesors.
+  // Classification mark and buffer hints accesors. The hints are the number
+  // of bytes of each direction the classifier is done with; they can be
+  // larger than the number of bytes received so far, when the next bytes are
+  // not needed (eg. http bodies).
   int32 classification_mark() const { return mark_; }
   int32 egress_hint() const { return egress_buffer_hint_; }
   int32 ingress_hint() const { return ingress_buffer_hint_; }
 
+  // Returns true iff the classifier still looks at the bytes of the egress
+  // (resp. ingress) direction; otherwise, they only have to be counted.
+  bool egress_needed() const { return egress_needed_; }
+  bool ingress_needed() const { return ingress_needed_; }
+
   // Updates the ConnectionClassifier status with new data added to the
   // Connection's buffers. Returns true iff the classification is definitive.
   bool update();
@@ -65,7 +103,8 @@ class ConnectionClassifier {
   void reverse_connection();
 
  private:
-  // Tries to guess the protocol in the two in/egress buffers.
+  // Tries to guess the protocol from the bytes added to the two in/egress
+  // buffers since the last call.
   // Returns UNKNOWN if unknown, HTTP/FTP if http/ftp, or OTHER if the
   // connection was identified as not using in http/ftp protocol.
   ConnectionProtocol guess_protocol();
@@ -75,13 +114,16 @@ class ConnectionClassifier {
   void update_http();
 
   // HTTP/FTP protocol matcher internal functions.
+  // The line parsers work in place: the @p method and @p url point into the
+  // @p line, itself pointing into the connection buffer.
   void ftp_handle_buffer(bool ingress);
-  bool ftp_parse_request_line(const string& line,
-                              string* method, string* url) const;
-  void http_handle_buffer(bool ingress);
-  bool http_parse_request_line(const string& line,
-                               string* method, string* url) const;
-  bool http_parse_response_line(const string& line) const;
+  bool ftp_parse_request_line(const StringPiece& line,
+                              StringPiece* method, StringPiece* url) const;
+  void http_handle_requests(bool ingress);
+  void http_check_oversize_request(const StringPiece& partial_line);
+  void http_handle_responses(bool ingress);
+  bool http_parse_request_line(const StringPiece& line,
+                               StringPiece* method, StringPiece* url) const;
 
   // Returns the start position in the buffer for the given buffer hint.
   // Returns the real buffer length.
@@ -94,14 +136,21 @@ class ConnectionClassifier {
   Classifier* classifier_;
   Connection* connection_;
 
-  // Stores the current known protocol (if any).
+  // Stores the current known protocol (if any), and the protocol detectors
+  // of the in/egress directions.
   ConnectionProtocol connection_type_;
+  ProtocolDetector egress_detector_;
+  ProtocolDetector ingress_detector_;
 
   // Buffer hints, used to reduce memory footprint in conntrack.h's Connection.
   // Also used to know up to which point the buffer was processed.
   uint32 egress_buffer_hint_;
   uint32 ingress_buffer_hint_;
 
+  // Whether the bytes of each direction are still looked at.
+  bool egress_needed_;
+  bool ingress_needed_;
+
   // Connection direction hint, and classifier state.
   ClientServerMode direction_hint_;
 
@@ -109,6 +158,17 @@ class ConnectionClassifier {
   bool classified_;
   int32 mark_;
 
+  // HTTP framing of the requests and of the responses (which are only
+  // tracked to skip their bodies, and to find out when the connection becomes
+  // a tunnel), and requests not answered yet: bit i of the masks is set iff
+  // the i-th oldest one is a HEAD (resp. CONNECT) request.
+  HttpStream http_requests_;
+  HttpStream http_responses_;
+  bool http_responses_tracked_;
+  uint32 http_pending_;
+  uint32 http_pending_head_;
+  uint32 http_pending_connect_;
+
   DISALLOW_EVIL_CONSTRUCTORS(ConnectionClassifier);
 };
 
@@ -123,37 +183,114 @@ class ClassificationRule {
     FTP
   };
 
+  // Request methods by which plain method constraints are indexed
+  // (METHOD_OTHER standing for all the other methods).
+  enum Method {
+    METHOD_OTHER,
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_OPTIONS,
+    METHOD_TRACE,
+    METHOD_CONNECT,
+    METHOD_RETR,
+    METHOD_STOR,
+    METHOD_STOU,
+    METHOD_APPE,
+    METHOD_REST,
+    NUM_METHODS
+  };
+
+  // Returns the Method of the (case-insensitive) @p method.
+  static Method get_method(const StringPiece& method);
+
   // Initializes a new rule for the @p protocol, with the @p mark as
   // classification mark in case of match.
   ClassificationRule(Protocol protocol, int32 mark);
 
-  // Classification mark accessor.
+  // Protocol and classification mark accessors.
+  Protocol protocol() const { return protocol_; }
   int32 mark() const { return mark_; }
 
+  // Constraints accessors (NULL if the rule has no such constraint, or if its
+  // regexp is not compiled, and empty patterns if the rule has no such
+  // constraint). The plain method is METHOD_OTHER unless the rule's method
+  // constraint is a plain method other than METHOD_OTHER.
+  const boost::regex* method_regex() const { return method_.get(); }
+  const boost::regex* url_regex() const { return url_.get(); }
+  const string& method_pattern() const { return method_pattern_; }
+  const string& url_pattern() const { return url_pattern_; }
+  Method plain_method() const { return plain_method_; }
+
+  // Url predicates accessors (0 or empty if the rule has no such predicate).
+  uint32 url_min_length() const { return url_min_length_; }
+  const string& url_prefix() const { return url_prefix_; }
+  const string& url_suffix() const { return url_suffix_; }
+  const string& url_host() const { return url_host_; }
+  const UrlList* url_list() const { return url_list_.get(); }
+  bool has_url_predicates() const {
+    return url_min_length_ > 0 || !url_prefix_.empty() ||
+        !url_suffix_.empty() || !url_host_.empty() || url_list_.get();
+  }
+
   // Classification constraints mutators.
   void set_method_regex(const string& method) {
-    initialize_regex(method_, method);
+    method_pattern_ = method;
+    initialize_regex(method_, method_pattern_);
+    plain_method_ = METHOD_OTHER;
   }
   void set_method_plain(const string& method) {
-     initialize_regex(method_, StringPrintf("^%s$", method.c_str()));
+     method_pattern_ = StringPrintf("^%s$", method.c_str());
+     initialize_regex(method_, method_pattern_);
+     plain_method_ = get_method(method);
   }
   void set_url_regex(const string& url) {
-     initialize_regex(url_, url);
+     url_pattern_ = url;
+     initialize_regex(url_, url_pattern_);
   }
   void set_url_maxsize(int max_size) {
     if (max_size < 1) {
       LOG(FATAL, "ClassificationRule only acceps max_size urls of 1 and more.");
     }
-    initialize_regex(url_, StringPrintf("^.{%d,}$", max_size + 1));
+    url_min_length_ = max_size + 1;
   }
-
-  // Returns true iff the @p protocol/method/url are matching the rule's
-  // constraints.
-  bool match(Protocol protocol, const string& method, const string& url);
+  void set_url_prefix(const string& prefix) { url_prefix_ = prefix; }
+  void set_url_suffix(const string& suffix) { url_suffix_ = suffix; }
+  void set_url_host(const string& host) { url_host_ = host; }
+  // Maps the compiled url list @p path. Returns false on failure.
+  bool set_url_list(const string& path);
+
+  // Returns true iff the @p protocol/method/url, requested from the @p host
+  // (empty if unknown), are matching the rule's constraints. The rule's
+  // regexps must be compiled.
+  bool match(Protocol protocol, const StringPiece& method,
+             const StringPiece& url, const StringPiece& host);
+
+  // Returns true iff the @p url, requested from the @p host, satisfies the url
+  // predicates of the rule (all its url constraints but the regexp). The
+  // predicates are case-insensitive, as the regexps, and are evaluated from
+  // the cheapest to the most expensive.
+  bool match_url_predicates(const StringPiece& url,
+                            const StringPiece& host) const;
 
   // Returns the rule in ASCII format.
   string str() const;
 
+  // Returns true iff the @p text is a valid regular expression for the rule
+  // constraints (the mutators call LOG(FATAL) on invalid regexps).
+  static bool is_valid_regex(const string& text);
+
+  // Saves the rule to @p out, or loads a rule from @p in (returning NULL if
+  // the data is invalid). The regexps of loaded rules are not compiled.
+  void Save(Serializer* out) const;
+  static ClassificationRule* Load(Deserializer* in);
+
+  // Compiles the method and/or url regexps of a loaded rule. Returns false if
+  // they are not valid.
+  bool compile_regexes(bool method, bool url);
+
  private:
   // Initialises the @p regexp with the @p text, calling LOG(FATAL) in case
   // of error.
@@ -163,15 +300,30 @@ class ClassificationRule {
   Protocol protocol_;
   int32 mark_;
 
-  // Contraints.
+  // Contraints (the patterns being the texts of the regexps).
+  string method_pattern_;
+  string url_pattern_;
   scoped_ptr<boost::regex> method_;
   scoped_ptr<boost::regex> url_;
+  Method plain_method_;
+
+  // Url predicates, evaluated before the url regexp: urls must be at least
+  // url_min_length_ long (url_maxsize + 1), start with url_prefix_, end with
+  // url_suffix_, be requested from url_host_, and be matched by url_list_.
+  uint32 url_min_length_;
+  string url_prefix_;
+  string url_suffix_;
+  string url_host_;
+  scoped_ptr<UrlList> url_list_;
 
   DISALLOW_EVIL_CONSTRUCTORS(ClassificationRule);
 };
 
 // The global classifier objects, which holds the list of active classification
-// rules. Supposed to be used a singleton.
+// rules. A single Classifier is active at a time, but a replaced Classifier
+// (cf. ConnTrack::ReplaceClassifier) stays alive as long as some
+// ConnectionClassifiers use it: it is reference counted, and deleted on its
+// last Release().
 class Classifier {
  public:
   // Special meaning classification marks.
@@ -179,33 +331,163 @@ class Classifier {
   static const int32 kNoMatchYet = 1;
   static const int32 kNoMatch = 2;
 
+  // The new Classifier holds a single reference, owned by the caller.
   Classifier();
   ~Classifier();
 
+  // Reference counting.
+  void Acquire() { AtomicIncrement(&ref_counter_, 1); }
+  void Release() {
+    if (AtomicIncrement(&ref_counter_, -1) == 0) {
+      delete this;
+    }
+  }
+
   // Rule accessor.
   const vector<ClassificationRule*>& rules() const { return rules_; }
 
+  // Returns true iff some rule matches requests of the @p protocol.
+  bool has_rules(ClassificationRule::Protocol protocol) const {
+    return protocol_rules_[protocol];
+  }
+
   // Adds the @p rule to the list of classifications rules. The callee becomes
-  // owner of the pointer.
+  // owner of the pointer. Rules can't be added once compiled.
   void add_rule(ClassificationRule* rule) {
+    CHECK(!compiled_);
     rules_.push_back(rule);
+    host_rules_ |= !rule->url_host().empty() || rule->url_list();
+    protocol_rules_[rule->protocol()] = true;
+    if (cache_.get()) {
+      cache_->Clear();
+    }
+  }
+
+  // Enables a cache of the last @p size classification results (or disables
+  // it if @p size is 0). Must be called before the first classification.
+  void set_cache_size(int size) {
+    cache_.reset(size > 0 ? new ClassificationCache(size) : NULL);
   }
 
+  // Compiles the rules. With @p use_automata, the method and url regexps are
+  // compiled into RegexSets, so that get_classification() matches all the
+  // rules at once instead of one by one (regexps the RegexSets can't handle
+  // are still matched with boost::regex). With @p use_prefilter, url regexps
+  // matched with boost::regex are only evaluated if the url contains their
+  // required literal.
+  void Compile(bool use_automata, bool use_prefilter);
+
+  // Compilation options (cf. Compile()).
+  bool compiled() const { return compiled_; }
+  bool use_automata() const { return use_automata_; }
+  bool use_prefilter() const { return use_prefilter_; }
+
+  // Saves the compiled classifier (its rules, automata and prefilters) to
+  // @p out, or loads it from @p in into an empty classifier, which is then
+  // compiled. Only the url and method regexps which are not matched by the
+  // automata are compiled by Load(). Returns false if the data is invalid.
+  void Save(Serializer* out) const;
+  bool Load(Deserializer* in);
+
+  // Logs the prefilter and cache statistics.
+  void LogStats();
+
   // Returns a new ConnectionClassifier object, initialized from the @p
   // Connection object. Caller becomes responsible of the object destruction.
   ConnectionClassifier* get_connection_classifier(Connection* connection) {
     return new ConnectionClassifier(this, connection);
   }
 
-  // Returns the classification mark for the @p protocol, @p method, and @p url.
-  // Returns kNoMatch if no match is found.
+  // Returns the classification mark for the @p protocol, @p method, and @p url
+  // (from the cache if possible). The request's host is the host of the @p url
+  // if it is absolute, or else the @p host_header (the value of the Host
+  // header of http requests, if any). Returns kNoMatch if no match is found.
   int32 get_classification(ClassificationRule::Protocol protocol,
-                           const string& method,
-                           const string& url);
+                           const StringPiece& method,
+                           const StringPiece& url,
+                           const StringPiece& host_header);
+
+  // Returns the classification mark of an http request of the @p method whose
+  // request line is not complete yet (@p partial_url being what was received
+  // after the method), if it is already known: when the first rule which can
+  // match the request only limits the url size, and the url is already too
+  // long. Returns kNoMatchYet otherwise.
+  int32 get_oversize_classification(const StringPiece& method,
+                                    const StringPiece& partial_url) const;
 
  private:
-  // List of rules used for classification.
+  // How the method or url constraint of a compiled rule is matched.
+  enum ConstraintMatcher {
+    MATCHER_NONE,        // No constraint.
+    MATCHER_AUTOMATON,   // By the RegexSet of the rule's protocol.
+    MATCHER_REGEX,       // By the rule's boost::regex.
+    MATCHER_PLAIN        // By the rule's plain method.
+  };
+
+  // Compiled rules of a protocol. Rules are identified by their index.
+  struct CompiledRules {
+    RegexSet methods;
+    RegexSet urls;
+
+    // Rules whose url constraint is not matched by the urls automaton, and
+    // which can match requests of a method (indexed by Method), in increasing
+    // order; they are candidates for all urls.
+    vector<int> other_urls[ClassificationRule::NUM_METHODS];
+
+    // Required literals of the url regexps matched with boost::regex.
+    LiteralPrefilter url_literals;
+
+    // First rule which can match requests of a method (indexed by Method),
+    // if it only has an url_maxsize constraint, or -1.
+    int size_rules[ClassificationRule::NUM_METHODS];
+  };
+
+  // Returns the first rule of the @p protocol which can match requests of
+  // the @p method, if it only has an url_maxsize constraint, or -1.
+  int find_size_rule(ClassificationRule::Protocol protocol,
+                     ClassificationRule::Method method) const;
+
+  // Computes the size_rules of the compiled rules.
+  void compile_size_rules();
+
+  // Returns the classification mark of a request from the @p host using the
+  // rules, one by one or compiled.
+  int32 get_rules_classification(ClassificationRule::Protocol protocol,
+                                 const StringPiece& method,
+                                 const StringPiece& url,
+                                 const StringPiece& host);
+  int32 get_compiled_classification(ClassificationRule::Protocol protocol,
+                                    const StringPiece& method,
+                                    const StringPiece& url,
+                                    const StringPiece& host);
+
+  // List of rules used for classification, whether some of them match the
+  // host of the requests (which is otherwise left out of the cache keys), and
+  // whether some of them match each protocol.
   vector<ClassificationRule*> rules_;
+  bool host_rules_;
+  bool protocol_rules_[2];
+
+  // Compiled rules (indexed by protocol), and how each rule's constraints
+  // are matched (indexed by rule).
+  bool compiled_;
+  bool use_automata_;
+  bool use_prefilter_;
+  CompiledRules compiled_rules_[2];
+  vector<ConstraintMatcher> method_matchers_;
+  vector<ConstraintMatcher> url_matchers_;
+
+  // Rules whose url regexp is prefiltered (indexed by rule), and number of
+  // url regexp evaluations done (hits) and avoided (misses) by the prefilter.
+  vector<bool> url_prefiltered_;
+  AtomicWord prefilter_hits_;
+  AtomicWord prefilter_misses_;
+
+  // Cache of the classification results (NULL if disabled).
+  scoped_ptr<ClassificationCache> cache_;
+
+  // Number of references on the Classifier.
+  AtomicWord ref_counter_;
 
   DISALLOW_EVIL_CONSTRUCTORS(Classifier);
 };
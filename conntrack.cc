@@ -18,85 +18,108 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-#include "base/googleinit.h"
 #include "base/logging.h"
-#include "base/util.h"
 #include "classifier.h"
 #include "conntrack.h"
+#include "object_pool.h"
 #include "packet.h"
-#include <set>
 #include <arpa/inet.h>
 #include <sys/time.h>
-
-using std::set;
+#include <unistd.h>
 
 //
-// Connection tracking key creation helpers.
+// Walltime helper.
 //
-static const char* kProtoNames[IPPROTO_MAX];
-
-// Initializes the protocol-to-name conversion table.
-void kProtoNames_initializer() {
-  for (int i = 0; i < IPPROTO_MAX; ++i) {
-    kProtoNames[i] = NULL;
-  }
-
-  kProtoNames[IPPROTO_TCP] = "tcp";
-  kProtoNames[IPPROTO_UDP] = "udp";
-}
-REGISTER_MODULE_INITIALIZER(kProtoNames, kProtoNames_initializer());
+static double WallTime() {
+  struct timeval result;
+  gettimeofday(&result, NULL);
 
-// Returns a string made from the @p protocol number. This function is NOT
-// re-entrant.
-static char protocol_buffer__[64];
-const char* sprintf_protocol(uint8 proto) {
-  if (kProtoNames[proto] == NULL) {
-    snprintf(protocol_buffer__, sizeof(protocol_buffer__), "l4-unk-%d", proto);
-    return protocol_buffer__;
-  }
-  return kProtoNames[proto];
+  return double(result.tv_sec) + double(result.tv_usec) / 1000000.0;
 }
 
-// Returns a string made from the @p ipv4/ipv6 address.
-string sprintf_ipv4_address(uint32 address) {
-  in_addr ipv4_address;
-  ipv4_address.s_addr = address;
+//
+// Implementation of the Connection class.
+//
+static ObjectPool connection_pool("Connection", sizeof(Connection));
 
-  return inet_ntoa(ipv4_address);
+void* Connection::operator new(size_t size) {
+  CHECK(size == sizeof(Connection));
+  return connection_pool.Allocate();
 }
 
-string sprintf_ipv6_address(const void* address) {
-  in6_addr ipv6_address;
-  memcpy(&ipv6_address, address, sizeof(struct in6_addr));
+void Connection::operator delete(void* connection) {
+  connection_pool.Free(connection);
+}
 
-  char tmp[INET6_ADDRSTRLEN];
-  if (!inet_ntop(AF_INET6, &ipv6_address, tmp, sizeof(tmp))) {
-    return "(null)";
+// Process-wide buffer budget: connections holding buffers are linked from the
+// oldest to the newest one, in one list per class of storage size. Protected
+// by the lock.
+struct BufferBudget {
+  BufferBudget()
+    : lock(), budget(0), eviction_mark(Classifier::kNoMatch), bytes(0),
+      peak_bytes(0), connections(0), evictions(0) {
+    for (int c = 0; c < Connection::kNumBudgetClasses; ++c) {
+      oldest[c] = newest[c] = NULL;
+    }
   }
 
-  return tmp;
+  Mutex lock;
+  int64 budget;
+  int32 eviction_mark;
+  int64 bytes;
+  int64 peak_bytes;
+  int connections;
+  int64 evictions;
+  Connection* oldest[Connection::kNumBudgetClasses];
+  Connection* newest[Connection::kNumBudgetClasses];
+};
+static BufferBudget buffer_budget;
+
+// Returns the budget class of a storage of @p bytes (> 0): the index of its
+// highest bit.
+static inline int get_budget_class(uint32 bytes) {
+  return 31 - __builtin_clz(bytes);
 }
 
-//
-// Walltime helper.
-//
-static double WallTime() {
-  struct timeval result;
-  gettimeofday(&result, NULL);
+void Connection::set_buffer_budget(int64 budget, int32 eviction_mark) {
+  CHECK(budget >= 0);
+  MutexLock ml(&buffer_budget.lock);
+  buffer_budget.budget = budget;
+  buffer_budget.eviction_mark = eviction_mark;
+}
 
-  return double(result.tv_sec) + double(result.tv_usec) / 1000000.0;
+void Connection::GetBufferStats(BufferStats* stats) {
+  MutexLock ml(&buffer_budget.lock);
+  stats->budget = buffer_budget.budget;
+  stats->bytes = buffer_budget.bytes;
+  stats->peak_bytes = buffer_budget.peak_bytes;
+  stats->connections = buffer_budget.connections;
+  stats->evictions = buffer_budget.evictions;
+}
+
+void Connection::LogBufferStats() {
+  BufferStats stats;
+  GetBufferStats(&stats);
+  LOG(INFO, "Buffers: %d kB held by %d connections (peak %d kB, budget %d kB), "
+            "%lld connections evicted.",
+      static_cast<int>(stats.bytes >> 10), stats.connections,
+      static_cast<int>(stats.peak_bytes >> 10),
+      static_cast<int>(stats.budget >> 10),
+      static_cast<long long>(stats.evictions));
 }
 
-//
-// Implementation of the Connection class.
-//
 Connection::Connection(bool conntracked, Classifier* classifier)
   : conntracked_(conntracked),
+    orig_endpoint_(0),
     classification_mark_(Classifier::kNoMatchYet),
+    definitive_mark_(false), connmark_saved_(false),
     packets_egress_(0), packets_ingress_(0),
     bytes_egress_(0), bytes_ingress_(0),
-    buffer_egress_(), buffer_ingress_(),
-    last_packet_(-1),
+    buffer_egress_(kMaxBufferSize), buffer_ingress_(kMaxBufferSize),
+    skip_egress_(0), skip_ingress_(0),
+    budget_bytes_(0), budget_older_(NULL), budget_newer_(NULL),
+    buffers_accounted_(false),
+    last_packet_(WallTime()),
     ref_counter_(1), content_lock_() {
   Acquire();
   if (classifier) {
@@ -104,11 +127,20 @@ Connection::Connection(bool conntracked, Classifier* classifier)
   } else {
     classifier_ = NULL;
     classification_mark_ = Classifier::kNoMatch;
-    definitive_mark_ = true;
+    Release_Store(&definitive_mark_, true);
   }
 }
 
 Connection::~Connection() {
+  // The connection must leave the budget list before anything else, since it
+  // may be evicted until then (the budget lock orders the eviction with the
+  // destruction).
+  if (buffers_accounted_) {
+    MutexLock ml(&buffer_budget.lock);
+    if (budget_bytes_ > 0) {
+      unlink_buffers_locked();
+    }
+  }
   if (classifier_) {
     delete classifier_;
     classifier_ = NULL;
@@ -131,20 +163,38 @@ void Connection::update_packet(bool orig, const char* data, int32 data_len) {
   CHECK(data_len >= 0);
 
   // If classification is definitive, stops the packet processing.
-  if (definitive_mark_) {
+  if (definitive()) {
     return;
   }
 
-  // Appends data to the ingress/egress buffers.
+  // Appends data to the ingress/egress buffers, but for the bytes the
+  // classifier doesn't need, which are only counted. If a buffer would grow
+  // above the threshold, kills the classification instead.
+  StreamBuffer* buffer;
+  uint32 stored;
   if (orig) {
     packets_egress_++;
     bytes_egress_ += data_len;
-    buffer_egress_.append(data, data_len);
+    stored = get_stored_length(classifier_->egress_needed(), data_len,
+                               &skip_egress_);
+    buffer = &buffer_egress_;
   } else {
     packets_ingress_++;
     bytes_ingress_ += data_len;
-    buffer_ingress_.append(data, data_len);
+    stored = get_stored_length(classifier_->ingress_needed(), data_len,
+                               &skip_ingress_);
+    buffer = &buffer_ingress_;
+  }
+  if (stored == 0) {
+    return;
+  }
+  if (buffer->size() + stored > kMaxBufferSize) {
+    classification_mark_ = Classifier::kNoMatch;
+    set_definitive_classification();
+    account_buffers();
+    return;
   }
+  buffer->Append(data + data_len - stored, stored);
 
   // Calls the classifier for status update; it returns the status of the
   // classification. If it is definitive, tears down the classifier.
@@ -152,37 +202,47 @@ void Connection::update_packet(bool orig, const char* data, int32 data_len) {
   classification_mark_ = classifier_->classification_mark();
   if (classified) {
     set_definitive_classification();
+    account_buffers();
     return;
   }
 
-  // Asks the classifier for buffer hints, and shrinks the buffer where needed.
-  uint32 hint_egress = classifier_->egress_hint();
-  uint32 hint_ingress = classifier_->ingress_hint();
-
-  if (hint_egress > (bytes_egress_ - buffer_egress_.size())) {
-    CHECK(hint_egress <= bytes_egress_);
-    int32 new_buffer_size = bytes_egress_ - hint_egress;
-    int32 new_buffer_start = buffer_egress_.size() - new_buffer_size;
-
-    string new_buffer(buffer_egress_.data() + new_buffer_start,
-                      new_buffer_size);
-    buffer_egress_.swap(new_buffer);
+  // Asks the classifier for buffer hints, and drops the bytes before the
+  // hints (without copying the remaining bytes), or skips the next bytes
+  // when the hints are past the received bytes.
+  apply_hint(classifier_->egress_hint(), bytes_egress_, &buffer_egress_,
+             &skip_egress_);
+  apply_hint(classifier_->ingress_hint(), bytes_ingress_, &buffer_ingress_,
+             &skip_ingress_);
+
+  // Releases the storage of the emptied buffers, so that idle connections
+  // (e.g. between keep-alive requests) don't hold any of the buffer budget.
+  if (buffer_egress_.empty()) {
+    buffer_egress_.Clear();
+  }
+  if (buffer_ingress_.empty()) {
+    buffer_ingress_.Clear();
   }
-  if (hint_ingress > (bytes_ingress_ - buffer_ingress_.size())) {
-    CHECK(hint_ingress <= bytes_ingress_);
-    int32 new_buffer_size = bytes_ingress_ - hint_ingress;
-    int32 new_buffer_start = buffer_ingress_.size() - new_buffer_size;
+  account_buffers();
+}
 
-    string new_buffer(buffer_ingress_.data() + new_buffer_start,
-                      new_buffer_size);
-    buffer_ingress_.swap(new_buffer);
+uint32 Connection::get_stored_length(bool needed, uint32 length,
+                                     uint32* skip) {
+  if (!needed) {
+    return 0;
   }
+  uint32 skipped = std::min(*skip, length);
+  *skip -= skipped;
+  return length - skipped;
+}
 
-  // If buffers grow above a threshold, kill the classification.
-  if (buffer_ingress_.size() > kMaxBufferSize ||
-      buffer_egress_.size() > kMaxBufferSize) {
-    classification_mark_ = Classifier::kNoMatch;
-    set_definitive_classification();
+void Connection::apply_hint(uint32 hint, uint32 bytes, StreamBuffer* buffer,
+                            uint32* skip) {
+  uint32 buffer_start = bytes - buffer->size();
+  if (hint > bytes) {
+    buffer->Consume(buffer->size());
+    *skip = hint - bytes;
+  } else if (hint > buffer_start) {
+    buffer->Consume(hint - buffer_start);
   }
 }
 
@@ -192,9 +252,82 @@ void Connection::set_definitive_classification() {
     classifier_ = NULL;
   }
 
-  buffer_ingress_.clear();
-  buffer_egress_.clear();
-  definitive_mark_ = true;
+  buffer_ingress_.Clear();
+  buffer_egress_.Clear();
+  Release_Store(&definitive_mark_, true);
+}
+
+void Connection::account_buffers() {
+  uint32 bytes = buffer_egress_.capacity() + buffer_ingress_.capacity();
+  if (bytes == budget_bytes_) {
+    return;
+  }
+
+  MutexLock ml(&buffer_budget.lock);
+  if (budget_bytes_ > 0) {
+    unlink_buffers_locked();
+  }
+  if (bytes == 0) {
+    return;
+  }
+  int budget_class = get_budget_class(bytes);
+  budget_older_ = buffer_budget.newest[budget_class];
+  budget_newer_ = NULL;
+  if (budget_older_) {
+    budget_older_->budget_newer_ = this;
+  } else {
+    buffer_budget.oldest[budget_class] = this;
+  }
+  buffer_budget.newest[budget_class] = this;
+  buffer_budget.connections++;
+  buffer_budget.bytes += bytes;
+  buffer_budget.peak_bytes = std::max(buffer_budget.peak_bytes,
+                                      buffer_budget.bytes);
+  budget_bytes_ = bytes;
+  buffers_accounted_ = true;
+
+  if (buffer_budget.budget > 0 && buffer_budget.bytes > buffer_budget.budget) {
+    evict_connections_locked();
+  }
+}
+
+void Connection::unlink_buffers_locked() {
+  int budget_class = get_budget_class(budget_bytes_);
+  if (budget_older_) {
+    budget_older_->budget_newer_ = budget_newer_;
+  } else {
+    buffer_budget.oldest[budget_class] = budget_newer_;
+  }
+  if (budget_newer_) {
+    budget_newer_->budget_older_ = budget_older_;
+  } else {
+    buffer_budget.newest[budget_class] = budget_older_;
+  }
+  budget_older_ = budget_newer_ = NULL;
+  buffer_budget.connections--;
+  buffer_budget.bytes -= budget_bytes_;
+  budget_bytes_ = 0;
+}
+
+void Connection::evict_connections_locked() {
+  // Victims are only try-locked: their owners may be waiting for the budget
+  // lock while holding them. Each connection is looked at once at most.
+  for (int budget_class = kNumBudgetClasses - 1;
+       budget_class >= 0 && buffer_budget.bytes > buffer_budget.budget;
+       --budget_class) {
+    Connection* victim = buffer_budget.oldest[budget_class];
+    while (victim && buffer_budget.bytes > buffer_budget.budget) {
+      Connection* newer = victim->budget_newer_;
+      if (victim != this && victim->content_lock_.TryLock()) {
+        victim->classification_mark_ = buffer_budget.eviction_mark;
+        victim->set_definitive_classification();
+        victim->unlink_buffers_locked();
+        victim->content_lock_.Unlock();
+        buffer_budget.evictions++;
+      }
+      victim = newer;
+    }
+  }
 }
 
 void Connection::reverse_connection() {
@@ -204,22 +337,35 @@ void Connection::reverse_connection() {
 
   std::swap(packets_egress_, packets_ingress_);
   std::swap(bytes_egress_, bytes_ingress_);
-  std::swap(buffer_egress_, buffer_ingress_);
+  std::swap(skip_egress_, skip_ingress_);
+  buffer_egress_.Swap(&buffer_ingress_);
 }
 
 //
 // Implementation of the ConnTrack class.
 //
-ConnTrack::ConnTrack(Classifier* classifier)
-    : classifier_(classifier),
-      connections_(),
-      connections_lock_(),
+ConnTrack::ConnTrack(Classifier* classifier, bool queue_conntrack,
+                     int classified_cache_size)
+    : classifier_(reinterpret_cast<AtomicWord>(classifier)),
+      reclaimer_(),
+      event_reader_(-1),
+      queue_conntrack_(queue_conntrack),
+      connections_(kConnectionShards,
+                   queue_conntrack ? 0 : classified_cache_size, &reclaimer_),
+      connections_by_id_(kConnectionShards,
+                         queue_conntrack ? classified_cache_size : 0,
+                         &reclaimer_),
       must_stop_(false),
-      last_gc_(-1) {
+      stats_interval_(0),
+      stats_requested_(false) {
+  set_lifetimes(kDefaultConntrackedLifetime, kDefaultUnconntrackedLifetime);
+
   // Sets up the conntrack events listener.
+  // In queue conntrack mode, NEW events are not needed.
   conntrack_event_handler_ = nfct_open(
       CONNTRACK,
-      NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_DESTROY);
+      queue_conntrack_ ? NF_NETLINK_CONNTRACK_DESTROY :
+          NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_DESTROY);
   if (!conntrack_event_handler_) {
     LOG(FATAL, "Unable to set up the conntrack event listener. "
                "Either you don't have root privileges, or there is no "
@@ -232,18 +378,36 @@ ConnTrack::~ConnTrack() {
     nfct_close(conntrack_event_handler_);
     conntrack_event_handler_ = NULL;
   }
+  if (classifier()) {
+    classifier()->Release();
+  }
+}
 
-  WriterMutexLock ml(&connections_lock_);
-  for (hash_map<string, Connection*>::iterator it = connections_.begin();
-       it != connections_.end(); ++it)  {
-    if (it->second != NULL) {
-      it->second->Destroy();
-    }
+// Reference of the ConnTrack on a replaced Classifier, retired through the
+// reclaimer, and released on deletion.
+struct RetiredClassifier {
+  explicit RetiredClassifier(Classifier* classifier)
+    : classifier(classifier) {}
+  ~RetiredClassifier() {
+    classifier->Release();
+  }
+
+  Classifier* classifier;
+};
+
+void ConnTrack::ReplaceClassifier(Classifier* classifier) {
+  Classifier* replaced = this->classifier();
+  Release_Store(&classifier_, reinterpret_cast<AtomicWord>(classifier));
+  if (replaced) {
+    reclaimer_.Retire(new RetiredClassifier(replaced));
   }
-  connections_.clear();
 }
 
 void ConnTrack::Run() {
+  // The event thread creates connections, hence reads the classifier; it is
+  // only online while processing an event.
+  event_reader_ = reclaimer_.RegisterReader();
+
   int result = nfct_callback_register(
       conntrack_event_handler_,
       static_cast<nf_conntrack_msg_type>(NFCT_T_NEW | NFCT_T_DESTROY),
@@ -270,78 +434,165 @@ void ConnTrack::Stop() {
   must_stop_ = true;
 }
 
-bool ConnTrack::has_connection(const string& key) {
-  ReaderMutexLock ml(&connections_lock_);
-  return connections_.find(key) != connections_.end();
+void ConnTrack::set_lifetimes(int conntracked_lifetime,
+                              int unconntracked_lifetime) {
+  connections_.set_lifetimes(conntracked_lifetime, unconntracked_lifetime);
+  connections_by_id_.set_lifetimes(conntracked_lifetime,
+                                   unconntracked_lifetime);
+}
+
+void ConnTrack::RunExpiration() {
+  // The expiration thread reads the classifier for the statistics, and is
+  // offline while sleeping. It also deletes the retired objects every second,
+  // so that replaced classifiers do not wait for kReclaimThreshold objects.
+  int reader = reclaimer_.RegisterReader();
+  int expired = 0;
+  for (int seconds = 1; !must_stop_; ++seconds) {
+    reclaimer_.Offline(reader);
+    sleep(1);
+    reclaimer_.Quiescent(reader);
+    reclaimer_.Collect();
+
+    time_t now = time(NULL);
+    expired += connections_.Tick(now, kExpirationBudget) +
+               connections_by_id_.Tick(now, kExpirationBudget);
+
+    if (stats_requested_ ||
+        (stats_interval_ > 0 && seconds % stats_interval_ == 0)) {
+      stats_requested_ = false;
+      LOG(INFO, "Conntrack: %d connections expired since last statistics.",
+          expired);
+      LogStats();
+      expired = 0;
+    }
+  }
+  reclaimer_.Offline(reader);
 }
 
-Connection* ConnTrack::get_connection(const string& key) {
-  ReaderMutexLock ml(&connections_lock_);
-  return get_connection_locked(key);
+void ConnTrack::LogStats() {
+  LOG(INFO, "Conntrack: %d connections by key, %d by conntrack id.",
+      static_cast<int>(connections_.size()),
+      static_cast<int>(connections_by_id_.size()));
+  if (classifier()) {
+    classifier()->LogStats();
+  }
+  Connection::LogBufferStats();
+  ObjectPool::LogStats();
 }
 
-Connection* ConnTrack::get_connection_or_create(
-    const pair<string, string>& keys, bool& direction_orig) {
-  WriterMutexLock ml(&connections_lock_);
+bool ConnTrack::has_connection(const FlowKey& key) {
+  return connections_.Has(key);
+}
 
-  Connection* connection = get_connection_locked(keys.first);
-  direction_orig = true;
-  if (!connection) {
-    connection = get_connection_locked(keys.second);
-    direction_orig = false;
+Connection* ConnTrack::get_connection(const FlowKey& key) {
+  return connections_.Get(key);
+}
 
-    if (!connection) {
-      LOG(INFO, "Got un-conntracked packet '%s'.", keys.first.c_str());
-      connections_[keys.first] = new Connection(false, classifier_);
-      connection = connections_[keys.first];
-      direction_orig = true;
-    }
+Connection* ConnTrack::get_connection_or_create(const FlowKey& key,
+                                                int source,
+                                                bool& direction_orig) {
+  bool created;
+  Connection* connection =
+      connections_.GetOrCreate(key, false, classifier(), &created);
+  if (created) {
+    LOG(INFO, "Got un-conntracked packet '%s'.", key.str(source).c_str());
+    connection->set_orig_endpoint(source);
   }
 
+  direction_orig = (connection->orig_endpoint() == source);
   return connection;
 }
 
-void ConnTrack::get_packet_keys(const Packet& packet,
-                                pair<string, string>* keys) {
-  string l3_conntrack_orig, l3_conntrack_repl;
-
-  if (packet.l3_protocol() == 4) {
-    SStringPrintf(
-        &l3_conntrack_orig,
-        "src=%s dst=%s",
-        sprintf_ipv4_address(packet.l3_ipv4_src()).c_str(),
-        sprintf_ipv4_address(packet.l3_ipv4_dst()).c_str());
-    SStringPrintf(
-        &l3_conntrack_repl,
-        "src=%s dst=%s",
-        sprintf_ipv4_address(packet.l3_ipv4_dst()).c_str(),
-        sprintf_ipv4_address(packet.l3_ipv4_src()).c_str());
-  } else if (packet.l3_protocol() == 6) {
-    SStringPrintf(
-        &l3_conntrack_orig,
-        "src=%s dst=%s",
-        sprintf_ipv6_address(packet.l3_ipv6_src()).c_str(),
-        sprintf_ipv6_address(packet.l3_ipv6_dst()).c_str());
-    SStringPrintf(
-        &l3_conntrack_repl,
-        "src=%s dst=%s",
-        sprintf_ipv6_address(packet.l3_ipv6_dst()).c_str(),
-        sprintf_ipv6_address(packet.l3_ipv6_src()).c_str());
-  } else {
-     SStringPrintf(&l3_conntrack_orig, "l3-unk-%d", packet.l3_protocol());
-     SStringPrintf(&l3_conntrack_repl, "l3-unk-%d", packet.l3_protocol());
+Connection* ConnTrack::get_connection_or_create(uint32 conntrack_id) {
+  bool created;
+  return connections_by_id_.GetOrCreate(conntrack_id, true, classifier(),
+                                        &created);
+}
+
+bool ConnTrack::get_classified_mark(const FlowKey& key, uint32* mark) {
+  return connections_.GetClassifiedMark(key, time(NULL), mark);
+}
+
+bool ConnTrack::get_classified_mark(uint32 conntrack_id, uint32* mark) {
+  return connections_by_id_.GetClassifiedMark(conntrack_id, time(NULL), mark);
+}
+
+void ConnTrack::publish_classified(const FlowKey& key) {
+  connections_.PublishClassified(key);
+}
+
+void ConnTrack::publish_classified(uint32 conntrack_id) {
+  connections_by_id_.PublishClassified(conntrack_id);
+}
+
+// Conntrack query callback: saves the mark of the queried conntrack.
+static int get_conntrack_mark(nf_conntrack_msg_type type,
+                              nf_conntrack* conntrack, void* mark) {
+  *reinterpret_cast<uint32*>(mark) = nfct_get_attr_u32(conntrack, ATTR_MARK);
+  return NFCT_CB_STOP;
+}
+
+bool ConnTrack::save_connmark(nfct_handle* query_handler, const Packet& packet,
+                              uint32 mark, uint32 mark_mask) {
+  // Builds the conntrack queries. The kernel looks the conntrack up in both
+  // directions, but NATed packets match none of the conntrack tuples; the
+  // reverse tuple is tried too, as it matches the reply tuple of DNATed
+  // connections.
+  nf_conntrack* conntrack[2] = { nfct_new(), nfct_new() };
+  if (!conntrack[0] || !conntrack[1]) {
+    LOG(ERROR, "Could not allocate a conntrack object.");
+    for (int i = 0; i < 2; ++i) {
+      if (conntrack[i]) {
+        nfct_destroy(conntrack[i]);
+      }
+    }
+    return false;
   }
 
-  SStringPrintf(&keys->first,
-                "%s %s sport=%d dport=%d",
-                sprintf_protocol(packet.l4_protocol()),
-                l3_conntrack_orig.c_str(),
-                packet.l4_src(), packet.l4_dst());
-  SStringPrintf(&keys->second,
-                "%s %s sport=%d dport=%d",
-                sprintf_protocol(packet.l4_protocol()),
-                l3_conntrack_repl.c_str(),
-                packet.l4_dst(), packet.l4_src());
+  for (int reverse = 0; reverse < 2; ++reverse) {
+    if (packet.l3_protocol() == 4) {
+      nfct_set_attr_u8(conntrack[reverse], ATTR_L3PROTO, AF_INET);
+      nfct_set_attr_u32(conntrack[reverse], ATTR_IPV4_SRC,
+          reverse ? packet.l3_ipv4_dst() : packet.l3_ipv4_src());
+      nfct_set_attr_u32(conntrack[reverse], ATTR_IPV4_DST,
+          reverse ? packet.l3_ipv4_src() : packet.l3_ipv4_dst());
+    } else {
+      nfct_set_attr_u8(conntrack[reverse], ATTR_L3PROTO, AF_INET6);
+      nfct_set_attr(conntrack[reverse], ATTR_IPV6_SRC,
+          reverse ? packet.l3_ipv6_dst() : packet.l3_ipv6_src());
+      nfct_set_attr(conntrack[reverse], ATTR_IPV6_DST,
+          reverse ? packet.l3_ipv6_src() : packet.l3_ipv6_dst());
+    }
+    nfct_set_attr_u8(conntrack[reverse], ATTR_L4PROTO, packet.l4_protocol());
+    nfct_set_attr_u16(conntrack[reverse], ATTR_PORT_SRC,
+        htons(reverse ? packet.l4_dst() : packet.l4_src()));
+    nfct_set_attr_u16(conntrack[reverse], ATTR_PORT_DST,
+        htons(reverse ? packet.l4_src() : packet.l4_dst()));
+  }
+
+  // Reads the current conntrack mark, and only replaces the bits of the
+  // @p mark_mask (libnetfilter_conntrack updates the whole mark).
+  uint32 current_mark = 0;
+  nfct_callback_register(query_handler, NFCT_T_ALL, get_conntrack_mark,
+                         &current_mark);
+  int result = -1;
+  for (int reverse = 0; reverse < 2 && result < 0; ++reverse) {
+    if (nfct_query(query_handler, NFCT_Q_GET, conntrack[reverse]) < 0) {
+      continue;
+    }
+    nfct_set_attr_u32(conntrack[reverse], ATTR_MARK,
+                      (current_mark & ~mark_mask) | (mark & mark_mask));
+    result = nfct_query(query_handler, NFCT_Q_UPDATE, conntrack[reverse]);
+  }
+  nfct_callback_unregister(query_handler);
+  nfct_destroy(conntrack[0]);
+  nfct_destroy(conntrack[1]);
+
+  if (result < 0) {
+    LOG(INFO, "Could not save the conntrack mark (%s).", strerror(errno));
+    return false;
+  }
+  return true;
 }
 
 int ConnTrack::conntrack_callback(nf_conntrack_msg_type type,
@@ -352,7 +603,10 @@ int ConnTrack::conntrack_callback(nf_conntrack_msg_type type,
     if (conntrack->must_stop_) {
       return NFCT_CB_STOP;
     }
-    return conntrack->handle_conntrack_event(type, conntrack_event);
+    conntrack->reclaimer_.Quiescent(conntrack->event_reader_);
+    int result = conntrack->handle_conntrack_event(type, conntrack_event);
+    conntrack->reclaimer_.Offline(conntrack->event_reader_);
+    return result;
   }
 
   LOG(ERROR, "No conntracker in conntrack_callback; aborting event listener.");
@@ -376,111 +630,44 @@ int ConnTrack::handle_conntrack_event(nf_conntrack_msg_type type,
     return NFCT_CB_CONTINUE;
   }
 
-  // Garbage collects the old conntrack, when required.
-  if (WallTime() > last_gc_ + kGCInterval) {
-    WriterMutexLock ml(&connections_lock_);
-    last_gc_ = WallTime();
-
-    double expiration_time = last_gc_ - kOldConntrackLifetime;
-    set<string> gckeys;
-    for (hash_map<string, Connection*>::iterator it = connections_.begin();
-         it != connections_.end(); ++it) {
-      if (it->second != NULL) {
-        if (it->second->last_packet() > 0 &&
-            it->second->last_packet() < expiration_time) {
-          gckeys.insert(it->first);
-        }
-      }
-    }
-
-    LOG(INFO, "Conntrack garbage collection: removed %d items.", gckeys.size());
-    for (set<string>::iterator it = gckeys.begin(); it != gckeys.end(); ++it) {
-      connections_.erase(*it);
+  // In queue conntrack mode, connections are created by the Queue, and are
+  // only deleted here.
+  if (queue_conntrack_) {
+    if (type == NFCT_T_DESTROY) {
+      connections_by_id_.Destroy(nfct_get_attr_u32(conntrack_event, ATTR_ID));
     }
+    return NFCT_CB_CONTINUE;
   }
 
   // Creates a new connection on new conntrack item.
+  FlowKey key;
+  int orig_endpoint = key.set_from_conntrack(conntrack_event);
   if (type == NFCT_T_NEW) {
-    string key = get_conntrack_key(conntrack_event, true);
-
-    WriterMutexLock ml(&connections_lock_);
-    hash_map<string, Connection*>::iterator connection = connections_.find(key);
-    if (connection != connections_.end()) {
-      if (connection->second != NULL) {
-        connection->second->set_conntracked(true);
-      } else {
-        connection->second = new Connection(true, classifier_);
-        connection->second->Release();
-      }
+    bool created;
+    Connection* connection =
+        connections_.GetOrCreate(key, true, classifier(), &created);
+    if (created) {
+      connection->set_orig_endpoint(orig_endpoint);
     } else {
-      string reverse_key = get_conntrack_key(conntrack_event, false);
-      hash_map<string, Connection*>::iterator reverse_connection =
-          connections_.find(key);
-
-      // Looks for an existing "reverse" connection -- happens when a packet is
-      // first seen on the Queue before the conntracker becomes aware of the
-      // underlying connection.
-      if (reverse_connection != connections_.end()) {
-        LOG(INFO, "Reverse connection found for orig key '%s'.", key.c_str());
-        reverse_connection->second->Acquire();
-        reverse_connection->second->reverse_connection();
-        reverse_connection->second->Release();
-        connections_[key] = reverse_connection->second;
-        connections_.erase(reverse_key);
-      } else {
-        connections_[key] = new Connection(true, classifier_);
-        connections_[key]->Release();
+      connection->set_conntracked(true);
+
+      // Reverses the connection when its packets were seen on the Queue
+      // before the conntracker became aware of the underlying connection, and
+      // the first packet was not from the original direction.
+      if (connection->orig_endpoint() != orig_endpoint) {
+        LOG(INFO, "Reverse connection found for orig key '%s'.",
+            key.str(orig_endpoint).c_str());
+        connection->reverse_connection();
+        connection->set_orig_endpoint(orig_endpoint);
       }
     }
+    connection->Release();
   }
 
   // Deletes older connections.
   if (type == NFCT_T_DESTROY) {
-    string key = get_conntrack_key(conntrack_event, true);
-
-    WriterMutexLock ml(&connections_lock_);
-    hash_map<string, Connection*>::iterator connection = connections_.find(key);
-    if (connection != connections_.end()) {
-      if (connection->second != NULL) {
-        connection->second->Destroy();
-      }
-      connections_.erase(connection);
-    }
+    connections_.Destroy(key);
   }
 
   return NFCT_CB_CONTINUE;
 }
-
-string ConnTrack::get_conntrack_key(const nf_conntrack* conntrack_event,
-                                    bool orig_dir) {
-  uint8 l3_proto = nfct_get_attr_u8(conntrack_event, ATTR_L3PROTO);
-  uint8 l4_proto = nfct_get_attr_u8(conntrack_event, ATTR_L4PROTO);
-  uint16 src_port = ntohs(nfct_get_attr_u16(conntrack_event, ATTR_PORT_SRC));
-  uint16 dst_port = ntohs(nfct_get_attr_u16(conntrack_event, ATTR_PORT_DST));
-
-  if (l3_proto == AF_INET) {
-    uint32 src_address = nfct_get_attr_u32(conntrack_event, ATTR_IPV4_SRC);
-    uint32 dst_address = nfct_get_attr_u32(conntrack_event, ATTR_IPV4_DST);
-
-    return StringPrintf(
-        "%s src=%s dst=%s sport=%d dport=%d",
-        sprintf_protocol(l4_proto),
-        sprintf_ipv4_address(orig_dir ? src_address : dst_address).c_str(),
-        sprintf_ipv4_address(orig_dir ? dst_address : src_address).c_str(),
-        orig_dir ? src_port : dst_port,
-        orig_dir ? dst_port : src_port);
-  } else if (l3_proto == AF_INET6) {
-    const void* src_address = nfct_get_attr(conntrack_event, ATTR_IPV6_SRC);
-    const void* dst_address = nfct_get_attr(conntrack_event, ATTR_IPV6_DST);
-
-    return StringPrintf(
-        "%s src=%s dst=%s sport=%d dport=%d",
-        sprintf_protocol(l4_proto),
-        sprintf_ipv6_address(orig_dir ? src_address : dst_address).c_str(),
-        sprintf_ipv6_address(orig_dir ? dst_address : src_address).c_str(),
-        orig_dir ? src_port : dst_port,
-        orig_dir ? dst_port : src_port);
-  } else {
-    return StringPrintf("l3-unk-%d", l3_proto);
-  }
-}
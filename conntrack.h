@@ -24,9 +24,16 @@
 #include "base/atomicops.h"
 #include "base/basictypes.h"
 #include "base/hash_map.h"
+#include "base/logging.h"
 #include "base/mutex.h"
+#include "flowkey.h"
 #include "packet.h"
+#include "reclaimer.h"
+#include "stream_buffer.h"
+#include <algorithm>
 #include <ext/hash_map>
+#include <vector>
+#include <time.h>
 #include <netinet/in.h>
 extern "C" {
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
@@ -36,6 +43,7 @@ extern "C" {
 using std::pair;
 using std::string;
 using std::hash_map;
+using std::vector;
 
 class Classifier;
 class ConnectionClassifier;
@@ -50,9 +58,40 @@ class Connection {
   // classified as "unmatched".
   static const uint32 kMaxBufferSize = 64 * (1 << 10);  // 64k
 
+  // Process-wide budget of the storage of the buffers of all connections
+  // being classified. Connections holding buffers are kept in classes of
+  // their storage size (a power of 2 each), in the order of their last buffer
+  // (re)allocation; when the budget is exceeded, the connections of the
+  // largest classes, and then the oldest ones, are definitively classified
+  // with the eviction mark, which frees their buffers, until the budget is
+  // met. Connections busy in another thread are passed over.
+  static const int kDefaultBufferBudgetMb = 256;
+  static const int kNumBudgetClasses = 32;
+
+  // Buffer budget statistics.
+  struct BufferStats {
+    int64 budget;       // Budget in bytes (0 if unlimited).
+    int64 bytes;        // Storage of the buffers, in bytes.
+    int64 peak_bytes;   // Highest storage since the start.
+    int connections;    // Number of connections holding buffers.
+    int64 evictions;    // Number of evicted connections since the start.
+  };
+
   explicit Connection(bool conntracked, Classifier* classifier);
   ~Connection();
 
+  // Connections are allocated from a dedicated ObjectPool.
+  static void* operator new(size_t size);
+  static void operator delete(void* connection);
+
+  // Sets the process-wide buffer @p budget, in bytes (0 for no limit), and
+  // the mark of the evicted connections.
+  static void set_buffer_budget(int64 budget, int32 eviction_mark);
+
+  // Fills the @p stats of the buffer budget, or logs them.
+  static void GetBufferStats(BufferStats* stats);
+  static void LogBufferStats();
+
   // "Is conntracked ?" accessors/mutators.
   bool conntracked() const { return conntracked_; }
   void set_conntracked(bool conntracked) { conntracked_ = conntracked; }
@@ -60,20 +99,44 @@ class Connection {
   // Classification mark accessor.
   uint32 classification_mark() const { return classification_mark_; }
 
+  // Returns true iff the classification mark is definitive.
+  bool definitive() const { return Acquire_Load(&definitive_mark_); }
+
+  // Returns true iff the classification mark is definitive, and sets @p mark
+  // to that mark. The definitive mark is published atomically, hence this
+  // method can be called without having acquired the connection.
+  bool get_definitive_mark(uint32* mark) const {
+    if (!Acquire_Load(&definitive_mark_)) {
+      return false;
+    }
+    *mark = classification_mark_;
+    return true;
+  }
+
+  // "Was the mark saved in the kernel conntrack ?" accessors/mutators.
+  bool connmark_saved() const { return connmark_saved_; }
+  void set_connmark_saved() { connmark_saved_ = true; }
+
   // Exchanged content accessors.
   inline int32 packets_egress() const { return packets_egress_; }
   inline int32 packets_ingress() const { return packets_ingress_; }
   inline int32 bytes_egress() const { return bytes_egress_; }
   inline int32 bytes_ingress() const { return bytes_ingress_; }
-  inline const string& buffer_egress() const { return buffer_egress_; }
-  inline const string& buffer_ingress() const { return buffer_ingress_; }
+  inline const StreamBuffer& buffer_egress() const { return buffer_egress_; }
+  inline const StreamBuffer& buffer_ingress() const { return buffer_ingress_; }
 
   // Updates the connection with the @p content of the packet.
   // "original" means src->dst, "repl" means dst->src.
   void update_packet_orig(const char* data, int32 data_len);
   void update_packet_repl(const char* data, int32 data_len);
 
-  // Updates the last_packet timestamp. Last packet timestamp accessor.
+  // Index of the FlowKey endpoint which is the source of the connection's
+  // original direction.
+  int orig_endpoint() const { return orig_endpoint_; }
+  void set_orig_endpoint(int orig_endpoint) { orig_endpoint_ = orig_endpoint; }
+
+  // Updates the last_packet timestamp. Last packet timestamp accessor; it is
+  // initialized to the creation time of the connection.
   void touch();
   double last_packet() const { return last_packet_; }
 
@@ -89,9 +152,10 @@ class Connection {
     content_lock_.Lock();
   }
   void Release() {
-    AtomicIncrement(&ref_counter_, -1);
+    // The reference must be dropped after the unlock, and the object must not
+    // be touched afterwards, unless this was the last reference.
     content_lock_.Unlock();
-    if (ref_counter_ == 0) {
+    if (AtomicIncrement(&ref_counter_, -1) == 0) {
       delete this;
     }
   }
@@ -104,30 +168,69 @@ class Connection {
   // Really updates the Connection (Cf. update_packet_* above).
   void update_packet(bool orig, const char* data, int32 data_len);
 
+  // Returns the number of bytes to store out of the @p length bytes of a
+  // packet, the first @p skip bytes of the direction not being needed (nor
+  // any of them, unless @p needed); updates @p skip.
+  static uint32 get_stored_length(bool needed, uint32 length, uint32* skip);
+
+  // Drops the bytes of the @p buffer before the classifier @p hint (@p bytes
+  // being the number of bytes received), and sets @p skip to the number of
+  // next bytes to skip when the hint is past them.
+  static void apply_hint(uint32 hint, uint32 bytes, StreamBuffer* buffer,
+                         uint32* skip);
+
   // Tears down the classifier and the buffers (called on definitive
   // classification).
   void set_definitive_classification();
 
+  // Updates the buffer budget with the current storage of the buffers, making
+  // the connection the newest one, and evicts the oldest connections if the
+  // budget is exceeded.
+  void account_buffers();
+
+  // Removes the connection from the buffer budget lists, or evicts the
+  // largest other connections until the budget is met. Both assume the caller
+  // owns the buffer budget lock.
+  void unlink_buffers_locked();
+  void evict_connections_locked();
+
   // Indicates if the connection have already be seen by ConnTrack.
   bool conntracked_;
 
+  // Original direction source endpoint, in the connection's FlowKey.
+  int orig_endpoint_;
+
   // The classification object.
   ConnectionClassifier* classifier_;
 
   // Stores the current rule match. This number is an opaque number from the
   // classifier, and is supposed to be the NFQUEUE verdict mark.
+  // Once definitive_mark_ is set (with release semantics), the mark does not
+  // change anymore.
   int32 classification_mark_;
-  bool definitive_mark_;
+  volatile AtomicWord definitive_mark_;
+  bool connmark_saved_;
 
   // Content received so far; packets_* and bytes_* stores real numbers.
   // Buffers only store the last received bytes: it actually stores bytes
-  // from the [bytes_*gress - buffer_*gress.size();bytes_*gress[.
+  // from the [bytes_*gress - buffer_*gress.size();bytes_*gress[. The next
+  // skip_*gress bytes, which the classifier doesn't need, won't be stored.
   uint32 packets_egress_;
   uint32 packets_ingress_;
   uint32 bytes_egress_;
   uint32 bytes_ingress_;
-  string buffer_egress_;
-  string buffer_ingress_;
+  StreamBuffer buffer_egress_;
+  StreamBuffer buffer_ingress_;
+  uint32 skip_egress_;
+  uint32 skip_ingress_;
+
+  // Storage accounted in the buffer budget, and links of the budget list of
+  // its class (protected by the budget lock). buffers_accounted_ is set once
+  // the connection was first accounted.
+  uint32 budget_bytes_;
+  Connection* budget_older_;
+  Connection* budget_newer_;
+  bool buffers_accounted_;
 
   // Timestamp of last received packet.
   double last_packet_;
@@ -139,57 +242,544 @@ class Connection {
   DISALLOW_EVIL_CONSTRUCTORS(Connection);
 };
 
+// A table of Connection objects, split in independently locked shards. The
+// shard of a connection is selected using the hash of its key, so that threads
+// working on connections of different shards never contend on the same lock.
+// Returned connections are always acquired, and must be released by the
+// caller.
+// Classified cache:
+//   Each shard can also hold a direct-mapped cache of the definitive marks of
+//   its classified connections, which readers of the @p reclaimer can look up
+//   without any lock, reference count, or shared write (GetClassifiedMark).
+//   Cache entries are immutable, except for their coarse last packet
+//   timestamp; they are only added or removed under the shard's writer lock,
+//   and removed entries are retired through the reclaimer.
+// Expiration:
+//   Connections are filed in a per-shard hierarchical timer wheel, at the
+//   time they would expire if they did not receive any packet: the fine
+//   wheel has one bucket per second of the next kWheelSlots seconds, and the
+//   coarse wheel one bucket per later round of kWheelSlots seconds (the last
+//   one also holding the farther deadlines). Coarse buckets are cascaded into
+//   the fine wheel when their round starts. Filing is lazy: touch() only
+//   updates the last packet timestamp; when the wheel reaches a connection,
+//   it is either destroyed, or filed again at its new expiration time. Each
+//   connection has exactly one (intrusive) wheel entry, which is unlinked
+//   when the connection is removed. Each Tick() only processes a bounded
+//   number of fine buckets and connections per shard.
+template <typename Key, typename Hash>
+class ConnectionTable {
+ public:
+  // Creates a table of @p num_shards shards. A @p classified_cache_size of 0
+  // disables the classified cache; otherwise, the @p reclaimer must outlive the
+  // table.
+  ConnectionTable(int num_shards, int classified_cache_size,
+                  QuiescentStateReclaimer* reclaimer)
+    : hash_(), shards_(), classified_slots_(0), reclaimer_(reclaimer),
+      conntracked_lifetime_(kDefaultLifetime),
+      unconntracked_lifetime_(kDefaultLifetime) {
+    CHECK(num_shards > 0);
+    if (classified_cache_size > 0) {
+      CHECK(reclaimer != NULL);
+      classified_slots_ = 1;
+      while (classified_slots_ * num_shards < classified_cache_size) {
+        classified_slots_ *= 2;
+      }
+    }
+    for (int i = 0; i < num_shards; ++i) {
+      Shard* shard = new Shard();
+      shard->classified = (classified_slots_ ?
+                           new AtomicWord[classified_slots_] : NULL);
+      for (int j = 0; j < classified_slots_; ++j) {
+        shard->classified[j] = 0;
+      }
+      shard->wheel.resize(kWheelSlots, NULL);
+      shard->coarse_wheel.resize(kWheelSlots, NULL);
+      shard->wheel_time = time(NULL);
+      shards_.push_back(shard);
+    }
+  }
+
+  // Destroys the table, and all its connections.
+  ~ConnectionTable() {
+    for (uint i = 0; i < shards_.size(); ++i) {
+      {
+        WriterMutexLock ml(&shards_[i]->lock);
+        for (typename Map::iterator it = shards_[i]->connections.begin();
+             it != shards_[i]->connections.end(); ++it) {
+          it->second.connection->Destroy();
+        }
+        shards_[i]->connections.clear();
+        for (int j = 0; j < classified_slots_; ++j) {
+          delete reinterpret_cast<ClassifiedEntry*>(
+              shards_[i]->classified[j]);
+        }
+      }
+      delete[] shards_[i]->classified;
+      delete shards_[i];
+    }
+  }
+
+  // Returns the number of shards, and the number of connections.
+  int num_shards() const { return shards_.size(); }
+  size_t size() {
+    size_t size = 0;
+    for (uint i = 0; i < shards_.size(); ++i) {
+      ReaderMutexLock ml(&shards_[i]->lock);
+      size += shards_[i]->connections.size();
+    }
+    return size;
+  }
+
+  // Returns true iff the @p key is associated with a connection.
+  bool Has(const Key& key) {
+    Shard* shard = get_shard(key);
+    ReaderMutexLock ml(&shard->lock);
+    return shard->connections.find(key) != shard->connections.end();
+  }
+
+  // Returns the connection identified by the @p key, or NULL.
+  Connection* Get(const Key& key) {
+    Shard* shard = get_shard(key);
+    ReaderMutexLock ml(&shard->lock);
+    return get_locked(shard, key);
+  }
+
+  // Returns the connection identified by the @p key. If there is none,
+  // creates a new Connection (with the @p conntracked and @p classifier
+  // parameters), and sets @p created to true.
+  Connection* GetOrCreate(const Key& key, bool conntracked,
+                          Classifier* classifier, bool* created) {
+    Shard* shard = get_shard(key);
+    *created = false;
+    {
+      ReaderMutexLock ml(&shard->lock);
+      Connection* connection = get_locked(shard, key);
+      if (connection) {
+        return connection;
+      }
+    }
+
+    // The connection might have been added since the reader lock was
+    // released, hence the second lookup.
+    WriterMutexLock ml(&shard->lock);
+    Connection* connection = get_locked(shard, key);
+    if (!connection) {
+      connection = new Connection(conntracked, classifier);
+      Entry* entry = &shard->connections[key];
+      entry->connection = connection;
+      entry->key = key;
+      file_locked(shard, entry);
+      *created = true;
+    }
+    return connection;
+  }
+
+  // Removes and destroys the connection identified by the @p key. Returns
+  // false if there was no such connection.
+  bool Destroy(const Key& key) {
+    Shard* shard = get_shard(key);
+    WriterMutexLock ml(&shard->lock);
+    typename Map::iterator it = shard->connections.find(key);
+    if (it == shard->connections.end()) {
+      return false;
+    }
+    remove_locked(shard, it);
+    return true;
+  }
+
+  // Sets the lifetimes, in seconds, of conntracked and un-conntracked
+  // connections which do not receive any packet.
+  void set_lifetimes(int conntracked_lifetime, int unconntracked_lifetime) {
+    CHECK(conntracked_lifetime > 0 && unconntracked_lifetime > 0);
+    conntracked_lifetime_ = conntracked_lifetime;
+    unconntracked_lifetime_ = unconntracked_lifetime;
+  }
+
+  // Advances the expiration wheels up to @p now, and destroys the expired
+  // connections. At most @p budget buckets and entries are processed per
+  // shard (the wheel catches up on the next calls); shards are processed one
+  // at a time. Returns the number of destroyed connections.
+  int Tick(time_t now, int budget) {
+    int removed = 0;
+    for (uint i = 0; i < shards_.size(); ++i) {
+      WriterMutexLock ml(&shards_[i]->lock);
+      removed += tick_locked(shards_[i], now, budget);
+    }
+    return removed;
+  }
+
+  // Returns true iff the connection identified by the @p key is in the
+  // classified cache, and sets @p mark to its definitive mark. Also records
+  // @p now as the connection's last packet timestamp (at most one write per
+  // second and connection).
+  // This method takes no lock: it must be called by an online reader of the
+  // table's reclaimer.
+  bool GetClassifiedMark(const Key& key, time_t now, uint32* mark) {
+    if (!classified_slots_) {
+      return false;
+    }
+    ClassifiedEntry* entry = get_classified(get_shard(key), key);
+    if (!entry) {
+      return false;
+    }
+    if (entry->last_packet != now) {
+      entry->last_packet = now;
+    }
+    *mark = entry->mark;
+    return true;
+  }
+
+  // Adds the connection identified by the @p key to the classified cache, if
+  // it exists, is definitively classified, and if its slot is free. Entries
+  // are never evicted by colliding connections (which would otherwise keep
+  // replacing each other); they are only removed with their connection.
+  void PublishClassified(const Key& key) {
+    if (!classified_slots_) {
+      return;
+    }
+    Shard* shard = get_shard(key);
+    AtomicWord* slot = get_classified_slot(shard, key);
+    if (Acquire_Load(slot)) {
+      return;
+    }
+
+    WriterMutexLock ml(&shard->lock);
+    typename Map::iterator it = shard->connections.find(key);
+    uint32 mark;
+    if (Acquire_Load(slot) || it == shard->connections.end() ||
+        !it->second.connection->get_definitive_mark(&mark)) {
+      return;
+    }
+
+    ClassifiedEntry* entry = new ClassifiedEntry();
+    entry->key = key;
+    entry->mark = mark;
+    entry->last_packet =
+        static_cast<time_t>(it->second.connection->last_packet());
+    Release_Store(slot, reinterpret_cast<AtomicWord>(entry));
+  }
+
+ private:
+  // A connection of the table, and its entry in the expiration wheel: the
+  // entry is linked in the bucket of its deadline (next points to the next
+  // entry of the bucket, and pprev to the pointer to the entry).
+  struct Entry {
+    Connection* connection;
+    Key key;
+    time_t deadline;
+    Entry* next;
+    Entry** pprev;
+  };
+  typedef hash_map<Key, Entry, Hash> Map;
+
+  // Number of buckets of the fine and coarse expiration wheels (the fine
+  // buckets last one second, and the coarse ones kWheelSlots seconds), and
+  // default connection lifetime.
+  static const int kWheelSlots = 1024;
+  static const int kDefaultLifetime = 3600;
+
+  // An entry of the classified cache.
+  struct ClassifiedEntry {
+    Key key;
+    uint32 mark;
+    volatile time_t last_packet;
+  };
+
+  // A shard of the table: connections, their classified cache, their
+  // expiration wheels, and their lock. The fine bucket of time t is
+  // wheel[t % kWheelSlots], its coarse bucket is
+  // coarse_wheel[(t / kWheelSlots) % kWheelSlots], and wheel_time is the
+  // next second to process. Entries hash_map values are never moved, hence
+  // can be linked. The padding keeps the locks of different shards on
+  // different cache lines.
+  struct Shard {
+    Map connections;
+    AtomicWord* classified;
+    vector<Entry*> wheel;
+    vector<Entry*> coarse_wheel;
+    time_t wheel_time;
+    Mutex lock;
+    char padding[64];
+  };
+
+  Shard* get_shard(const Key& key) {
+    return shards_[hash_(key) % shards_.size()];
+  }
+
+  // Returns the classified cache slot of the @p key, in its @p shard. Uses the
+  // hash bits not already used to select the shard.
+  AtomicWord* get_classified_slot(Shard* shard, const Key& key) {
+    size_t slot = (hash_(key) / shards_.size()) & (classified_slots_ - 1);
+    return &shard->classified[slot];
+  }
+
+  // Returns the classified cache entry of the @p key, or NULL.
+  ClassifiedEntry* get_classified(Shard* shard, const Key& key) {
+    if (!classified_slots_) {
+      return NULL;
+    }
+    ClassifiedEntry* entry = reinterpret_cast<ClassifiedEntry*>(
+        Acquire_Load(get_classified_slot(shard, key)));
+    if (entry && entry->key == key) {
+      return entry;
+    }
+    return NULL;
+  }
+
+  // Removes the @p key from the classified cache, if present. Assumes the
+  // caller owns the writer lock on the @p shard.
+  void unpublish_locked(Shard* shard, const Key& key) {
+    ClassifiedEntry* entry = get_classified(shard, key);
+    if (entry) {
+      Release_Store(get_classified_slot(shard, key), 0);
+      reclaimer_->Retire(entry);
+    }
+  }
+
+  // Returns the time at which the @p connection will expire, if it does not
+  // receive any packet. Assumes the caller owns a lock on the @p shard.
+  time_t get_deadline(Shard* shard, const Key& key, Connection* connection) {
+    double last_packet = connection->last_packet();
+    ClassifiedEntry* entry = get_classified(shard, key);
+    if (entry && entry->last_packet > last_packet) {
+      last_packet = entry->last_packet;
+    }
+    return static_cast<time_t>(last_packet) + (connection->conntracked() ?
+        conntracked_lifetime_ : unconntracked_lifetime_);
+  }
+
+  // Files the @p entry in the expiration wheel, at its connection's current
+  // deadline. Assumes the caller owns the writer lock on the @p shard, and
+  // that the entry is not filed.
+  void file_locked(Shard* shard, Entry* entry) {
+    entry->deadline = std::max(
+        get_deadline(shard, entry->key, entry->connection), shard->wheel_time);
+    Entry** bucket;
+    if (entry->deadline - shard->wheel_time < kWheelSlots) {
+      bucket = &shard->wheel[entry->deadline % kWheelSlots];
+    } else {
+      time_t last_round = shard->wheel_time / kWheelSlots + kWheelSlots - 1;
+      time_t round = std::min(entry->deadline / kWheelSlots, last_round);
+      bucket = &shard->coarse_wheel[round % kWheelSlots];
+    }
+    entry->next = *bucket;
+    entry->pprev = bucket;
+    if (*bucket) {
+      (*bucket)->pprev = &entry->next;
+    }
+    *bucket = entry;
+  }
+
+  // Unlinks the @p entry from its expiration wheel bucket. Assumes the caller
+  // owns the writer lock on its shard.
+  static void unfile_locked(Entry* entry) {
+    *entry->pprev = entry->next;
+    if (entry->next) {
+      entry->next->pprev = entry->pprev;
+    }
+  }
+
+  // Removes and destroys the connection of the @p it entry. Assumes the
+  // caller owns the writer lock on the @p shard.
+  void remove_locked(Shard* shard, typename Map::iterator it) {
+    unfile_locked(&it->second);
+    unpublish_locked(shard, it->first);
+    it->second.connection->Destroy();
+    shard->connections.erase(it);
+  }
+
+  // Advances the expiration wheel of the @p shard (cf. Tick). Assumes the
+  // caller owns the writer lock on the @p shard.
+  int tick_locked(Shard* shard, time_t now, int budget) {
+    int removed = 0;
+    while (shard->wheel_time <= now && budget-- > 0) {
+      // At the start of a round, cascades its coarse bucket into the fine
+      // wheel (each entry is only cascaded once per filing, hence this is not
+      // charged to the budget; the bucket is empty when resuming the round).
+      if (shard->wheel_time % kWheelSlots == 0) {
+        Entry** coarse = &shard->coarse_wheel[
+            (shard->wheel_time / kWheelSlots) % kWheelSlots];
+        while (*coarse) {
+          Entry* entry = *coarse;
+          unfile_locked(entry);
+          file_locked(shard, entry);
+        }
+      }
+
+      // Processes the bucket entries, whose deadline is the wheel time (the
+      // connections filed again are moved to later buckets).
+      Entry** bucket = &shard->wheel[shard->wheel_time % kWheelSlots];
+      for (; *bucket && budget > 0; --budget) {
+        Entry* entry = *bucket;
+        if (get_deadline(shard, entry->key, entry->connection) >
+            shard->wheel_time) {
+          unfile_locked(entry);
+          file_locked(shard, entry);
+        } else {
+          remove_locked(shard, shard->connections.find(entry->key));
+          removed++;
+        }
+      }
+
+      // Stops in the middle of the bucket when the budget is exhausted.
+      if (*bucket) {
+        break;
+      }
+      shard->wheel_time++;
+    }
+    return removed;
+  }
+
+  // Returns the acquired connection identified by the @p key, or NULL.
+  // Assumes the caller owns a lock on the @p shard.
+  Connection* get_locked(Shard* shard, const Key& key) {
+    typename Map::iterator it = shard->connections.find(key);
+    if (it != shard->connections.end()) {
+      it->second.connection->Acquire();
+      return it->second.connection;
+    }
+    return NULL;
+  }
+
+  Hash hash_;
+  vector<Shard*> shards_;
+
+  // Number of classified cache slots per shard (a power of two, or 0), and
+  // the reclaimer of the cache entries.
+  int classified_slots_;
+  QuiescentStateReclaimer* reclaimer_;
+
+  // Connection lifetimes, in seconds.
+  int conntracked_lifetime_;
+  int unconntracked_lifetime_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ConnectionTable);
+};
+
 // The connection tracking mechanism. Opens a socket on the conntrack netlink,
 // maintains a local copy of the conntrack table using the conntrack event, and
 // returns the Connection objects to the Queue class.
-// Format of conntrack keys:
-//   Conntrack elements are identified by a string, named key, which uniquely
-//   identifies the conntrack item, and which is easily derived from a matched
-//   packet. It is formated the following way:
-//    "<proto> src=<src> dst=<dst> sport=<sport> dport=<dport>"
+// Conntrack keys:
+//   Conntrack elements are identified by a FlowKey, which uniquely identifies
+//   the conntrack item, and which is easily derived from a matched packet.
+//   Since FlowKeys are shared by both directions of a connection, the
+//   Connection keeps track of which endpoint started the connection.
+// Queue conntrack mode:
+//   When NFQUEUE attaches the conntrack information to queued packets, the
+//   Connection objects are directly identified by their kernel conntrack id,
+//   and the packet direction is given by the conntrack info. Only DESTROY
+//   events are then listened to, to remove the terminated connections.
 class ConnTrack {
  public:
-  // Number of seconds during which a conntrack without any new packet is kept
-  // in the conntrack table. Prevents missed DESTROY events from exhausting
-  // memory.
-  static const int kOldConntrackLifetime = 3600 * 6;  // 6 hours.
+  // Default number of seconds during which a connection without any new
+  // packet is kept in the conntrack table, for conntracked connections
+  // (which are normally removed by DESTROY events; this prevents missed
+  // events from exhausting memory), and for un-conntracked connections.
+  static const int kDefaultConntrackedLifetime = 3600 * 6;  // 6 hours.
+  static const int kDefaultUnconntrackedLifetime = 3600;  // 1 hour.
+
+  // Maximal number of expiration wheel buckets and entries processed per
+  // shard and per second.
+  static const int kExpirationBudget = 4096;
 
-  // Number of seconds between two conntrack garbage collections.
-  static const int kGCInterval = 3600;
+  // Number of shards of the connection tables.
+  static const int kConnectionShards = 64;
 
-  // Static data used to compute the key.
-  static const char* kProtoNames[IPPROTO_MAX];
+  // Default size of the classified cache (cf. get_classified_mark).
+  static const int kDefaultClassifiedCacheSize = 65536;
 
   // Sets up the conntrack event listener, and register the @p classifier for
-  // future connections.
-  ConnTrack(Classifier* classifier);
+  // future connections (the ConnTrack takes over the caller's reference).
+  // @p queue_conntrack enables the queue conntrack mode.
+  // @p classified_cache_size is the number of slots of the classified cache
+  // (0 disables it).
+  ConnTrack(Classifier* classifier, bool queue_conntrack,
+            int classified_cache_size);
   ~ConnTrack();
 
+  // Returns the classifier of new connections. Must be called by an online
+  // reader of the reclaimer(): the Classifier is only guaranteed to live until
+  // the reader's next quiescent state, unless it is acquired.
+  Classifier* classifier() {
+    return reinterpret_cast<Classifier*>(Acquire_Load(&classifier_));
+  }
+
+  // Atomically replaces the classifier of new connections with the
+  // @p classifier (taking over the caller's reference). Existing connections
+  // keep their classifier; the ConnTrack's reference on the replaced
+  // Classifier is released once no reader can still be using it.
+  void ReplaceClassifier(Classifier* classifier);
+
+  // Returns true iff the queue conntrack mode is enabled.
+  bool queue_conntrack() const { return queue_conntrack_; }
+
+  // Sets the lifetimes, in seconds, of connections without any new packet.
+  void set_lifetimes(int conntracked_lifetime, int unconntracked_lifetime);
+
   // Starts the conntrack event listener; only returns on failure.
   void Run();
   void Stop();
 
+  // Starts the connection expiration loop, which advances the expiration
+  // wheels every second, and logs the statistics when needed; only returns
+  // after Stop().
+  void RunExpiration();
+
+  // Logs the connection tables and object pools statistics, every
+  // @p stats_interval seconds (0 disables periodic statistics), or once at
+  // the next expiration tick after RequestStats() (which is safe to call
+  // from a signal handler).
+  void set_stats_interval(int stats_interval) {
+    stats_interval_ = stats_interval;
+  }
+  void RequestStats() { stats_requested_ = true; }
+  void LogStats();
+
   // Returns true iff the given conntrack key is associated with an existing
   // connection.
-  bool has_connection(const string& key);
+  bool has_connection(const FlowKey& key);
 
   // Returns the connection identified by the @p key, and increment its usage
   // counter, or returns NULL on failure.
-  Connection* get_connection(const string& key);
-
-  // Returns the connection identified by any of the two @p keys, and updates
-  // the @p direction_orig to indicates which key was used.
-  // If no connection is found, returns a new connection for the original
-  // direction.
-  Connection* get_connection_or_create(const pair<string, string>& keys,
+  Connection* get_connection(const FlowKey& key);
+
+  // Returns the connection identified by the @p key, and updates the
+  // @p direction_orig to indicate if the @p source endpoint of the key is the
+  // source of the connection's original direction.
+  // If no connection is found, returns a new connection whose original
+  // direction starts at the @p source endpoint.
+  Connection* get_connection_or_create(const FlowKey& key, int source,
                                        bool& direction_orig);
 
-  // Returns the pair of tracking keys associated with the @p packet.
-  // The input @p packet is the complete queue structure (the packet, plus
-  // netfilter-queue headers).
-  // The first key will be the "forward direction key" (for when the @p packet
-  // is a src->dst packet), the second will be the "backward direction packet".
-  static void get_packet_keys(const Packet& packet, pair<string, string>* keys);
+  // Returns the connection identified by the kernel @p conntrack_id, and
+  // creates it if needed (queue conntrack mode only).
+  Connection* get_connection_or_create(uint32 conntrack_id);
+
+  // Lock-free fast path: returns true iff the connection identified by the
+  // @p key (or by the kernel @p conntrack_id) is definitively classified and
+  // in the classified cache, and sets @p mark to its definitive mark. Must be
+  // called by an online reader of the reclaimer().
+  bool get_classified_mark(const FlowKey& key, uint32* mark);
+  bool get_classified_mark(uint32 conntrack_id, uint32* mark);
+
+  // Adds the connection identified by the @p key (or by the kernel
+  // @p conntrack_id) to the classified cache, if it is definitively
+  // classified. The connection must not be acquired by the caller.
+  void publish_classified(const FlowKey& key);
+  void publish_classified(uint32 conntrack_id);
+
+  // Returns the reclaimer protecting the classified cache and the classifier;
+  // threads calling get_classified_mark or get_connection_or_create must be
+  // registered as its readers.
+  QuiescentStateReclaimer* reclaimer() { return &reclaimer_; }
+
+  // Saves the bits of the @p mark_mask of the @p mark in the kernel conntrack
+  // mark of the @p packet's connection (the other bits are kept), so that
+  // iptables can restore it (CONNMARK --restore-mark) and stop queueing the
+  // connection. The blocking queries go through the caller's own
+  // @p query_handler. Returns false on failure.
+  static bool save_connmark(nfct_handle* query_handler, const Packet& packet,
+                            uint32 mark, uint32 mark_mask);
 
   // Static callback for the conntrack event listener.
   // Calls the handle_conntrack_event of the @p conntrack_object, or returns
@@ -203,36 +793,32 @@ class ConnTrack {
   int handle_conntrack_event(nf_conntrack_msg_type type,
                              nf_conntrack* conntrack_event);
 
-  // Returns the connection identified by the @p key. Assumes that the caller
-  // owns a lock on connections_lock_.
-  inline Connection* get_connection_locked(const string& key) {
-    hash_map<string, Connection*>::iterator it = connections_.find(key);
-    if (it != connections_.end()) {
-      it->second->Acquire();
-      return it->second;
-    }
-    return NULL;
-  }
-
-  // Returns the conntrack key associated to the @p conntrack event.
-  // If @p orig_dir is true, returns the original direction key, otherwise
-  // returns the reverse direction key.
-  static string get_conntrack_key(const nf_conntrack* conntrack_event,
-                                  bool orig_dir);
+  // Connection tables types.
+  typedef ConnectionTable<FlowKey, FlowKeyHash> FlowConnectionTable;
+  typedef ConnectionTable<uint32, __gnu_cxx::hash<uint32> > IdConnectionTable;
 
   // Conntrack events listener.
   nfct_handle* conntrack_event_handler_;
 
-  // Pointer to the connection classifier.
-  Classifier* classifier_;
+  // Pointer to the connection classifier (a Classifier*, replaced without
+  // lock).
+  AtomicWord classifier_;
+
+  // Reclaimer of the classified cache entries and of the replaced
+  // classifiers, and reader id of the conntrack event thread.
+  QuiescentStateReclaimer reclaimer_;
+  int event_reader_;
 
-  // Connection storage, and mutex.
-  hash_map<string, Connection*> connections_;
-  Mutex connections_lock_;
+  // Connection storage (by key, and by conntrack id in the queue conntrack
+  // mode).
+  bool queue_conntrack_;
+  FlowConnectionTable connections_;
+  IdConnectionTable connections_by_id_;
   bool must_stop_;
 
-  // Timestamp of last garbage collection.
-  double last_gc_;
+  // Statistics logging parameters.
+  int stats_interval_;
+  volatile bool stats_requested_;
 
   DISALLOW_EVIL_CONSTRUCTORS(ConnTrack);
 };
@@ -0,0 +1,193 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Contention benchmark for the connection table. Several "queue" threads look
+// connections up (and create them when needed), while an "event" thread
+// concurrently creates and destroys connections, as the conntrack event
+// listener does. The benchmark is run with a single shard (which behaves as a
+// table protected by a single global lock), then with --shards shards, and
+// finally with --shards shards and the lock-free classified cache.
+// Only definitively classified connections are published in the classified
+// cache. Keep-alive http connections none of whose requests matched a rule
+// are not definitive, and take the locked path for each of their packets for
+// as long as they are open; --undecided_percent simulates such connections.
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "conntrack.h"
+#include "object_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <google/gflags.h>
+
+DEFINE_int32(threads, 4, "Number of queue threads.");
+DEFINE_int32(flows, 100000, "Number of distinct flows.");
+DEFINE_int32(lookups, 2000000, "Number of lookups per queue thread.");
+DEFINE_int32(shards, ConnTrack::kConnectionShards,
+             "Number of shards of the sharded connection table.");
+DEFINE_int32(classified_cache_size, ConnTrack::kDefaultClassifiedCacheSize,
+             "Number of slots of the classified cache.");
+DEFINE_int32(undecided_percent, 0,
+             "Percentage of the flows which are never definitively classified "
+             "(eg. keep-alive http connections whose requests don't match), "
+             "hence never published in the classified cache.");
+
+typedef ConnectionTable<FlowKey, FlowKeyHash> BenchmarkTable;
+
+// State shared by the benchmark threads.
+struct BenchmarkState {
+  BenchmarkTable* table;
+  QuiescentStateReclaimer* reclaimer;
+  bool classified_cache;
+  vector<FlowKey> keys;
+  volatile bool lookups_done;
+};
+
+static double WallTime() {
+  struct timeval result;
+  gettimeofday(&result, NULL);
+
+  return double(result.tv_sec) + double(result.tv_usec) / 1000000.0;
+}
+
+// Returns the key of the @p flow-th tcp flow.
+static FlowKey get_flow_key(int flow) {
+  char packet[sizeof(iphdr) + sizeof(tcphdr)];
+  memset(packet, 0, sizeof(packet));
+
+  iphdr* ip_header = reinterpret_cast<iphdr*>(packet);
+  ip_header->version = 4;
+  ip_header->ihl = sizeof(iphdr) / 4;
+  ip_header->tot_len = htons(sizeof(packet));
+  ip_header->protocol = IPPROTO_TCP;
+  ip_header->saddr = htonl(0x0a000000 + flow / 30000);
+  ip_header->daddr = htonl(0xc0a80001);
+
+  tcphdr* tcp_header = reinterpret_cast<tcphdr*>(packet + sizeof(iphdr));
+  tcp_header->source = htons(1024 + flow % 30000);
+  tcp_header->dest = htons(80);
+  tcp_header->doff = sizeof(tcphdr) / 4;
+
+  FlowKey key;
+  key.set_from_packet(Packet(packet, sizeof(packet)));
+  return key;
+}
+
+// Looks random flows up, as a Queue thread does for every packet. Since
+// connections are created without classifier, they are immediately
+// classified, and published in the classified cache when enabled (but for
+// the undecided flows).
+void* queue_thread(void* data) {
+  BenchmarkState* state = reinterpret_cast<BenchmarkState*>(data);
+  unsigned int seed = reinterpret_cast<intptr_t>(&seed);
+  int reader = state->reclaimer->RegisterReader();
+  time_t now = time(NULL);
+
+  for (int i = 0; i < FLAGS_lookups; ++i) {
+    int flow = rand_r(&seed) % state->keys.size();
+    const FlowKey& key = state->keys[flow];
+    uint32 mark;
+    state->reclaimer->Quiescent(reader);
+    if (state->table->GetClassifiedMark(key, now, &mark)) {
+      continue;
+    }
+
+    bool created;
+    Connection* connection =
+        state->table->GetOrCreate(key, false, NULL, &created);
+    connection->touch();
+    connection->Release();
+    if (state->classified_cache && flow % 100 >= FLAGS_undecided_percent) {
+      state->table->PublishClassified(key);
+    }
+  }
+  state->reclaimer->Offline(reader);
+  return NULL;
+}
+
+// Creates and destroys random flows, as the conntrack thread does on
+// NEW/DESTROY events.
+void* event_thread(void* data) {
+  BenchmarkState* state = reinterpret_cast<BenchmarkState*>(data);
+  unsigned int seed = 42;
+
+  while (!state->lookups_done) {
+    const FlowKey& key = state->keys[rand_r(&seed) % state->keys.size()];
+    if (!state->table->Destroy(key)) {
+      bool created;
+      state->table->GetOrCreate(key, true, NULL, &created)->Release();
+    }
+  }
+  return NULL;
+}
+
+// Runs the benchmark on a table of @p num_shards shards, with a classified
+// cache of @p classified_cache_size slots.
+void run_benchmark(BenchmarkState* state, int num_shards,
+                   int classified_cache_size) {
+  QuiescentStateReclaimer reclaimer;
+  BenchmarkTable table(num_shards, classified_cache_size, &reclaimer);
+  state->table = &table;
+  state->reclaimer = &reclaimer;
+  state->classified_cache = (classified_cache_size > 0);
+  state->lookups_done = false;
+
+  pthread_t event_thread_id;
+  vector<pthread_t> queue_thread_ids(FLAGS_threads);
+  double start = WallTime();
+
+  pthread_create(&event_thread_id, NULL, event_thread, state);
+  for (int i = 0; i < FLAGS_threads; ++i) {
+    pthread_create(&queue_thread_ids[i], NULL, queue_thread, state);
+  }
+  for (int i = 0; i < FLAGS_threads; ++i) {
+    pthread_join(queue_thread_ids[i], NULL);
+  }
+  double elapsed = WallTime() - start;
+
+  state->lookups_done = true;
+  pthread_join(event_thread_id, NULL);
+
+  printf("shards=%-4d cache=%-7d threads=%-3d undecided=%d%% %10.0f "
+         "lookups/s (%.2fs, %d connections)\n",
+         num_shards, classified_cache_size, FLAGS_threads,
+         FLAGS_undecided_percent,
+         FLAGS_threads * static_cast<double>(FLAGS_lookups) / elapsed,
+         elapsed, static_cast<int>(table.size()));
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK(FLAGS_threads > 0 && FLAGS_flows > 0 && FLAGS_shards > 0);
+  CHECK(FLAGS_undecided_percent >= 0 && FLAGS_undecided_percent <= 100);
+
+  BenchmarkState state;
+  for (int flow = 0; flow < FLAGS_flows; ++flow) {
+    state.keys.push_back(get_flow_key(flow));
+  }
+
+  run_benchmark(&state, 1, 0);
+  run_benchmark(&state, FLAGS_shards, 0);
+  run_benchmark(&state, FLAGS_shards, FLAGS_classified_cache_size);
+  ObjectPool::LogStats();
+  return 0;
+}
@@ -0,0 +1,165 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Tests of the classification of connections: the packets of each test
+// connection are fed as they would be by a queue thread, and the resulting
+// marks are checked. Failed checks abort the test with an error.
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "classifier.h"
+#include "conntrack.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+using std::string;
+
+// Mark of the requests to /blocked, and of the evicted connections.
+static const int32 kBlockedMark = 7;
+static const int32 kEvictedMark = 9;
+
+// Returns a classifier marking the http requests to /blocked.
+static Classifier* NewClassifier() {
+  Classifier* classifier = new Classifier();
+  ClassificationRule* rule =
+      new ClassificationRule(ClassificationRule::HTTP, kBlockedMark);
+  rule->set_url_prefix("/blocked");
+  classifier->add_rule(rule);
+  return classifier;
+}
+
+// Returns a new connection, which the test references as the connection
+// table would: the creator releases it, and Destroy() drops the reference.
+static Connection* NewConnection(Classifier* classifier) {
+  Connection* connection = new Connection(true, classifier);
+  connection->Release();
+  return connection;
+}
+
+// Feeds the @p text to the @p connection, from the client (in the original
+// direction) or from the server, as a queue thread does.
+static void SendClient(Connection* connection, const char* text) {
+  connection->Acquire();
+  connection->update_packet_orig(text, strlen(text));
+  connection->Release();
+}
+
+static void SendServer(Connection* connection, const char* text) {
+  connection->Acquire();
+  connection->update_packet_repl(text, strlen(text));
+  connection->Release();
+}
+
+// A response delimited by the end of the connection stops the tracking of
+// the responses, while the requests which follow are still classified.
+static void TestCloseDelimitedResponse(Classifier* classifier) {
+  Connection* connection = NewConnection(classifier);
+  SendClient(connection, "GET /index.html HTTP/1.1\r\nHost: a\r\n\r\n");
+  SendServer(connection, "HTTP/1.0 200 OK\r\n\r\n<html>");
+  SendServer(connection, "</html>");
+  CHECK(!connection->definitive());
+
+  SendClient(connection, "GET /next.html HTTP/1.1\r\nHost: a\r\n\r\n");
+  SendServer(connection, "more body");
+  CHECK(!connection->definitive());
+  CHECK_EQ(connection->buffer_ingress().size(), 0U);
+
+  SendClient(connection, "GET /blocked HTTP/1.1\r\nHost: a\r\n\r\n");
+  CHECK(connection->definitive());
+  CHECK_EQ(connection->classification_mark(),
+           static_cast<uint32>(kBlockedMark));
+  connection->Destroy();
+}
+
+// Http connections are definitively unmatched at once when there is no http
+// rule, instead of waiting for requests which can't match.
+static void TestNoRuleForProtocol() {
+  Classifier* classifier = new Classifier();
+  ClassificationRule* rule =
+      new ClassificationRule(ClassificationRule::FTP, kBlockedMark);
+  rule->set_url_prefix("/blocked");
+  classifier->add_rule(rule);
+
+  Connection* connection = NewConnection(classifier);
+  SendClient(connection, "GET /blocked HTTP/1.1\r\nHost: a\r\n\r\n");
+  CHECK(connection->definitive());
+  CHECK_EQ(connection->classification_mark(),
+           static_cast<uint32>(Classifier::kNoMatch));
+  connection->Destroy();
+  classifier->Release();
+}
+
+// Connections holding the largest buffers are evicted first, whatever their
+// age, until the buffer budget is met.
+static void TestBufferBudgetEviction(Classifier* classifier) {
+  // Small buffers hold a partial request line, and large buffers a partial
+  // request line long enough for the largest buffers.
+  const string large_line = "GET /" + string(Connection::kMaxBufferSize / 4,
+                                             'a');
+  const int kNumConnections = 5;
+  const bool kLarge[kNumConnections] = { false, true, false, true, false };
+  Connection* connections[kNumConnections];
+  uint32 small_bytes = 0;
+  for (int i = 0; i < kNumConnections; ++i) {
+    connections[i] = NewConnection(classifier);
+    SendClient(connections[i], kLarge[i] ? large_line.c_str() : "GET /sl");
+    CHECK(!connections[i]->definitive());
+    if (!kLarge[i]) {
+      small_bytes = connections[i]->buffer_egress().capacity();
+    }
+  }
+
+  // One more small connection only fits in the budget once both the large
+  // connections are evicted.
+  Connection::set_buffer_budget(4 * small_bytes, kEvictedMark);
+  Connection* last = NewConnection(classifier);
+  SendClient(last, "GET /sl");
+  for (int i = 0; i < kNumConnections; ++i) {
+    CHECK_EQ(connections[i]->definitive(), kLarge[i]);
+    if (kLarge[i]) {
+      CHECK_EQ(connections[i]->classification_mark(),
+               static_cast<uint32>(kEvictedMark));
+    }
+  }
+  CHECK(!last->definitive());
+
+  Connection::BufferStats stats;
+  Connection::GetBufferStats(&stats);
+  CHECK_EQ(stats.bytes, static_cast<int64>(4 * small_bytes));
+  CHECK_EQ(stats.connections, 4);
+  CHECK_EQ(stats.evictions, 2);
+
+  last->Destroy();
+  for (int i = 0; i < kNumConnections; ++i) {
+    connections[i]->Destroy();
+  }
+  Connection::GetBufferStats(&stats);
+  CHECK_EQ(stats.bytes, 0);
+  Connection::set_buffer_budget(0, Classifier::kNoMatch);
+}
+
+int main() {
+  Classifier* classifier = NewClassifier();
+  TestCloseDelimitedResponse(classifier);
+  TestBufferBudgetEviction(classifier);
+  classifier->Release();
+  TestNoRuleForProtocol();
+
+  printf("PASSED\n");
+  return 0;
+}
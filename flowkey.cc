@@ -0,0 +1,120 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/util.h"
+#include "flowkey.h"
+#include <arpa/inet.h>
+
+//
+// Key formatting helpers (only used for logging).
+//
+// Returns a string made from the @p protocol number.
+static string sprintf_protocol(uint8 proto) {
+  if (proto == IPPROTO_TCP) {
+    return "tcp";
+  } else if (proto == IPPROTO_UDP) {
+    return "udp";
+  }
+  return StringPrintf("l4-unk-%d", proto);
+}
+
+// Returns a string made from the @p ipv4/ipv6 address.
+static string sprintf_address(int family, const void* address) {
+  char tmp[INET6_ADDRSTRLEN];
+  if (!inet_ntop(family, address, tmp, sizeof(tmp))) {
+    return "(null)";
+  }
+
+  return tmp;
+}
+
+//
+// Implementation of the FlowKey structure.
+//
+int FlowKey::set_from_packet(const Packet& packet) {
+  if (packet.l3_protocol() == 4) {
+    uint32 source = packet.l3_ipv4_src();
+    uint32 destination = packet.l3_ipv4_dst();
+    return set(4, packet.l4_protocol(), sizeof(uint32),
+               &source, packet.l4_src(), &destination, packet.l4_dst());
+  } else if (packet.l3_protocol() == 6) {
+    return set(6, packet.l4_protocol(), sizeof(in6_addr),
+               packet.l3_ipv6_src(), packet.l4_src(),
+               packet.l3_ipv6_dst(), packet.l4_dst());
+  }
+  return set(packet.l3_protocol(), packet.l4_protocol(), 0,
+             NULL, packet.l4_src(), NULL, packet.l4_dst());
+}
+
+int FlowKey::set_from_conntrack(const nf_conntrack* conntrack) {
+  uint8 l3_proto = nfct_get_attr_u8(conntrack, ATTR_L3PROTO);
+  uint8 l4_proto = nfct_get_attr_u8(conntrack, ATTR_L4PROTO);
+  uint16 src_port = ntohs(nfct_get_attr_u16(conntrack, ATTR_PORT_SRC));
+  uint16 dst_port = ntohs(nfct_get_attr_u16(conntrack, ATTR_PORT_DST));
+
+  if (l3_proto == AF_INET) {
+    uint32 src_address = nfct_get_attr_u32(conntrack, ATTR_IPV4_SRC);
+    uint32 dst_address = nfct_get_attr_u32(conntrack, ATTR_IPV4_DST);
+    return set(4, l4_proto, sizeof(uint32),
+               &src_address, src_port, &dst_address, dst_port);
+  } else if (l3_proto == AF_INET6) {
+    return set(6, l4_proto, sizeof(in6_addr),
+               nfct_get_attr(conntrack, ATTR_IPV6_SRC), src_port,
+               nfct_get_attr(conntrack, ATTR_IPV6_DST), dst_port);
+  }
+  return set(0, l4_proto, 0, NULL, src_port, NULL, dst_port);
+}
+
+int FlowKey::set(uint8 l3_proto, uint8 l4_proto, int address_length,
+                 const void* source_address, uint16 source_port,
+                 const void* destination_address, uint16 destination_port) {
+  memset(this, 0, sizeof(*this));
+  l3_protocol = l3_proto;
+  l4_protocol = l4_proto;
+
+  // Orders the endpoints by address, then by port.
+  int order = 0;
+  if (address_length > 0) {
+    order = memcmp(source_address, destination_address, address_length);
+  }
+  if (order == 0) {
+    order = (source_port < destination_port ? -1 :
+             source_port > destination_port ? 1 : 0);
+  }
+
+  int source = (order <= 0 ? 0 : 1);
+  if (address_length > 0) {
+    memcpy(address[source], source_address, address_length);
+    memcpy(address[1 - source], destination_address, address_length);
+  }
+  port[source] = source_port;
+  port[1 - source] = destination_port;
+  return source;
+}
+
+string FlowKey::str(int source) const {
+  int destination = 1 - source;
+  if (l3_protocol == 4 || l3_protocol == 6) {
+    int family = (l3_protocol == 4 ? AF_INET : AF_INET6);
+    return StringPrintf("%s src=%s dst=%s sport=%d dport=%d",
+                        sprintf_protocol(l4_protocol).c_str(),
+                        sprintf_address(family, address[source]).c_str(),
+                        sprintf_address(family, address[destination]).c_str(),
+                        port[source], port[destination]);
+  }
+  return StringPrintf("l3-unk-%d", l3_protocol);
+}
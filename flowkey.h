@@ -0,0 +1,90 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FLOWKEY_H__
+#define FLOWKEY_H__
+
+#include "base/basictypes.h"
+#include "packet.h"
+#include <string.h>
+extern "C" {
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+}
+
+using std::string;
+
+// Identifies a connection by its 5-tuple (layer-3 protocol, layer-4 protocol,
+// addresses and ports), stored in a packed binary format.
+// The key is direction-canonical: its two (address, port) endpoints are
+// ordered, so that the packets of both directions of a connection share the
+// same key. The endpoint which is the source of a given packet is returned
+// when the key is built.
+struct FlowKey {
+  // Endpoints: addresses are in network order (ipv4 addresses only use the
+  // first word), ports are in host order. Unused bytes are always zeroed.
+  uint32 address[2][4];
+  uint16 port[2];
+  uint8 l3_protocol;
+  uint8 l4_protocol;
+  uint16 padding;
+
+  // Builds the key from the @p packet, and returns the index (0 or 1) of the
+  // endpoint which is the source of the packet.
+  int set_from_packet(const Packet& packet);
+
+  // Builds the key from the original tuple of the @p conntrack, and returns
+  // the index (0 or 1) of the endpoint which is the source of the conntrack's
+  // original direction.
+  int set_from_conntrack(const nf_conntrack* conntrack);
+
+  // Returns the key hash.
+  size_t hash() const {
+    const char* data = reinterpret_cast<const char*>(this);
+    uint64 hash = 0;
+    for (uint i = 0; i < sizeof(FlowKey); i += sizeof(uint64)) {
+      uint64 word;
+      memcpy(&word, data + i, sizeof(word));
+      hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+      hash ^= hash >> 29;
+    }
+    return static_cast<size_t>(hash ^ (hash >> 32));
+  }
+
+  bool operator==(const FlowKey& other) const {
+    return memcmp(this, &other, sizeof(FlowKey)) == 0;
+  }
+
+  // Returns the key in the "<proto> src=<src> dst=<dst> sport=<sport>
+  // dport=<dport>" format, using the @p source endpoint as source. Only meant
+  // to be used for logging.
+  string str(int source) const;
+
+ private:
+  // Sets the key from the @p source and @p destination endpoints, whose
+  // addresses are @p address_length bytes long. Returns the index of the
+  // source endpoint.
+  int set(uint8 l3_protocol, uint8 l4_protocol, int address_length,
+          const void* source_address, uint16 source_port,
+          const void* destination_address, uint16 destination_port);
+};
+
+// Hash functor for hash_map<FlowKey, ...>.
+struct FlowKeyHash {
+  size_t operator()(const FlowKey& key) const { return key.hash(); }
+};
+
+#endif  // FLOWKEY_H__
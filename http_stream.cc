@@ -0,0 +1,283 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "http_stream.h"
+#include "protocol_parser.h"
+#include <string.h>
+
+// Largest accepted body or chunk size.
+static const uint64 kMaxBodySize = 1ULL << 62;
+
+// Returns the @p line without its leading and trailing spaces and tabs.
+static StringPiece strip_blanks(const StringPiece& line) {
+  const char* start = line.begin();
+  const char* end = line.end();
+  while (start < end && (*start == ' ' || *start == '\t')) {
+    ++start;
+  }
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+    --end;
+  }
+  return StringPiece(start, end - start);
+}
+
+// Returns true iff the @p line is the header @p name (ignoring case), and
+// points @p value to its value.
+static bool get_header(const StringPiece& line, const char* name,
+                       StringPiece* value) {
+  uint32 length = strlen(name);
+  if (line.size() <= length || line[length] != ':' ||
+      strncasecmp(line.data(), name, length) != 0) {
+    return false;
+  }
+  *value = strip_blanks(StringPiece(line.data() + length + 1,
+                                    line.size() - length - 1));
+  return true;
+}
+
+// Parses the number in @p base at the start of @p text into @p value, and
+// returns the number of digits, or 0 if there is none or if it is too large.
+static uint32 parse_number(const StringPiece& text, int base, uint64* value) {
+  *value = 0;
+  uint32 i = 0;
+  for (; i < text.size(); ++i) {
+    int digit;
+    char c = text[i];
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+      digit = (c | 0x20) - 'a' + 10;
+    } else {
+      break;
+    }
+    *value = *value * base + digit;
+    if (*value > kMaxBodySize) {
+      return 0;
+    }
+  }
+  return i;
+}
+
+HttpStream::HttpStream(bool requests)
+  : requests_(requests),
+    state_(STATE_START_LINE),
+    messages_(0),
+    line_scanned_(0),
+    head_pending_(false),
+    head_length_(0),
+    start_line_length_(0),
+    host_offset_(0),
+    host_length_(0),
+    host_(),
+    remaining_(0),
+    has_content_length_(false),
+    chunked_(false),
+    until_close_(false),
+    no_body_(false) {
+}
+
+uint32 HttpStream::get_line(const char* data, uint32 length,
+                            StringPiece* line) {
+  const char* eol = FindLineEnd(data + line_scanned_, length - line_scanned_);
+  if (eol == NULL) {
+    line_scanned_ = length;
+    return 0;
+  }
+
+  // A \r is only a terminator by itself when it isn't followed by a \n.
+  uint32 size = eol - data;
+  uint32 terminator = 1;
+  if (*eol == '\r') {
+    if (size + 1 == length) {
+      line_scanned_ = size;
+      return 0;
+    }
+    if (eol[1] == '\n') {
+      terminator = 2;
+    }
+  }
+  line_scanned_ = 0;
+  line->set(data, size);
+  return size + terminator;
+}
+
+bool HttpStream::handle_header(const StringPiece& line, uint32 offset) {
+  StringPiece value;
+  if (requests_ && get_header(line, "Host", &value)) {
+    // Only the first Host header counts.
+    if (host_offset_ == 0) {
+      host_offset_ = offset + (value.data() - line.data());
+      host_length_ = value.size();
+    }
+  } else if (get_header(line, "Content-Length", &value)) {
+    uint64 content_length;
+    if (value.empty() ||
+        parse_number(value, 10, &content_length) != value.size() ||
+        (has_content_length_ && content_length != remaining_)) {
+      return false;
+    }
+    has_content_length_ = true;
+    remaining_ = content_length;
+  } else if (get_header(line, "Transfer-Encoding", &value)) {
+    // The body is chunked iff chunked is the last encoding; other bodies of
+    // requests can't be delimited.
+    static const uint32 kChunkedLength = 7;
+    chunked_ = value.size() >= kChunkedLength &&
+        strncasecmp(value.end() - kChunkedLength, "chunked",
+                    kChunkedLength) == 0 &&
+        (value.size() == kChunkedLength ||
+         value[value.size() - kChunkedLength - 1] == ' ' ||
+         value[value.size() - kChunkedLength - 1] == ',');
+    if (!chunked_) {
+      if (requests_) {
+        return false;
+      }
+      until_close_ = true;
+    }
+  }
+  return true;
+}
+
+void HttpStream::start_body() {
+  // Transfer-Encoding takes precedence over Content-Length.
+  if (no_body_) {
+    state_ = STATE_START_LINE;
+  } else if (chunked_) {
+    state_ = STATE_CHUNK_SIZE;
+  } else if (until_close_) {
+    state_ = STATE_UNTIL_CLOSE;
+  } else if (has_content_length_) {
+    state_ = remaining_ > 0 ? STATE_BODY : STATE_START_LINE;
+  } else {
+    state_ = requests_ ? STATE_START_LINE : STATE_UNTIL_CLOSE;
+  }
+}
+
+HttpStream::Event HttpStream::Parse(const char* data, uint32 length,
+                                    uint32* consumed, StringPiece* line) {
+  // A pending request head is passed again from its start.
+  uint32 head_start = 0;
+  uint32 position = (head_pending_ ? head_length_ : 0);
+  while (position < length && state_ != STATE_ERROR) {
+    // Skips the bytes of bodies and chunks.
+    if (state_ == STATE_UNTIL_CLOSE) {
+      position = length;
+      continue;
+    }
+    if (state_ == STATE_BODY || state_ == STATE_CHUNK_DATA) {
+      uint32 available = length - position;
+      if (remaining_ > available) {
+        remaining_ -= available;
+        position = length;
+      } else {
+        position += remaining_;
+        remaining_ = 0;
+        state_ = (state_ == STATE_BODY ? STATE_START_LINE : STATE_CHUNK_END);
+      }
+      continue;
+    }
+
+    StringPiece current;
+    uint32 line_length = get_line(data + position, length - position,
+                                  &current);
+    if (line_length == 0) {
+      break;
+    }
+    position += line_length;
+
+    switch (state_) {
+      case STATE_START_LINE:
+        // Empty lines are allowed between messages.
+        if (!current.empty()) {
+          ++messages_;
+          remaining_ = 0;
+          has_content_length_ = chunked_ = until_close_ = no_body_ = false;
+          state_ = STATE_HEADERS;
+          if (requests_) {
+            head_pending_ = true;
+            head_start = current.data() - data;
+            start_line_length_ = current.size();
+            host_offset_ = host_length_ = 0;
+            break;
+          }
+          *consumed = position;
+          *line = current;
+          return START_LINE;
+        }
+        break;
+      case STATE_HEADERS:
+        // Continuation lines (starting with a blank) are ignored.
+        if (current.empty()) {
+          start_body();
+          if (head_pending_) {
+            head_pending_ = false;
+            host_.set(data + head_start + host_offset_, host_length_);
+            *consumed = position;
+            line->set(data + head_start, start_line_length_);
+            return START_LINE;
+          }
+        } else if (current[0] != ' ' && current[0] != '\t' &&
+                   !handle_header(current,
+                                  current.data() - data - head_start)) {
+          state_ = STATE_ERROR;
+        }
+        break;
+      case STATE_CHUNK_SIZE: {
+        // The size may be followed by blanks and chunk extensions.
+        uint32 digits = parse_number(current, 16, &remaining_);
+        if (digits == 0 ||
+            (digits < current.size() && current[digits] != ';' &&
+             current[digits] != ' ' && current[digits] != '\t')) {
+          state_ = STATE_ERROR;
+        } else {
+          state_ = (remaining_ > 0 ? STATE_CHUNK_DATA : STATE_TRAILERS);
+        }
+        break;
+      }
+      case STATE_CHUNK_END:
+        state_ = (current.empty() ? STATE_CHUNK_SIZE : STATE_ERROR);
+        break;
+      case STATE_TRAILERS:
+        if (current.empty()) {
+          state_ = STATE_START_LINE;
+        }
+        break;
+      default:
+        LOG(FATAL, "Unexpected HttpStream state %d.", state_);
+    }
+  }
+
+  if (head_pending_) {
+    head_length_ = position - head_start;
+    position = head_start;
+  }
+  *consumed = position;
+  return state_ == STATE_ERROR ? ERROR : NEED_DATA;
+}
+
+uint32 HttpStream::SkipBody(uint32 max_length) {
+  if (state_ != STATE_BODY && state_ != STATE_CHUNK_DATA) {
+    return 0;
+  }
+  uint32 skipped = (remaining_ > max_length ? max_length : remaining_);
+  remaining_ -= skipped;
+  if (remaining_ == 0) {
+    state_ = (state_ == STATE_BODY ? STATE_START_LINE : STATE_CHUNK_END);
+  }
+  return skipped;
+}
@@ -0,0 +1,136 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HTTP_STREAM_H__
+#define HTTP_STREAM_H__
+
+#include "base/basictypes.h"
+#include "base/stringpiece.h"
+
+// Resumable parser of the framing of one direction of an http/1.x
+// connection (the requests sent by the client, or the responses sent by the
+// server). It is fed with the bytes of the direction as they arrive, and
+// returns the start lines of the messages one at a time; header lines are
+// only scanned for the body framing (Content-Length and chunked
+// Transfer-Encoding) and, in requests, for the Host header, and body bytes
+// are skipped without being looked at, so that callers can drop every byte
+// the parser has consumed. The parser only holds a few words of state,
+// whatever the size of the messages.
+class HttpStream {
+ public:
+  // Results of Parse().
+  enum Event {
+    NEED_DATA,   // All the complete data was consumed.
+    START_LINE,  // A start line (the request line, once the headers of the
+                 // request are complete, or a status line) was found.
+    ERROR        // The data does not follow the http framing.
+  };
+
+  // Sets up the parser for the requests, or for the responses, of a
+  // connection (whose bodies are, by default, delimited by the end of the
+  // connection).
+  explicit HttpStream(bool requests);
+
+  // Parses the @p length bytes of @p data, which follow the bytes consumed so
+  // far, up to the next event. Sets @p consumed to the number of bytes which
+  // were processed (and are not needed anymore), and, on START_LINE, points
+  // @p line to the start line (without its line terminator), which is part
+  // of the consumed bytes. The headers of requests are not consumed until
+  // they are complete.
+  Event Parse(const char* data, uint32 length, uint32* consumed,
+              StringPiece* line);
+
+  // Skips the rest of the current body or chunk (at most @p max_length
+  // bytes), which won't be passed to Parse(): all the bytes passed so far must
+  // have been consumed. Returns the number of bytes skipped.
+  uint32 SkipBody(uint32 max_length);
+
+  // Tells the parser that the message of the last start line has no body
+  // (responses to HEAD requests, and 1xx, 204 and 304 responses), whatever
+  // its headers.
+  void set_no_body() { no_body_ = true; }
+
+  // Returns true iff the parser is looking for a start line (all the
+  // bytes which were not consumed are the beginning of that line).
+  bool in_start_line() const { return state_ == STATE_START_LINE; }
+
+  // Returns true iff the rest of the stream is the body of the last message.
+  bool until_close() const { return state_ == STATE_UNTIL_CLOSE; }
+
+  // Value of the Host header of the request of the last START_LINE (empty
+  // if there is none), which is part of the consumed bytes.
+  const StringPiece& host() const { return host_; }
+
+  // Number of start lines found so far.
+  uint32 messages() const { return messages_; }
+
+ private:
+  // Position of the parser in the stream.
+  enum State {
+    STATE_START_LINE,
+    STATE_HEADERS,
+    STATE_BODY,
+    STATE_CHUNK_SIZE,
+    STATE_CHUNK_DATA,
+    STATE_CHUNK_END,
+    STATE_TRAILERS,
+    STATE_UNTIL_CLOSE,
+    STATE_ERROR
+  };
+
+  // Points @p line to the line starting at @p data (without its \n or \r\n
+  // terminator), and returns its length with the terminator, or returns 0 if
+  // the line is not complete yet. Incomplete lines are not scanned again.
+  uint32 get_line(const char* data, uint32 length, StringPiece* line);
+
+  // Handles a header line (starting @p offset bytes after the start line of
+  // its request), and the end of the headers.
+  bool handle_header(const StringPiece& line, uint32 offset);
+  void start_body();
+
+  // Direction of the stream, and parser state.
+  bool requests_;
+  State state_;
+  uint32 messages_;
+
+  // Number of bytes of the pending incomplete line which were already
+  // scanned.
+  uint32 line_scanned_;
+
+  // Pending request head (start line and headers), which is not consumed
+  // until it is complete: length of its complete lines, length of its start
+  // line, and position and length of the value of its Host header (relative
+  // to its start).
+  bool head_pending_;
+  uint32 head_length_;
+  uint32 start_line_length_;
+  uint32 host_offset_;
+  uint32 host_length_;
+  StringPiece host_;
+
+  // Framing of the current message: remaining body (or chunk) bytes, and
+  // framing headers.
+  uint64 remaining_;
+  bool has_content_length_;
+  bool chunked_;
+  bool until_close_;
+  bool no_body_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(HttpStream);
+};
+
+#endif  // HTTP_STREAM_H__
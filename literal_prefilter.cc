@@ -0,0 +1,350 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "literal_prefilter.h"
+#include "serializer.h"
+#include <algorithm>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+const uint32 LiteralPrefilter::kMinLiteralLength;
+
+LiteralPrefilter::LiteralPrefilter()
+  : literals_(), ids_(), compiled_(false), num_classes_(0), transitions_(),
+    first_output_(), outputs_(), next_output_() {
+  memset(byte_class_, 0, sizeof(byte_class_));
+}
+
+void LiteralPrefilter::Add(int id, const string& literal) {
+  CHECK(!compiled_);
+  CHECK(!literal.empty());
+  string lower(literal);
+  for (uint i = 0; i < lower.size(); ++i) {
+    lower[i] = tolower(lower[i]);
+  }
+  literals_.push_back(lower);
+  ids_.push_back(id);
+}
+
+void LiteralPrefilter::Compile() {
+  CHECK(!compiled_);
+  compiled_ = true;
+
+  // Bytes used by the literals get their own class (upper case letters share
+  // the class of their lower case).
+  num_classes_ = 1;
+  for (uint i = 0; i < literals_.size(); ++i) {
+    for (uint j = 0; j < literals_[i].size(); ++j) {
+      uint8 byte = literals_[i][j];
+      if (!byte_class_[byte]) {
+        byte_class_[byte] = num_classes_++;
+      }
+    }
+  }
+  for (int byte = 'A'; byte <= 'Z'; ++byte) {
+    byte_class_[byte] = byte_class_[tolower(byte)];
+  }
+
+  // Builds the trie of the literals (-1 being a missing transition).
+  transitions_.assign(num_classes_, -1);
+  vector<vector<int> > outputs(1);
+  for (uint i = 0; i < literals_.size(); ++i) {
+    int state = 0;
+    for (uint j = 0; j < literals_[i].size(); ++j) {
+      int transition = state * num_classes_ +
+          byte_class_[static_cast<uint8>(literals_[i][j])];
+      if (transitions_[transition] < 0) {
+        transitions_[transition] = outputs.size();
+        outputs.push_back(vector<int>());
+        transitions_.resize(transitions_.size() + num_classes_, -1);
+      }
+      state = transitions_[transition];
+    }
+    outputs[state].push_back(ids_[i]);
+  }
+
+  // Computes the failure links in breadth-first order, and replaces the
+  // missing transitions with the transitions of the failure state.
+  const int num_states = outputs.size();
+  vector<int32> failure(num_states, 0);
+  vector<int32> queue;
+  next_output_.assign(num_states, -1);
+  for (int c = 0; c < num_classes_; ++c) {
+    int32& next = transitions_[c];
+    if (next < 0) {
+      next = 0;
+    } else {
+      queue.push_back(next);
+    }
+  }
+  for (uint q = 0; q < queue.size(); ++q) {
+    int32 state = queue[q];
+    for (int c = 0; c < num_classes_; ++c) {
+      int32& next = transitions_[state * num_classes_ + c];
+      int32 fallback = transitions_[failure[state] * num_classes_ + c];
+      if (next < 0) {
+        next = fallback;
+      } else {
+        failure[next] = fallback;
+        queue.push_back(next);
+      }
+    }
+    next_output_[state] = outputs[failure[state]].empty() ?
+        next_output_[failure[state]] : failure[state];
+  }
+
+  first_output_.clear();
+  outputs_.clear();
+  for (int s = 0; s < num_states; ++s) {
+    first_output_.push_back(outputs_.size());
+    std::sort(outputs[s].begin(), outputs[s].end());
+    outputs_.insert(outputs_.end(), outputs[s].begin(), outputs[s].end());
+  }
+  first_output_.push_back(outputs_.size());
+}
+
+void LiteralPrefilter::Match(const char* data, uint32 length,
+                             vector<int>* ids) const {
+  CHECK(compiled_);
+  uint32 first_id = ids->size();
+  int32 state = 0;
+  for (uint32 i = 0; i < length; ++i) {
+    state = transitions_[state * num_classes_ +
+                         byte_class_[static_cast<uint8>(data[i])]];
+    int32 output = state;
+    if (first_output_[output] == first_output_[output + 1]) {
+      output = next_output_[output];
+    }
+    for (; output >= 0; output = next_output_[output]) {
+      ids->insert(ids->end(), outputs_.begin() + first_output_[output],
+                  outputs_.begin() + first_output_[output + 1]);
+    }
+  }
+
+  if (ids->size() > first_id + 1) {
+    std::sort(ids->begin() + first_id, ids->end());
+    ids->erase(std::unique(ids->begin() + first_id, ids->end()), ids->end());
+  }
+}
+
+void LiteralPrefilter::Save(Serializer* out) const {
+  CHECK(compiled_);
+  out->WriteVector(ids_);
+  out->WriteBytes(byte_class_, sizeof(byte_class_));
+  out->WriteInt32(num_classes_);
+  out->WriteVector(transitions_);
+  out->WriteVector(first_output_);
+  out->WriteVector(outputs_);
+  out->WriteVector(next_output_);
+}
+
+bool LiteralPrefilter::Load(Deserializer* in, int num_ids) {
+  CHECK(!compiled_ && ids_.empty());
+  if (!in->ReadVector(&ids_) ||
+      !in->ReadBytes(byte_class_, sizeof(byte_class_)) ||
+      !in->ReadInt32(&num_classes_) ||
+      !in->ReadVector(&transitions_) ||
+      !in->ReadVector(&first_output_) ||
+      !in->ReadVector(&outputs_) ||
+      !in->ReadVector(&next_output_)) {
+    return false;
+  }
+  compiled_ = true;
+
+  // Match() trusts the automaton: checks that all the transitions, byte
+  // classes and outputs stay within the tables.
+  int32 num_states = next_output_.size();
+  if (num_classes_ <= 0 || num_states == 0 ||
+      transitions_.size() != uint64(num_states) * num_classes_ ||
+      first_output_.size() != uint32(num_states) + 1 ||
+      first_output_[0] != 0 ||
+      first_output_[num_states] != static_cast<int>(outputs_.size())) {
+    return false;
+  }
+  for (int b = 0; b < 256; ++b) {
+    if (byte_class_[b] >= num_classes_) {
+      return false;
+    }
+  }
+  for (uint32 t = 0; t < transitions_.size(); ++t) {
+    if (transitions_[t] < 0 || transitions_[t] >= num_states) {
+      return false;
+    }
+  }
+  for (int32 s = 0; s < num_states; ++s) {
+    if (first_output_[s] > first_output_[s + 1] ||
+        next_output_[s] < -1 || next_output_[s] >= num_states) {
+      return false;
+    }
+  }
+  for (uint i = 0; i < outputs_.size(); ++i) {
+    if (outputs_[i] < 0 || outputs_[i] >= num_ids) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//
+// Extraction of the required literals of a pattern.
+//
+
+// Moves the current literal @p run to the @p literals, if not empty.
+static void flush_literal(string* run, vector<string>* literals) {
+  if (!run->empty()) {
+    literals->push_back(*run);
+    run->clear();
+  }
+}
+
+// Skips the bracket expression starting at @p pos (after the '['), and sets
+// @p literal to its only character if it has a single one (or to -1).
+// Returns false if the bracket expression is not terminated.
+static bool skip_bracket(const string& pattern, uint32* pos, int* literal) {
+  uint32 start = *pos;
+  bool first = true;
+  while (*pos < pattern.size() && (first || pattern[*pos] != ']')) {
+    first = (pattern[*pos] == '^' && *pos == start);
+    if (pattern[*pos] == '[' && *pos + 1 < pattern.size() &&
+        strchr(":.=", pattern[*pos + 1])) {
+      char delimiter[] = {pattern[*pos + 1], ']', '\0'};
+      string::size_type close = pattern.find(delimiter, *pos + 2);
+      if (close == string::npos) {
+        return false;
+      }
+      *pos = close + 1;
+    }
+    (*pos)++;
+  }
+  if (*pos >= pattern.size()) {
+    return false;
+  }
+  *literal = (*pos == start + 1 && pattern[start] != '\\') ?
+      pattern[start] : -1;
+  (*pos)++;
+  return true;
+}
+
+// Parses the repetition operators at @p pos (if any). Returns the minimal
+// number of repetitions (1 if there is no operator), and sets @p repeated if
+// there is one.
+static int parse_repetitions(const string& pattern, uint32* pos,
+                             bool* repeated) {
+  int min = 1;
+  *repeated = false;
+  while (*pos < pattern.size()) {
+    char c = pattern[*pos];
+    if (c == '*' || c == '?') {
+      min = 0;
+    } else if (c == '{') {
+      min = min ? atoi(pattern.c_str() + *pos + 1) : 0;
+      string::size_type close = pattern.find('}', *pos);
+      *pos = (close == string::npos) ? pattern.size() - 1 : close;
+    } else if (c != '+') {
+      break;
+    }
+    *repeated = true;
+    (*pos)++;
+  }
+  return min;
+}
+
+// Collects into @p literals the literals that a match of the sequence at
+// @p pos must contain, up to the end of the enclosing group. Returns false if
+// the sequence is an alternation (which then requires no literal).
+static bool get_sequence_literals(const string& pattern, uint32* pos,
+                                  vector<string>* literals) {
+  vector<string> sequence_literals;
+  string run;
+  bool alternation = false;
+  while (*pos < pattern.size() && pattern[*pos] != ')') {
+    char c = pattern[(*pos)++];
+    int literal = -1;
+    bool group = false, group_literals = false;
+    vector<string> inner_literals;
+    if (c == '|') {
+      alternation = true;
+      continue;
+    } else if (c == '(') {
+      group = true;
+      group_literals = get_sequence_literals(pattern, pos, &inner_literals);
+      if (*pos < pattern.size()) {
+        (*pos)++;
+      }
+    } else if (c == '[') {
+      if (!skip_bracket(pattern, pos, &literal)) {
+        return false;
+      }
+    } else if (c == '\\') {
+      // Escaped letters and digits are classes or back-references, and some
+      // escaped punctuation are word or buffer boundaries.
+      if (*pos < pattern.size() && !isalnum(pattern[*pos]) &&
+          !strchr("<>`'", pattern[*pos])) {
+        literal = pattern[*pos];
+      }
+      (*pos)++;
+    } else if (c != '.' && c != '^' && c != '$') {
+      literal = c;
+    }
+
+    bool repeated = false;
+    int min = parse_repetitions(pattern, pos, &repeated);
+    if (literal >= 0 && min > 0) {
+      // A repeated character ends the literal, but also starts the next one
+      // (e.g. "ab+c" requires "ab" and "bc").
+      run.push_back(tolower(literal));
+      if (repeated) {
+        flush_literal(&run, &sequence_literals);
+        run.push_back(tolower(literal));
+      }
+    } else {
+      flush_literal(&run, &sequence_literals);
+      if (group && group_literals && min > 0) {
+        sequence_literals.insert(sequence_literals.end(),
+                                 inner_literals.begin(), inner_literals.end());
+      }
+    }
+  }
+  flush_literal(&run, &sequence_literals);
+
+  if (alternation) {
+    return false;
+  }
+  literals->insert(literals->end(), sequence_literals.begin(),
+                   sequence_literals.end());
+  return true;
+}
+
+bool LiteralPrefilter::GetRequiredLiteral(const string& pattern,
+                                          string* literal) {
+  vector<string> literals;
+  uint32 pos = 0;
+  if (!get_sequence_literals(pattern, &pos, &literals) ||
+      pos != pattern.size()) {
+    return false;
+  }
+
+  literal->clear();
+  for (uint i = 0; i < literals.size(); ++i) {
+    if (literals[i].size() > literal->size()) {
+      *literal = literals[i];
+    }
+  }
+  return literal->size() >= kMinLiteralLength;
+}
@@ -0,0 +1,89 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LITERAL_PREFILTER_H__
+#define LITERAL_PREFILTER_H__
+
+#include "base/basictypes.h"
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+class Deserializer;
+class Serializer;
+
+// Case-insensitive multi-literal matcher (Aho-Corasick automaton), used to
+// skip the regexps which can't match a string: each regexp is registered with
+// a literal any of its matches must contain, and is only evaluated when that
+// literal occurs in the string.
+class LiteralPrefilter {
+ public:
+  // Minimal length of the literals worth registering.
+  static const uint32 kMinLiteralLength = 2;
+
+  LiteralPrefilter();
+
+  // Number of registered literals.
+  int size() const { return ids_.size(); }
+
+  // Registers the @p literal, identified by @p id. Literals can't be added
+  // once the prefilter is compiled.
+  void Add(int id, const string& literal);
+
+  // Builds the automaton.
+  void Compile();
+
+  // Appends the ids of the literals occurring in the @p length bytes of
+  // @p data to @p ids, in increasing order.
+  void Match(const char* data, uint32 length, vector<int>* ids) const;
+
+  // Extracts into @p literal the longest literal that any string fully
+  // matching the (POSIX extended, case-insensitive) @p pattern must contain,
+  // in lower case. Returns false if no such literal of at least
+  // kMinLiteralLength bytes is found.
+  static bool GetRequiredLiteral(const string& pattern, string* literal);
+
+  // Saves the compiled automaton to @p out, or loads it from @p in into an
+  // empty prefilter (which is then compiled). Load() returns false if the
+  // automaton is not consistent, or has ids outside [0, @p num_ids[.
+  void Save(Serializer* out) const;
+  bool Load(Deserializer* in, int num_ids);
+
+ private:
+  // Registered literals (lower case) and their ids.
+  vector<string> literals_;
+  vector<int> ids_;
+
+  // Automaton: bytes are mapped to classes (bytes absent from the literals
+  // share class 0), and the transition from the state s on byte b is
+  // transitions_[s * num_classes_ + byte_class_[b]], the root being 0.
+  // The ids of the literals ending in the state s are in
+  // outputs_[first_output_[s], first_output_[s + 1][; next_output_[s] is the
+  // next state (following the failure links) with some output, or -1.
+  bool compiled_;
+  uint8 byte_class_[256];
+  int num_classes_;
+  vector<int32> transitions_;
+  vector<int> first_output_;
+  vector<int> outputs_;
+  vector<int32> next_output_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(LiteralPrefilter);
+};
+
+#endif  // LITERAL_PREFILTER_H__
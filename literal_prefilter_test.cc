@@ -0,0 +1,261 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Tests of the LiteralPrefilter. The literal required by a pattern must occur
+// (ignoring case) in every random string boost::regex_match matches in full
+// with the pattern, as the regexp is skipped otherwise; and the automaton must
+// find the same literals in random strings as a naive search, on sets of
+// literals overlapping one another. Failed checks abort the test with an
+// error.
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "literal_prefilter.h"
+#include "serializer.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+
+using std::set;
+using std::string;
+using std::vector;
+
+// Number of random strings, of random patterns and of random literal sets.
+static const int kNumStrings = 20000;
+static const int kNumRandomPatterns = 2000;
+static const int kNumRandomLiteralSets = 50;
+
+// Patterns whose literal extraction is checked: repetitions, brackets,
+// alternations inside and outside groups, and escaped punctuation.
+static const char* kPatterns[] = {
+  "ab+c", "ab{0,1}c", "ab*c", "abc?d", "ab{3}c", "(ab){2}", "(foo)+bar",
+  "foo(bar)*baz", "a(bc)?de", "[]a]", "xx[]a]yy", "[^]a]bc", "foo|bar",
+  "(foo|bar)baz", "ab(cd|ce)f", "x(abc|abd)yz", "(a|b)cde", "foo|foobar",
+  "\\.exe$", ".*\\.tar\\.gz", "^/ads/.*", "a\\+b\\*c", "\\(ab\\)", "a.b",
+  "ABC", "[a-c]{2}de",
+};
+
+// Strings matching the handpicked patterns, added to the random strings so
+// that each pattern with a literal matches at least one string.
+static const char* kMatchingStrings[] = {
+  "aBBc", "abcD", "abbbc", "ABAB", "fooFOObar", "foobarBARbaz", "abcde",
+  "xxayy", "xx]YY", "xbc", "barbaz", "abcef", "xabcyz", "XABDyz", "bcde",
+  "a.EXE", "a/b.tar.gz", "/ads/", "/ads/x", "A+B*C", "(ab)", "abc", "cade",
+};
+
+// Fragments of the patterns, from which the strings are made.
+static const char* kFragments[] = {
+  "a", "b", "c", "d", "e", "f", "x", "y", "z", "ab", "bc", "cd", "ce", "de",
+  "foo", "bar", "baz", "FOO", "]", ".", "exe", "tar", "gz", "+", "*", "(",
+  ")", "/", "ads", "yz", "A", "B",
+};
+
+// Atoms and repetition operators of the random patterns.
+static const char* kRandomAtoms[] = {
+  "a", "b", "ab", "ba", "c", ".", "[ab]", "[]a]", "(ab|ac)", "(a|b)",
+  "(ab)", "\\.", "(a|ab)c",
+};
+static const char* kRandomOperators[] = {
+  "", "", "", "", "*", "+", "?", "{2}", "{0,1}", "{1,2}",
+};
+static const char* kRandomFragments[] = {
+  "a", "b", "c", "ab", "ac", "]", ".", "A", "B",
+};
+
+#define ARRAY_SIZE(array) static_cast<int>(sizeof(array) / sizeof(*array))
+
+// Returns a string of up to @p max_fragments random @p fragments.
+static string get_random_string(const char** fragments, int num_fragments,
+                                int max_fragments, unsigned int* seed) {
+  string text;
+  int length = rand_r(seed) % (max_fragments + 1);
+  for (int i = 0; i < length; ++i) {
+    text += fragments[rand_r(seed) % num_fragments];
+  }
+  return text;
+}
+
+// Returns a random pattern of up to 5 repeated atoms, possibly alternated
+// with another one.
+static string get_random_pattern(unsigned int* seed) {
+  string pattern;
+  int length = 1 + rand_r(seed) % 5;
+  for (int i = 0; i < length; ++i) {
+    pattern += kRandomAtoms[rand_r(seed) % ARRAY_SIZE(kRandomAtoms)];
+    pattern += kRandomOperators[rand_r(seed) % ARRAY_SIZE(kRandomOperators)];
+  }
+  if (rand_r(seed) % 8 == 0) {
+    pattern += "|";
+    pattern += kRandomAtoms[rand_r(seed) % ARRAY_SIZE(kRandomAtoms)];
+  }
+  return pattern;
+}
+
+static string to_lower(const string& text) {
+  string lower(text);
+  for (uint i = 0; i < lower.size(); ++i) {
+    lower[i] = tolower(lower[i]);
+  }
+  return lower;
+}
+
+// Checks that the literal required by the @p pattern, if any, occurs in all
+// the @p strings the pattern matches. Returns the number of these strings, or
+// -1 if the pattern has no required literal.
+static int check_required_literal(const string& pattern,
+                                  const vector<string>& strings) {
+  boost::regex regex(pattern, boost::regex_constants::extended |
+                                  boost::regex_constants::icase |
+                                  boost::regex_constants::no_except);
+  if (regex.status() != 0) {
+    LOG(FATAL, "Invalid pattern '%s'.", pattern.c_str());
+  }
+  string literal;
+  if (!LiteralPrefilter::GetRequiredLiteral(pattern, &literal)) {
+    return -1;
+  }
+  CHECK(literal.size() >= LiteralPrefilter::kMinLiteralLength);
+  CHECK(literal == to_lower(literal));
+
+  int matches = 0;
+  for (uint s = 0; s < strings.size(); ++s) {
+    if (!boost::regex_match(strings[s].begin(), strings[s].end(), regex)) {
+      continue;
+    }
+    if (to_lower(strings[s]).find(literal) == string::npos) {
+      LOG(FATAL, "'%s' matches '%s', which lacks its literal '%s'.",
+          pattern.c_str(), strings[s].c_str(), literal.c_str());
+    }
+    matches++;
+  }
+  return matches;
+}
+
+// Checks that a prefilter of the @p literals (and a copy saved and loaded
+// again) finds the literals occurring in each of the @p strings.
+static void check_match(const vector<string>& literals,
+                        const vector<string>& strings) {
+  LiteralPrefilter prefilter;
+  for (uint i = 0; i < literals.size(); ++i) {
+    prefilter.Add(i, literals[i]);
+  }
+  prefilter.Compile();
+
+  string saved;
+  Serializer out(&saved);
+  prefilter.Save(&out);
+  LiteralPrefilter loaded;
+  Deserializer in(saved.data(), saved.size());
+  CHECK(loaded.Load(&in, literals.size()) && in.done());
+
+  for (uint s = 0; s < strings.size(); ++s) {
+    const string lower = to_lower(strings[s]);
+    vector<int> expected, ids, loaded_ids;
+    for (uint i = 0; i < literals.size(); ++i) {
+      if (lower.find(to_lower(literals[i])) != string::npos) {
+        expected.push_back(i);
+      }
+    }
+    prefilter.Match(strings[s].data(), strings[s].size(), &ids);
+    loaded.Match(strings[s].data(), strings[s].size(), &loaded_ids);
+    if (ids != expected || loaded_ids != expected) {
+      LOG(FATAL, "The prefilter found %d literals out of %d in '%s'.",
+          static_cast<int>(ids.size()), static_cast<int>(expected.size()),
+          strings[s].c_str());
+    }
+  }
+}
+
+int main() {
+  unsigned int seed = 42;
+  vector<string> strings(kMatchingStrings,
+                         kMatchingStrings + ARRAY_SIZE(kMatchingStrings));
+  for (int i = 0; i < kNumStrings; ++i) {
+    strings.push_back(get_random_string(kFragments, ARRAY_SIZE(kFragments), 6,
+                                        &seed));
+  }
+
+  // Handpicked patterns, each with a literal matching some strings.
+  int num_literals = 0;
+  int matches = 0;
+  for (int i = 0; i < ARRAY_SIZE(kPatterns); ++i) {
+    int pattern_matches = check_required_literal(kPatterns[i], strings);
+    if (pattern_matches >= 0) {
+      CHECK(pattern_matches > 0);
+      num_literals++;
+      matches += pattern_matches;
+    }
+  }
+  printf("%d handpicked patterns, %d with a literal: %d matches contain it\n",
+         ARRAY_SIZE(kPatterns), num_literals, matches);
+
+  // Random patterns.
+  vector<string> random_strings;
+  for (int i = 0; i < kNumStrings; ++i) {
+    random_strings.push_back(get_random_string(
+        kRandomFragments, ARRAY_SIZE(kRandomFragments), 8, &seed));
+  }
+  num_literals = matches = 0;
+  for (int i = 0; i < kNumRandomPatterns; ++i) {
+    int pattern_matches = check_required_literal(get_random_pattern(&seed),
+                                                 random_strings);
+    if (pattern_matches >= 0) {
+      num_literals++;
+      matches += pattern_matches;
+    }
+  }
+  printf("%d random patterns, %d with a literal: %d matches contain it\n",
+         kNumRandomPatterns, num_literals, matches);
+
+  // Literals which are suffixes or infixes of others, hence found through
+  // the failure links, with the classical example first.
+  static const char* kLiterals[] = {
+    "he", "she", "his", "hers", "ab", "bab", "abab", "aab", "aa", "Bc",
+  };
+  static const char* kLiteralFragments[] = {
+    "h", "e", "s", "i", "r", "a", "b", "c", "A", "H", "x",
+  };
+  strings.clear();
+  for (int i = 0; i < kNumStrings; ++i) {
+    strings.push_back(get_random_string(
+        kLiteralFragments, ARRAY_SIZE(kLiteralFragments), 12, &seed));
+  }
+  check_match(vector<string>(kLiterals, kLiterals + ARRAY_SIZE(kLiterals)),
+              strings);
+  for (int l = 0; l < kNumRandomLiteralSets; ++l) {
+    set<string> literals;
+    int size = 1 + rand_r(&seed) % 30;
+    for (int i = 0; i < size; ++i) {
+      string literal;
+      int length = 2 + rand_r(&seed) % 4;
+      for (int j = 0; j < length; ++j) {
+        literal += "abc"[rand_r(&seed) % 3];
+      }
+      literals.insert(literal);
+    }
+    check_match(vector<string>(literals.begin(), literals.end()), strings);
+  }
+  printf("%d literal sets matched as by a naive search\n",
+         kNumRandomLiteralSets + 1);
+
+  printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "mapped_file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile() {
+  if (data_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+bool MappedFile::Map(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  bool mapped = (fstat(fd, &status) == 0);
+  if (mapped && status.st_size > 0) {
+    void* data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      mapped = false;
+    } else {
+      data_ = static_cast<const char*>(data);
+      size_ = status.st_size;
+    }
+  }
+  close(fd);
+  return mapped;
+}
+
+bool ReplaceFile(const string& path, const string& contents) {
+  string temporary_path = path + ".tmp";
+  FILE* file = fopen(temporary_path.c_str(), "wb");
+  if (!file) {
+    LOG(ERROR, "Could not create '%s' (%s).", temporary_path.c_str(),
+        strerror(errno));
+    return false;
+  }
+  bool written =
+      (fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+  written = (fclose(file) == 0) && written;
+  if (!written || rename(temporary_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR, "Could not write '%s' (%s).", path.c_str(), strerror(errno));
+    unlink(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
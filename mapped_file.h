@@ -0,0 +1,50 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef MAPPED_FILE_H__
+#define MAPPED_FILE_H__
+
+#include "base/basictypes.h"
+#include <string>
+
+using std::string;
+
+// Read-only memory mapping of a whole file, shared by all the threads.
+class MappedFile {
+ public:
+  MappedFile() : data_(NULL), size_(0) {}
+  ~MappedFile();
+
+  // Maps the file at @p path. Returns false on failure (empty files can't be
+  // mapped, but are valid).
+  bool Map(const string& path);
+
+  const char* data() const { return data_; }
+  uint64 size() const { return size_; }
+
+ private:
+  const char* data_;
+  uint64 size_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(MappedFile);
+};
+
+// Replaces the file at @p path with the @p contents, through a temporary file,
+// so that readers never see a partial file. Returns false on failure.
+bool ReplaceFile(const string& path, const string& contents);
+
+#endif  // MAPPED_FILE_H__
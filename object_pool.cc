@@ -0,0 +1,184 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "object_pool.h"
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <pthread.h>
+
+using std::vector;
+
+// Registered pools. Pools are registered during the static initialization,
+// hence before any other thread is started.
+static ObjectPool* pools[ObjectPool::kMaxPools];
+static int num_pools = 0;
+
+// Caches of the current thread (indexed by pool id), and caches of all the
+// threads (only used for statistics).
+static __thread ObjectPool::ThreadCache* thread_caches = NULL;
+static vector<ObjectPool::ThreadCache*> all_thread_caches;
+static Mutex all_thread_caches_lock;
+
+// Key used to flush the thread caches on thread exit.
+static pthread_key_t thread_caches_key;
+static pthread_once_t thread_caches_key_once = PTHREAD_ONCE_INIT;
+
+// Returns the next free object after @p object, in a free list.
+static inline void*& next_object(void* object) {
+  return *reinterpret_cast<void**>(object);
+}
+
+ObjectPool::ObjectPool(const char* name, size_t object_size)
+  : id_(num_pools), name_(name), object_size_(object_size),
+    slab_objects_(0), free_list_(NULL), lock_() {
+  CHECK(num_pools < kMaxPools);
+  pools[num_pools++] = this;
+
+  // Objects are aligned on 16 bytes, as malloc'ed objects are.
+  object_size_ = (object_size_ + 15) & ~static_cast<size_t>(15);
+  slab_objects_ = kSlabSize / object_size_;
+  if (slab_objects_ < kBatchSize) {
+    slab_objects_ = kBatchSize;
+  }
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void* ObjectPool::Allocate() {
+  if (!thread_caches) {
+    SetupThreadCaches();
+  }
+
+  ThreadCache* cache = &thread_caches[id_];
+  if (!cache->head) {
+    Refill(cache);
+  }
+  void* object = cache->head;
+  cache->head = next_object(object);
+  cache->count--;
+  return object;
+}
+
+void ObjectPool::Free(void* object) {
+  if (!object) {
+    return;
+  }
+  if (!thread_caches) {
+    SetupThreadCaches();
+  }
+
+  ThreadCache* cache = &thread_caches[id_];
+  next_object(object) = cache->head;
+  cache->head = object;
+  cache->count++;
+  if (cache->count >= 2 * kBatchSize) {
+    Flush(cache, kBatchSize);
+  }
+}
+
+void ObjectPool::GetStats(Stats* stats) {
+  {
+    MutexLock ml(&lock_);
+    *stats = stats_;
+  }
+
+  MutexLock ml(&all_thread_caches_lock);
+  for (uint i = 0; i < all_thread_caches.size(); ++i) {
+    stats->cached += all_thread_caches[i][id_].count;
+  }
+  stats->in_use = stats->capacity - stats->free - stats->cached;
+}
+
+void ObjectPool::LogStats() {
+  for (int i = 0; i < num_pools; ++i) {
+    Stats stats;
+    pools[i]->GetStats(&stats);
+    LOG(INFO, "Pool %s: %d objects in use, %d cached by threads, %d free "
+              "(%d slabs, %d kB).",
+        pools[i]->name_, stats.in_use, stats.cached, stats.free, stats.slabs,
+        static_cast<int>((stats.capacity * pools[i]->object_size_) >> 10));
+  }
+}
+
+void ObjectPool::Refill(ThreadCache* cache) {
+  MutexLock ml(&lock_);
+  if (stats_.free < kBatchSize) {
+    char* slab = reinterpret_cast<char*>(malloc(slab_objects_ * object_size_));
+    CHECK(slab != NULL);
+    for (int i = 0; i < slab_objects_; ++i) {
+      void* object = slab + i * object_size_;
+      next_object(object) = free_list_;
+      free_list_ = object;
+    }
+    stats_.slabs++;
+    stats_.capacity += slab_objects_;
+    stats_.free += slab_objects_;
+  }
+
+  for (int i = 0; i < kBatchSize; ++i) {
+    void* object = free_list_;
+    free_list_ = next_object(object);
+    next_object(object) = cache->head;
+    cache->head = object;
+  }
+  cache->count += kBatchSize;
+  stats_.free -= kBatchSize;
+}
+
+void ObjectPool::Flush(ThreadCache* cache, int count) {
+  MutexLock ml(&lock_);
+  for (int i = 0; i < count && cache->head; ++i) {
+    void* object = cache->head;
+    cache->head = next_object(object);
+    cache->count--;
+    next_object(object) = free_list_;
+    free_list_ = object;
+    stats_.free++;
+  }
+}
+
+void ObjectPool::SetupThreadCaches() {
+  thread_caches = reinterpret_cast<ThreadCache*>(
+      calloc(kMaxPools, sizeof(ThreadCache)));
+  CHECK(thread_caches != NULL);
+  pthread_once(&thread_caches_key_once, &ObjectPool::CreateThreadCachesKey);
+  pthread_setspecific(thread_caches_key, thread_caches);
+
+  MutexLock ml(&all_thread_caches_lock);
+  all_thread_caches.push_back(thread_caches);
+}
+
+void ObjectPool::CreateThreadCachesKey() {
+  CHECK(pthread_key_create(&thread_caches_key,
+                           &ObjectPool::FlushThreadCaches) == 0);
+}
+
+void ObjectPool::FlushThreadCaches(void* caches) {
+  ThreadCache* thread_cache = reinterpret_cast<ThreadCache*>(caches);
+  for (int i = 0; i < num_pools; ++i) {
+    pools[i]->Flush(&thread_cache[i], thread_cache[i].count);
+  }
+
+  {
+    MutexLock ml(&all_thread_caches_lock);
+    all_thread_caches.erase(std::find(all_thread_caches.begin(),
+                                      all_thread_caches.end(), thread_cache));
+  }
+  free(thread_cache);
+  thread_caches = NULL;
+}
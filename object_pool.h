@@ -0,0 +1,103 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef OBJECT_POOL_H__
+#define OBJECT_POOL_H__
+
+#include "base/basictypes.h"
+#include "base/mutex.h"
+#include <stddef.h>
+
+// Pool of fixed-size objects, meant to back the class-specific operator
+// new/delete of frequently allocated classes. Objects are carved from large
+// slabs, which are never returned to the system, so that connection churn
+// neither stresses malloc nor fragments the heap.
+// Each thread keeps a cache of free objects, refilled from (and flushed to)
+// the pool's global free list by batches of kBatchSize objects; most
+// allocations and deallocations hence take no lock. The caches of exiting
+// threads are flushed back to the pool.
+// Pools must be static objects (at most kMaxPools of them).
+class ObjectPool {
+ public:
+  // Maximal number of pools, number of objects moved at once between the
+  // thread caches and the global free list, and minimal size of a slab.
+  static const int kMaxPools = 8;
+  static const int kBatchSize = 64;
+  static const int kSlabSize = 64 * (1 << 10);  // 64k
+
+  // Occupancy statistics of a pool. The number of cached objects is read
+  // without synchronization with the threads, and is hence approximate.
+  struct Stats {
+    int slabs;        // Number of slabs.
+    int capacity;     // Number of objects in the slabs.
+    int in_use;       // Number of allocated objects.
+    int cached;       // Number of free objects in the thread caches.
+    int free;         // Number of free objects in the global free list.
+  };
+
+  // Per-thread cache of free objects of a pool.
+  struct ThreadCache {
+    void* head;
+    int count;
+  };
+
+  // Sets up a pool for objects of @p object_size bytes. The @p name is only
+  // used for statistics.
+  ObjectPool(const char* name, size_t object_size);
+
+  // Returns a new uninitialized object, or releases the @p object.
+  void* Allocate();
+  void Free(void* object);
+
+  // Fills the @p stats with the pool's current statistics.
+  void GetStats(Stats* stats);
+
+  // Logs the statistics of all pools.
+  static void LogStats();
+
+ private:
+  // Moves a batch of free objects from the global free list to the @p cache;
+  // allocates a new slab when needed.
+  void Refill(ThreadCache* cache);
+
+  // Moves @p count free objects from the @p cache to the global free list.
+  void Flush(ThreadCache* cache, int count);
+
+  // Sets up the caches of the calling thread.
+  static void SetupThreadCaches();
+
+  // Flushes the @p caches of the exiting thread (pthread key destructor).
+  static void FlushThreadCaches(void* caches);
+  static void CreateThreadCachesKey();
+
+  // Pool identifier (index of the pool's thread caches), name and object
+  // size.
+  int id_;
+  const char* name_;
+  size_t object_size_;
+  int slab_objects_;
+
+  // Global free list (linked through the first word of the free objects), and
+  // statistics (slabs, capacity and free only); protected by the lock_.
+  void* free_list_;
+  Stats stats_;
+  Mutex lock_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ObjectPool);
+};
+
+#endif  // OBJECT_POOL_H__
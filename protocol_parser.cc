@@ -0,0 +1,503 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/googleinit.h"
+#include "base/logging.h"
+#include "protocol_parser.h"
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define PROTOCOL_PARSER_X86
+#include <immintrin.h>
+#endif
+
+//
+// Byte scans.
+//
+
+// Scalar implementations.
+static const char* find_line_end_scalar(const char* data, uint32 length) {
+  for (uint32 i = 0; i < length; ++i) {
+    if (data[i] == '\r' || data[i] == '\n') {
+      return data + i;
+    }
+  }
+  return NULL;
+}
+
+static const char* find_last_space_scalar(const char* data, uint32 length) {
+  for (uint32 i = length; i > 0; --i) {
+    if (data[i - 1] == ' ') {
+      return data + i - 1;
+    }
+  }
+  return NULL;
+}
+
+#ifdef PROTOCOL_PARSER_X86
+// SSE2 and AVX2 implementations: blocks of 16 (resp. 32) bytes are compared
+// at once, and the remaining bytes are scanned with the scalar version. They
+// are compiled for their instruction set whatever the compiler flags, and only
+// called when the processor supports it.
+__attribute__((target("sse2")))
+static const char* find_line_end_sse2(const char* data, uint32 length) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  uint32 i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, cr),
+                                              _mm_cmpeq_epi8(block, lf)));
+    if (mask) {
+      return data + i + __builtin_ctz(mask);
+    }
+  }
+  return find_line_end_scalar(data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static const char* find_last_space_sse2(const char* data, uint32 length) {
+  const __m128i space = _mm_set1_epi8(' ');
+  uint32 i = length;
+  for (; i >= 16; i -= 16) {
+    __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i - 16));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, space));
+    if (mask) {
+      return data + i - 16 + (31 - __builtin_clz(mask));
+    }
+  }
+  return find_last_space_scalar(data, i);
+}
+
+__attribute__((target("avx2")))
+static const char* find_line_end_avx2(const char* data, uint32 length) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  uint32 i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    uint32 mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, cr),
+                        _mm256_cmpeq_epi8(block, lf)));
+    if (mask) {
+      return data + i + __builtin_ctz(mask);
+    }
+  }
+  return find_line_end_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static const char* find_last_space_avx2(const char* data, uint32 length) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  uint32 i = length;
+  for (; i >= 32; i -= 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i - 32));
+    uint32 mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, space));
+    if (mask) {
+      return data + i - 32 + (31 - __builtin_clz(mask));
+    }
+  }
+  return find_last_space_scalar(data, i);
+}
+#endif
+
+// Implementation in use; the scalar one until the module is initialized.
+typedef const char* (*ScanFunction)(const char* data, uint32 length);
+static ScanImplementation scan_implementation = SCAN_SCALAR;
+static ScanFunction find_line_end = find_line_end_scalar;
+static ScanFunction find_last_space = find_last_space_scalar;
+
+static bool is_supported(ScanImplementation implementation) {
+#ifdef PROTOCOL_PARSER_X86
+  __builtin_cpu_init();
+  if (implementation == SCAN_SSE2) {
+    return __builtin_cpu_supports("sse2");
+  } else if (implementation == SCAN_AVX2) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return implementation == SCAN_SCALAR;
+}
+
+ScanImplementation GetScanImplementation() {
+  return scan_implementation;
+}
+
+bool SetScanImplementation(ScanImplementation implementation) {
+  if (!is_supported(implementation)) {
+    return false;
+  }
+
+  scan_implementation = implementation;
+  find_line_end = find_line_end_scalar;
+  find_last_space = find_last_space_scalar;
+#ifdef PROTOCOL_PARSER_X86
+  if (implementation == SCAN_SSE2) {
+    find_line_end = find_line_end_sse2;
+    find_last_space = find_last_space_sse2;
+  } else if (implementation == SCAN_AVX2) {
+    find_line_end = find_line_end_avx2;
+    find_last_space = find_last_space_avx2;
+  }
+#endif
+  return true;
+}
+
+static void initialize_detector_tokens();
+
+REGISTER_MODULE_INITIALIZER(protocol_parser, {
+  if (!SetScanImplementation(SCAN_AVX2)) {
+    SetScanImplementation(SCAN_SSE2);
+  }
+  initialize_detector_tokens();
+});
+
+const char* FindLineEnd(const char* data, uint32 length) {
+  return find_line_end(data, length);
+}
+
+//
+// Line parsers.
+//
+
+// Character classes of the regexps (which are case-insensitive).
+static inline bool is_letter(char c) {
+  return static_cast<uint8>((c | 0x20) - 'a') < 26;
+}
+
+static inline bool is_digit(char c) {
+  return static_cast<uint8>(c - '0') < 10;
+}
+
+static inline bool is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Returns true if the @p data starts with the upper-case @p word, ignoring
+// case; the @p data must be at least as long as the @p word.
+static inline bool has_word(const char* data, const char* word) {
+  for (; *word; ++data, ++word) {
+    if ((*data & ~0x20) != *word) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sets the optional output parameters of the request parsers.
+static inline void set_field(const char* start, const char* end,
+                             StringPiece* field) {
+  if (field) {
+    field->set(start, end - start);
+  }
+}
+
+bool ParseHttpRequestLine(const StringPiece& line,
+                          StringPiece* method, StringPiece* url) {
+  // The method is the leading letters, and must be followed by a space.
+  const char* end = line.end();
+  const char* method_end = line.begin();
+  while (method_end < end && is_letter(*method_end)) {
+    ++method_end;
+  }
+  if (method_end == line.begin() || method_end == end ||
+      *method_end != ' ') {
+    return false;
+  }
+
+  // The url is greedy: it ends at the last " HTTP" followed by the end of the
+  // line, by a "\r" ending the line, or by a "/".
+  const char* url_start = method_end + 1;
+  const char* candidate = end;
+  while ((candidate = find_last_space(url_start, candidate - url_start))) {
+    uint32 remaining = end - candidate;
+    if (remaining >= 5 && has_word(candidate + 1, "HTTP") &&
+        (remaining == 5 || candidate[5] == '/' ||
+         (remaining == 6 && candidate[5] == '\r'))) {
+      set_field(line.begin(), method_end, method);
+      set_field(url_start, candidate, url);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseHttpResponseLine(const StringPiece& line) {
+  const char* end = line.end();
+  if (line.size() < 4 || !has_word(line.data(), "HTTP")) {
+    return false;
+  }
+
+  // Optional version: a slash and at least one digit or dot (the backslash
+  // of the regexp's bracket expression being a literal one).
+  const char* position = line.begin() + 4;
+  if (position < end && *position == '/') {
+    const char* version = ++position;
+    while (position < end &&
+           (is_digit(*position) || *position == '.' || *position == '\\')) {
+      ++position;
+    }
+    if (position == version) {
+      return false;
+    }
+  }
+
+  // Status code, which must end the line.
+  if (position == end || *position != ' ') {
+    return false;
+  }
+  const char* status = ++position;
+  while (position < end && is_digit(*position)) {
+    ++position;
+  }
+  return position != status && position == end;
+}
+
+bool HasHttpUrlLength(const StringPiece& partial_url, uint32 length) {
+  if (partial_url.size() < length + 4) {
+    return false;
+  }
+  for (uint32 i = 0; i < length; ++i) {
+    if (partial_url[i] == ' ' && has_word(partial_url.data() + i + 1, "HTTP")) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ParseHttpStatusLine(const StringPiece& line, int* status) {
+  const char* end = line.end();
+  if (line.size() < 5 || !has_word(line.data(), "HTTP") || line[4] != '/') {
+    return false;
+  }
+  const char* position = line.begin() + 5;
+  while (position < end && (is_digit(*position) || *position == '.')) {
+    ++position;
+  }
+  if (end - position < 4 || *position != ' ' || !is_digit(position[1]) ||
+      !is_digit(position[2]) || !is_digit(position[3]) ||
+      (end - position > 4 && position[4] != ' ' && position[4] != '\r')) {
+    return false;
+  }
+  *status = (position[1] - '0') * 100 + (position[2] - '0') * 10 +
+      (position[3] - '0');
+  return true;
+}
+
+bool ParseFtpServerLine(const StringPiece& line) {
+  return line.size() >= 4 && line[0] == '2' && is_digit(line[1]) &&
+      is_digit(line[2]) && line[3] == ' ';
+}
+
+bool ParseFtpRequestLine(const StringPiece& line,
+                         StringPiece* method, StringPiece* url) {
+  const char* end = line.end();
+  const char* command = line.begin();
+  while (command < end && is_space(*command)) {
+    ++command;
+  }
+  if (end - command < 5 || command[4] != ' ') {
+    return false;
+  }
+  if (!has_word(command, "RETR") && !has_word(command, "STOR") &&
+      !has_word(command, "STOU") && !has_word(command, "APPE") &&
+      !has_word(command, "REST")) {
+    return false;
+  }
+
+  set_field(command, command + 4, method);
+  set_field(command + 5, end, url);
+  return true;
+}
+
+StringPiece StripUrlScheme(const StringPiece& url) {
+  const char* position = url.begin();
+  while (position < url.end() && is_letter(*position)) {
+    ++position;
+  }
+  if (position == url.begin() || url.end() - position < 3 ||
+      memcmp(position, "://", 3) != 0) {
+    return url;
+  }
+  position += 3;
+  return StringPiece(position, url.end() - position);
+}
+
+// Points @p host to the host of the [@p start, @p end[ authority, without the
+// user info and the port. Returns false if the host is empty.
+static bool get_authority_host(const char* start, const char* end,
+                               StringPiece* host) {
+  for (const char* position = start; position < end; ++position) {
+    if (*position == '@') {
+      start = position + 1;
+    }
+  }
+  const char* host_end = start;
+  while (host_end < end && *host_end != ':') {
+    ++host_end;
+  }
+  if (host_end == start) {
+    return false;
+  }
+  host->set(start, host_end - start);
+  return true;
+}
+
+bool ParseUrlHost(const StringPiece& url, StringPiece* host) {
+  StringPiece authority = StripUrlScheme(url);
+  if (authority.data() == url.data()) {
+    return false;
+  }
+
+  // The authority ends at the first '/', '?' or '#'.
+  const char* end = authority.begin();
+  while (end < authority.end() && *end != '/' && *end != '?' && *end != '#') {
+    ++end;
+  }
+  return get_authority_host(authority.begin(), end, host);
+}
+
+bool ParseHostHeader(const StringPiece& value, StringPiece* host) {
+  return get_authority_host(value.begin(), value.end(), host);
+}
+
+//
+// Protocol detection.
+//
+
+// Tokens starting each protocol; upper case letters also match lower case
+// letters, and '#' matches any digit.
+struct DetectorToken {
+  const char* text;
+  ProtocolDetector::Result result;
+};
+static const DetectorToken kDetectorTokens[] = {
+  {"GET ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"HEAD ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"POST ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"PUT ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"DELETE ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"OPTIONS ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"TRACE ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"CONNECT ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"PATCH ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"PROPFIND ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"PROPPATCH ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"MKCOL ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"COPY ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"MOVE ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"LOCK ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"UNLOCK ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"SEARCH ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"REPORT ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"PURGE ", ProtocolDetector::DETECT_HTTP_REQUEST},
+  {"HTTP/", ProtocolDetector::DETECT_HTTP_RESPONSE},
+  {"HTTP ", ProtocolDetector::DETECT_HTTP_RESPONSE},
+  {"2## ", ProtocolDetector::DETECT_FTP_SERVER},
+};
+static const int kNumDetectorTokens =
+    sizeof(kDetectorTokens) / sizeof(kDetectorTokens[0]);
+
+// Tokens which may start with each byte.
+static uint32 first_byte_candidates[256];
+
+static inline bool token_matches(char token, char c) {
+  if (token == '#') {
+    return is_digit(c);
+  }
+  return is_letter(token) ? (c & ~0x20) == token : c == token;
+}
+
+static void initialize_detector_tokens() {
+  CHECK(kNumDetectorTokens <= 32);
+  for (int c = 0; c < 256; ++c) {
+    first_byte_candidates[c] = 0;
+    for (int t = 0; t < kNumDetectorTokens; ++t) {
+      if (token_matches(kDetectorTokens[t].text[0], static_cast<char>(c))) {
+        first_byte_candidates[c] |= 1U << t;
+      }
+    }
+  }
+}
+
+ProtocolDetector::ProtocolDetector()
+  : candidates_(0), position_(0), result_(DETECT_PENDING),
+    generic_state_(GENERIC_METHOD), generic_matched_(0) {
+}
+
+ProtocolDetector::Result ProtocolDetector::Update(const char* data,
+                                                  uint32 length) {
+  for (uint32 i = position_; i < length && result_ == DETECT_PENDING; ++i) {
+    // Keeps the tokens matching the byte, and stops on the first complete
+    // one (no token is a prefix of another one).
+    uint32 candidates = first_byte_candidates[static_cast<uint8>(data[i])];
+    if (position_ > 0) {
+      candidates = 0;
+      for (uint32 left = candidates_; left; left &= left - 1) {
+        int t = __builtin_ctz(left);
+        if (token_matches(kDetectorTokens[t].text[position_], data[i])) {
+          candidates |= 1U << t;
+        }
+      }
+    }
+    candidates_ = candidates;
+    ++position_;
+
+    // Other methods: "token SP ... HTTP/" on the first line.
+    static const char kHttpVersion[] = " HTTP/";
+    if (generic_state_ == GENERIC_METHOD) {
+      if (data[i] == ' ' && position_ > 1) {
+        generic_state_ = GENERIC_URL;
+      } else if (!is_letter(data[i])) {
+        generic_state_ = GENERIC_NONE;
+      }
+    } else if (generic_state_ == GENERIC_URL) {
+      if (data[i] == '\r' || data[i] == '\n') {
+        generic_state_ = GENERIC_NONE;
+      } else if (token_matches(kHttpVersion[generic_matched_], data[i])) {
+        if (kHttpVersion[++generic_matched_] == '\0') {
+          result_ = DETECT_HTTP_REQUEST;
+        }
+      } else {
+        generic_matched_ = (data[i] == ' ');
+      }
+    }
+
+    if (candidates_ == 0 && generic_state_ == GENERIC_NONE) {
+      result_ = DETECT_NONE;
+    }
+    for (uint32 left = candidates_; left; left &= left - 1) {
+      int t = __builtin_ctz(left);
+      if (kDetectorTokens[t].text[position_] == '\0') {
+        result_ = kDetectorTokens[t].result;
+      }
+    }
+  }
+  return result();
+}
+
+void ProtocolDetector::Swap(ProtocolDetector* other) {
+  std::swap(candidates_, other->candidates_);
+  std::swap(position_, other->position_);
+  std::swap(result_, other->result_);
+  std::swap(generic_state_, other->generic_state_);
+  std::swap(generic_matched_, other->generic_matched_);
+}
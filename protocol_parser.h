@@ -0,0 +1,146 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Hand-written parsers for the http and ftp protocol lines. They accept
+// exactly the lines matched by the regexps the classifier used to run (listed
+// with each parser), and extract the same fields, but work in place (fields
+// are returned as StringPieces pointing into the line) and don't allocate.
+// The byte scans over whole lines use SSE2 or AVX2 when the processor
+// supports them.
+
+#ifndef PROTOCOL_PARSER_H__
+#define PROTOCOL_PARSER_H__
+
+#include "base/basictypes.h"
+#include "base/stringpiece.h"
+
+// Implementations of the byte scans.
+enum ScanImplementation {
+  SCAN_SCALAR = 0,
+  SCAN_SSE2 = 1,
+  SCAN_AVX2 = 2
+};
+
+// Returns the implementation of the byte scans in use (by default, the best
+// one supported by the processor).
+ScanImplementation GetScanImplementation();
+
+// Switches to the @p implementation of the byte scans. Returns false if the
+// processor doesn't support it.
+bool SetScanImplementation(ScanImplementation implementation);
+
+// Returns a pointer to the first \r or \n of the @p length bytes of @p data,
+// or NULL if there is none.
+const char* FindLineEnd(const char* data, uint32 length);
+
+// Parses an http request line ("^([a-z]+) (.*) HTTP(/.*)?\r?$").
+// Points @p method and @p url to the method and url of the request; output
+// parameters may be NULL.
+bool ParseHttpRequestLine(const StringPiece& line,
+                          StringPiece* method, StringPiece* url);
+
+// Parses an http response line ("^HTTP(/[0-9\.]+)? [0-9]+").
+bool ParseHttpResponseLine(const StringPiece& line);
+
+// Returns true iff the url of an http request line, whose beginning after
+// the method and its space is @p partial_url (the line end having not been
+// received yet), is at least @p length bytes long whatever the rest of the
+// line: the url can't end at a " HTTP" before that length.
+bool HasHttpUrlLength(const StringPiece& partial_url, uint32 length);
+
+// Parses a complete http status line ("HTTP/<version> <code>[ <reason>]",
+// as sent by real servers), and sets @p status to its 3 digits code.
+bool ParseHttpStatusLine(const StringPiece& line, int* status);
+
+// Parses an ftp server reply line ("^2[0-9][0-9] .*$").
+bool ParseFtpServerLine(const StringPiece& line);
+
+// Parses an ftp transfer request line
+// ("^\s*(RETR|STOR|STOU|APPE|REST) (.*)\r?$"), as ParseHttpRequestLine.
+bool ParseFtpRequestLine(const StringPiece& line,
+                         StringPiece* method, StringPiece* url);
+
+// Incremental detector of the protocol spoken by one direction of a
+// connection, from the first bytes it sends: http request methods (GET,
+// POST, ..., and the WebDAV ones) followed by a space, "HTTP/" or "HTTP "
+// for http responses, and 2xx replies for ftp servers. The candidates are
+// selected by the first byte, and narrowed by each following byte, hence
+// every byte is looked at once, and other protocols are usually told apart
+// after their first byte. Requests of other methods are detected once their
+// first line is seen to be a token, a space, and then " HTTP/" (which is
+// looked for up to the end of the line). Only the start of the first line is
+// checked; the protocol handlers validate the whole line.
+class ProtocolDetector {
+ public:
+  enum Result {
+    DETECT_PENDING,        // More bytes are needed.
+    DETECT_HTTP_REQUEST,   // The direction is an http client.
+    DETECT_HTTP_RESPONSE,  // The direction is an http server.
+    DETECT_FTP_SERVER,     // The direction is an ftp server.
+    DETECT_NONE            // The direction is none of the above.
+  };
+
+  ProtocolDetector();
+
+  // Looks at the bytes of the @p length bytes of @p data (all the bytes
+  // sent by the direction so far) which were not seen yet, and returns the
+  // detection result.
+  Result Update(const char* data, uint32 length);
+
+  // Detection result, and number of bytes seen.
+  Result result() const { return static_cast<Result>(result_); }
+  uint32 position() const { return position_; }
+
+  // Exchanges the state of the detector with the @p other detector.
+  void Swap(ProtocolDetector* other);
+
+ private:
+  // Progress of the match of the request lines of other methods.
+  enum GenericState {
+    GENERIC_METHOD,  // In the leading token.
+    GENERIC_URL,     // After the token and its space.
+    GENERIC_NONE     // Not a request line.
+  };
+
+  // Candidate tokens (bit i is set iff the token i matches the bytes seen),
+  // number of bytes seen, and result.
+  uint32 candidates_;
+  uint32 position_;
+  uint8 result_;
+
+  // Generic request line match: state, and number of bytes of " HTTP/"
+  // matched by the last bytes seen.
+  uint8 generic_state_;
+  uint8 generic_matched_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(ProtocolDetector);
+};
+
+// Returns the @p url without its "scheme://" prefix (the @p url itself if it
+// is not an absolute url).
+StringPiece StripUrlScheme(const StringPiece& url);
+
+// Points @p host to the host of the absolute @p url ("scheme://host/...",
+// without the user info and the port), and returns true, or returns false if
+// the url has no host.
+bool ParseUrlHost(const StringPiece& url, StringPiece* host);
+
+// Points @p host to the host of the Host header @p value (without its port),
+// and returns true, or returns false if the value has no host.
+bool ParseHostHeader(const StringPiece& value, StringPiece* host);
+
+#endif  // PROTOCOL_PARSER_H__
@@ -0,0 +1,200 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Benchmark of the protocol line parsers against the regexps they replaced.
+// Random lines (mostly made of protocol fragments, to exercise the corner
+// cases of the regexps) are first checked to be parsed identically by the
+// regexps and by the parsers, with each supported byte scan implementation;
+// realistic request lines are then parsed in a loop by both.
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "protocol_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+#include <google/gflags.h>
+
+using std::string;
+using std::vector;
+
+DEFINE_int32(random_lines, 200000,
+             "Number of random lines checked against the regexps.");
+DEFINE_int32(lines, 10000, "Number of request lines parsed per iteration.");
+DEFINE_int32(iterations, 50, "Number of parsing iterations.");
+DEFINE_int32(seed, 42, "Seed of the line generator.");
+
+// Regexps used by the classifier before the parsers.
+static const boost::regex http_request_line(
+    "^([a-z]+) (.*) HTTP(/.*)?\r?$",
+    boost::regex_constants::extended | boost::regex_constants::icase);
+static const boost::regex http_response_line(
+    "^HTTP(/[0-9\\.]+)? [0-9]+",
+    boost::regex_constants::extended | boost::regex_constants::icase);
+static const boost::regex ftp_server_line(
+    "^2[0-9][0-9] .*$",
+    boost::regex_constants::extended | boost::regex_constants::icase);
+static const boost::regex ftp_request_line(
+    "^\\s*(RETR|STOR|STOU|APPE|REST) (.*)\r?$",
+    boost::regex_constants::extended | boost::regex_constants::icase);
+
+static const char* kImplementationNames[] = { "scalar", "sse2", "avx2" };
+
+static double WallTime() {
+  struct timeval result;
+  gettimeofday(&result, NULL);
+
+  return double(result.tv_sec) + double(result.tv_usec) / 1000000.0;
+}
+
+// Returns a random line made of protocol fragments.
+static string get_random_line(unsigned int* seed) {
+  static const char* kFragments[] = {
+    "GET", "get", "Post", "HTTP", "hTtP", "RETR", "stou", "Appe", "rest",
+    "STOR", " ", " ", " ", "  ", "/", "/1.1", "/1\\0", ".", "\\", "200", "2",
+    "9", "0", "x", "a.b", "\r", "\n", "\t", "\v", "\f", "\x85", "\xc8",
+    "[", "`", "@", ":", "\0",
+  };
+  static const int kNumFragments = sizeof(kFragments) / sizeof(*kFragments);
+  string line;
+  int num_fragments = rand_r(seed) % 10;
+  for (int i = 0; i < num_fragments; ++i) {
+    const char* fragment = kFragments[rand_r(seed) % kNumFragments];
+    line.append(fragment, fragment[0] ? strlen(fragment) : 1);
+  }
+  return line;
+}
+
+// Returns a realistic request line, with an url of up to 512 bytes.
+static string get_request_line(unsigned int* seed) {
+  static const char* kMethods[] = { "GET", "POST", "HEAD" };
+  string line(kMethods[rand_r(seed) % 3]);
+  line += " http://www.example.com/";
+  int url_length = rand_r(seed) % 512;
+  for (int i = 0; i < url_length; ++i) {
+    line += "abcdefghijklmnopqrstuvwxyz0123456789/?&=._-"[rand_r(seed) % 43];
+  }
+  line += " HTTP/1.1";
+  return line;
+}
+
+// Checks that the regexps and the parsers agree on the @p line.
+static void check_line(const string& line) {
+  const char* data = line.data();
+  uint32 length = line.size();
+  StringPiece method, url;
+  boost::cmatch what;
+
+  const char* expected_eol = NULL;
+  for (uint32 i = 0; i < length && !expected_eol; ++i) {
+    if (data[i] == '\r' || data[i] == '\n') {
+      expected_eol = data + i;
+    }
+  }
+  CHECK(FindLineEnd(data, length) == expected_eol);
+
+  bool matched = boost::regex_match(data, data + length, what,
+                                    http_request_line);
+  CHECK(ParseHttpRequestLine(line, &method, &url) == matched);
+  CHECK(!matched || (method.begin() == what[1].first &&
+                     method.end() == what[1].second &&
+                     url.begin() == what[2].first &&
+                     url.end() == what[2].second));
+
+  matched = boost::regex_match(data, data + length, what, ftp_request_line);
+  CHECK(ParseFtpRequestLine(line, &method, &url) == matched);
+  CHECK(!matched || (method.begin() == what[1].first &&
+                     method.end() == what[1].second &&
+                     url.begin() == what[2].first &&
+                     url.end() == what[2].second));
+
+  CHECK(ParseHttpResponseLine(line) ==
+        boost::regex_match(data, data + length, http_response_line));
+  CHECK(ParseFtpServerLine(line) ==
+        boost::regex_match(data, data + length, ftp_server_line));
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  const ScanImplementation best = GetScanImplementation();
+
+  // Differential check.
+  unsigned int seed = FLAGS_seed;
+  vector<string> lines;
+  for (int i = 0; i < FLAGS_random_lines; ++i) {
+    lines.push_back(get_random_line(&seed));
+  }
+  for (int i = 0; i < FLAGS_lines; ++i) {
+    lines.push_back(get_request_line(&seed));
+  }
+  for (int implementation = SCAN_SCALAR; implementation <= best;
+       ++implementation) {
+    CHECK(SetScanImplementation(ScanImplementation(implementation)));
+    for (uint32 i = 0; i < lines.size(); ++i) {
+      check_line(lines[i]);
+    }
+    printf("%-6s: %d lines parsed as by the regexps\n",
+           kImplementationNames[implementation],
+           static_cast<int>(lines.size()));
+  }
+
+  // Parsing speed.
+  lines.erase(lines.begin(), lines.begin() + FLAGS_random_lines);
+  uint64 bytes = 0;
+  for (uint32 i = 0; i < lines.size(); ++i) {
+    bytes += lines[i].size();
+  }
+
+  boost::cmatch what;
+  int matches = 0;
+  double start = WallTime();
+  for (int iteration = 0; iteration < FLAGS_iterations; ++iteration) {
+    for (uint32 i = 0; i < lines.size(); ++i) {
+      const char* data = lines[i].data();
+      matches += boost::regex_match(data, data + lines[i].size(), what,
+                                    http_request_line);
+    }
+  }
+  double elapsed = WallTime() - start;
+  printf("regexp: %8.1f ns/line %8.1f MB/s\n",
+         elapsed * 1e9 / (FLAGS_iterations * lines.size()),
+         FLAGS_iterations * bytes / elapsed / 1e6);
+
+  for (int implementation = SCAN_SCALAR; implementation <= best;
+       ++implementation) {
+    CHECK(SetScanImplementation(ScanImplementation(implementation)));
+    start = WallTime();
+    for (int iteration = 0; iteration < FLAGS_iterations; ++iteration) {
+      for (uint32 i = 0; i < lines.size(); ++i) {
+        StringPiece method, url;
+        matches += (FindLineEnd(lines[i].data(), lines[i].size()) == NULL &&
+                    ParseHttpRequestLine(lines[i], &method, &url));
+      }
+    }
+    elapsed = WallTime() - start;
+    printf("%-6s: %8.1f ns/line %8.1f MB/s\n",
+           kImplementationNames[implementation],
+           elapsed * 1e9 / (FLAGS_iterations * lines.size()),
+           FLAGS_iterations * bytes / elapsed / 1e6);
+  }
+  CHECK(matches > 0);
+  return 0;
+}
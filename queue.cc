@@ -20,12 +20,140 @@
 
 #include "base/logging.h"
 #include "queue.h"
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <linux/netfilter.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+
+// Size of a verdict message: netlink header, nfnetlink header, and the
+// NFQA_VERDICT_HDR and NFQA_MARK attributes.
+static const int kVerdictMessageSize =
+    NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(nfgenmsg)) +
+    NLA_HDRLEN + NLA_ALIGN(sizeof(nfqnl_msg_verdict_hdr)) +
+    NLA_HDRLEN + NLA_ALIGN(sizeof(uint32));
+
+// Returns the current time, in microseconds.
+static int64 WallTimeMicros() {
+  struct timeval result;
+  gettimeofday(&result, NULL);
+
+  return int64(result.tv_sec) * 1000000 + result.tv_usec;
+}
+
+// Appends the @p attribute_type attribute to the netlink message at
+// @p message, and returns the position following the attribute.
+static char* put_attribute(char* message, uint16 attribute_type,
+                           const void* data, uint16 data_length) {
+  nlattr* attribute = reinterpret_cast<nlattr*>(message);
+  attribute->nla_type = attribute_type;
+  attribute->nla_len = NLA_HDRLEN + data_length;
+  memcpy(message + NLA_HDRLEN, data, data_length);
+  return message + NLA_HDRLEN + NLA_ALIGN(data_length);
+}
+
+// Writes at @p message a verdict message of the @p type (NFQNL_MSG_VERDICT or
+// NFQNL_MSG_VERDICT_BATCH) for the @p packet_id of the @p queue, accepting the
+// packet(s) with the @p mark; returns the position following the message.
+static char* put_verdict_message(char* message, int queue, uint16 type,
+                                 uint32 packet_id, uint32 mark) {
+  nlmsghdr* header = reinterpret_cast<nlmsghdr*>(message);
+  header->nlmsg_len = kVerdictMessageSize;
+  header->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+  header->nlmsg_flags = NLM_F_REQUEST;
+  header->nlmsg_seq = 0;
+  header->nlmsg_pid = 0;
+
+  nfgenmsg* nf_header = reinterpret_cast<nfgenmsg*>(NLMSG_DATA(header));
+  nf_header->nfgen_family = AF_UNSPEC;
+  nf_header->version = NFNETLINK_V0;
+  nf_header->res_id = htons(queue);
+
+  nfqnl_msg_verdict_hdr verdict;
+  verdict.verdict = htonl(NF_ACCEPT);
+  verdict.id = htonl(packet_id);
+  uint32 network_mark = htonl(mark);
+
+  char* attributes =
+      reinterpret_cast<char*>(nf_header) + NLMSG_ALIGN(sizeof(nfgenmsg));
+  attributes = put_attribute(attributes, NFQA_VERDICT_HDR,
+                             &verdict, sizeof(verdict));
+  put_attribute(attributes, NFQA_MARK, &network_mark, sizeof(network_mark));
+  return message + kVerdictMessageSize;
+}
+
+// Looks for the conntrack information attached by NFQUEUE to the packet
+// message @p nf_msg (NFQA_CT and NFQA_CT_INFO attributes). Returns false if
+// no conntrack information was attached (the outputs are then left
+// untouched), otherwise returns true and sets the @p conntrack_id, and the
+// @p direction_orig of the packet.
+static bool get_packet_conntrack(const nfgenmsg* nf_msg,
+                                 uint32* conntrack_id, bool* direction_orig) {
+  // The nfgenmsg header is the payload of the netlink message, and is followed
+  // by the packet attributes.
+  const nlmsghdr* header = reinterpret_cast<const nlmsghdr*>(
+      reinterpret_cast<const char*>(nf_msg) - NLMSG_HDRLEN);
+  const char* attributes =
+      reinterpret_cast<const char*>(nf_msg) + NLMSG_ALIGN(sizeof(nfgenmsg));
+  int remaining = static_cast<int>(header->nlmsg_len) -
+      NLMSG_HDRLEN - NLMSG_ALIGN(sizeof(nfgenmsg));
+
+  uint32 id = 0;
+  bool orig = true;
+  bool has_id = false, has_info = false;
+  while (remaining >= NLA_HDRLEN) {
+    const nlattr* attribute = reinterpret_cast<const nlattr*>(attributes);
+    if (attribute->nla_len < NLA_HDRLEN || attribute->nla_len > remaining) {
+      break;
+    }
+    const char* payload = attributes + NLA_HDRLEN;
+    int payload_length = attribute->nla_len - NLA_HDRLEN;
+
+    int type = attribute->nla_type & NLA_TYPE_MASK;
+    if (type == NFQA_CT_INFO && payload_length >= 4) {
+      uint32 conntrack_info;
+      memcpy(&conntrack_info, payload, sizeof(conntrack_info));
+      orig = (ntohl(conntrack_info) < IP_CT_IS_REPLY);
+      has_info = true;
+    } else if (type == NFQA_CT) {
+      // Looks for the CTA_ID attribute in the nested conntrack attributes.
+      while (payload_length >= NLA_HDRLEN) {
+        const nlattr* nested = reinterpret_cast<const nlattr*>(payload);
+        if (nested->nla_len < NLA_HDRLEN || nested->nla_len > payload_length) {
+          break;
+        }
+        if ((nested->nla_type & NLA_TYPE_MASK) == CTA_ID &&
+            nested->nla_len >= NLA_HDRLEN + 4) {
+          memcpy(&id, payload + NLA_HDRLEN, sizeof(id));
+          id = ntohl(id);
+          has_id = true;
+        }
+        payload += NLA_ALIGN(nested->nla_len);
+        payload_length -= NLA_ALIGN(nested->nla_len);
+      }
+    }
+
+    attributes += NLA_ALIGN(attribute->nla_len);
+    remaining -= NLA_ALIGN(attribute->nla_len);
+  }
+
+  if (!has_id || !has_info) {
+    return false;
+  }
+  *conntrack_id = id;
+  *direction_orig = orig;
+  return true;
+}
 
 Queue::Queue(int queue, uint32 mark_mask, ConnTrack* conntrack)
   : conntrack_(conntrack), queue_(queue),
+    save_connmark_(false),
     queue_handle_(NULL), queue_socket_(NULL),
-    must_stop_(false) {
+    must_stop_(false), conntrack_query_handler_(NULL),
+    verdict_batch_size_(1), verdict_batch_latency_us_(0),
+    oldest_pending_verdict_us_(0), pending_verdicts_(),
+    last_verdict_id_(0) {
   if (!set_mark_mask(mark_mask)) {
     LOG(FATAL, "The mark mask must only have consecutive bits on. "
                "Eg. 0x0ff0 is correct, while 0xf0f0 is not.");
@@ -37,37 +165,72 @@ Queue::Queue(int queue, uint32 mark_mask, ConnTrack* conntrack)
     LOG(FATAL, "Unable to open the netfilter queue (%s)", strerror(errno));
   }
 
+  // Binds our handler to the AF_INET and AF_INET6 domains, once per process.
+  bind_protocol_families(queue_handle_);
+}
+
+Queue::~Queue() {
+  if (queue_socket_ != NULL) {
+    nfq_destroy_queue(queue_socket_);
+    queue_socket_ = NULL;
+  }
+
+  if (conntrack_query_handler_ != NULL) {
+    nfct_close(conntrack_query_handler_);
+    conntrack_query_handler_ = NULL;
+  }
+
+  if (queue_handle_ != NULL) {
+    unbind_protocol_families(queue_handle_);
+    nfq_close(queue_handle_);
+    queue_handle_ = NULL;
+  }
+}
+
+// Number of queues using the AF_INET and AF_INET6 bindings; protected by the
+// lock.
+static Mutex bound_queues_lock;
+static int bound_queues = 0;
+
+void Queue::bind_protocol_families(nfq_handle* queue_handle) {
+  MutexLock ml(&bound_queues_lock);
+  if (bound_queues++ > 0) {
+    return;
+  }
+
   // Unbinds existing queue handlers on domains AF_INET and AF_INET6.
   // No check is performed on return value since kernel <= 2.6.24 always
   // return -1.
   LOG(INFO, "Unbinding existing nf_queue handlers for AF_INET/AF_INET6.");
-  nfq_unbind_pf(queue_handle_, AF_INET);
-  nfq_unbind_pf(queue_handle_, AF_INET6);
+  nfq_unbind_pf(queue_handle, AF_INET);
+  nfq_unbind_pf(queue_handle, AF_INET6);
 
   // Binds our queue handler to AF_INET and AF_INET6 domains.
   LOG(INFO, "Binding our handler as nf_queue handler for AF_INET/AF_INET6.");
-  if (nfq_bind_pf(queue_handle_, AF_INET) < 0) {
+  if (nfq_bind_pf(queue_handle, AF_INET) < 0) {
     LOG(FATAL, "Could not bind our handler as AF_INET nf_queue handler (%s).",
         strerror(errno));
   }
-  if (nfq_bind_pf(queue_handle_, AF_INET6) < 0) {
+  if (nfq_bind_pf(queue_handle, AF_INET6) < 0) {
     LOG(FATAL, "Could not bind our handler as AF_INET6 nf_queue handler (%s).",
         strerror(errno));
   }
 }
 
-Queue::~Queue() {
-  if (queue_socket_ != NULL) {
-    nfq_destroy_queue(queue_socket_);
-    queue_socket_ = NULL;
+void Queue::unbind_protocol_families(nfq_handle* queue_handle) {
+  MutexLock ml(&bound_queues_lock);
+  if (--bound_queues > 0) {
+    return;
   }
 
-  if (queue_handle_ != NULL) {
-    nfq_unbind_pf(queue_handle_, AF_INET);
-    nfq_unbind_pf(queue_handle_, AF_INET6);
-    nfq_close(queue_handle_);
-    queue_handle_ = NULL;
-  }
+  nfq_unbind_pf(queue_handle, AF_INET);
+  nfq_unbind_pf(queue_handle, AF_INET6);
+}
+
+void Queue::set_verdict_batching(int max_size, int max_latency_us) {
+  verdict_batch_size_ = std::max(1, std::min(max_size, kMaxVerdictBatchSize));
+  verdict_batch_latency_us_ = std::max(0, max_latency_us);
+  pending_verdicts_.reserve(verdict_batch_size_);
 }
 
 void Queue::Run() {
@@ -85,15 +248,56 @@ void Queue::Run() {
     LOG(FATAL, "Could not set copy_packet mode for NFQUEUE %d (%s).",
         queue_, strerror(errno));
   }
+  if (conntrack_->queue_conntrack() &&
+      nfq_set_queue_flags(queue_socket_, NFQA_CFG_F_CONNTRACK,
+                          NFQA_CFG_F_CONNTRACK) < 0) {
+    LOG(FATAL, "Could not enable conntrack information for NFQUEUE %d (%s).",
+        queue_, strerror(errno));
+  }
 
   // Listens to the queue, and processes packets.
   int fd = nfnl_fd(nfq_nfnlh(queue_handle_));
 
+  // Registers the thread as a reader of the classified cache; the thread is
+  // quiescent between two reads, and offline while blocked on the socket.
+  QuiescentStateReclaimer* reclaimer = conntrack_->reclaimer();
+  int reader = reclaimer->RegisterReader();
+
   int received;
   char buffer[kBufferSize];
-  for (; (received = recv(fd, buffer, kBufferSize, 0)) >= 0 && !must_stop_;) {
+  for (;;) {
+    // When verdicts are pending, only polls the socket, so that the pending
+    // verdicts are sent as soon as the socket is drained.
+    int flags = (pending_verdicts_.empty() ? 0 : MSG_DONTWAIT);
+    if (!flags) {
+      reclaimer->Offline(reader);
+    }
+    received = recv(fd, buffer, kBufferSize, flags);
+    reclaimer->Quiescent(reader);
+    if (received < 0 && errno == EAGAIN) {
+      flush_verdicts();
+      continue;
+    }
+    if (received < 0 && errno == ENOBUFS && !must_stop_) {
+      // The socket overran; the packets which could not be delivered were
+      // not queued by the kernel, and the next ones are still received.
+      LOG(WARNING, "NFQUEUE %d overrun, packets were lost.", queue_);
+      flush_verdicts();
+      continue;
+    }
+    if (received < 0 || must_stop_) {
+      break;
+    }
+
     nfq_handle_packet(queue_handle_, buffer, received);
+    if (!pending_verdicts_.empty() &&
+        WallTimeMicros() - oldest_pending_verdict_us_ >=
+            verdict_batch_latency_us_) {
+      flush_verdicts();
+    }
   }
+  flush_verdicts();
+  reclaimer->Offline(reader);
 
   // Unbinds from our NFQUEUE.
   nfq_destroy_queue(queue_socket_);
@@ -144,7 +348,7 @@ int Queue::handle_packet(nfq_q_handle* queue_handle,
   char* packet_data;
   int packet_length = nfq_get_payload(nf_data, &packet_data);
   if (packet_length < 0) {
-    return nfq_set_verdict(queue_handle, packet_id, NF_ACCEPT, 0, NULL);
+    return set_verdict(queue_handle, packet_id, packet_mark, packet_mark);
   }
 
   Packet packet(packet_data, packet_length);
@@ -152,24 +356,48 @@ int Queue::handle_packet(nfq_q_handle* queue_handle,
        packet.l3_protocol() != 6) ||
       (packet.l4_protocol() != IPPROTO_TCP &&
        packet.l4_protocol() != IPPROTO_UDP)) {
-    return nfq_set_verdict(queue_handle, packet_id, NF_ACCEPT, 0, NULL);
+    return set_verdict(queue_handle, packet_id, packet_mark, packet_mark);
   }
 
   // Drops packets without any payload; these packets are usually TCP control
   // packets (SYN, SYN ACK, RST, ...), which will only confuse the conntrack
   // matcher).
   if (packet.payload_size() <= 0) {
-    return nfq_set_verdict(queue_handle, packet_id, NF_ACCEPT, 0, NULL);
+    return set_verdict(queue_handle, packet_id, packet_mark, packet_mark);
   }
 
-  // Determines the conntrack keys for the packet, and fetches the corresponding
-  // Connection object from the conntrack table.
-  pair<string, string> conntrack_keys;
-  conntrack_->get_packet_keys(packet, &conntrack_keys);
-
+  // Identifies the connection, using the conntrack information attached to
+  // the packet when available, and the packet's conntrack key otherwise.
+  // Packets of definitively classified connections are directly marked from
+  // the classified cache, without any lock.
   bool direction_orig = true;
-  Connection* connection =
-      conntrack_->get_connection_or_create(conntrack_keys, direction_orig);
+  uint32 conntrack_id = 0;
+  bool use_conntrack_id = conntrack_->queue_conntrack() &&
+      get_packet_conntrack(nf_msg, &conntrack_id, &direction_orig);
+  FlowKey key;
+  int source = 0;
+  uint32 local_mark;
+  if (use_conntrack_id) {
+    if (conntrack_->get_classified_mark(conntrack_id, &local_mark)) {
+      return set_verdict(queue_handle, packet_id, packet_mark,
+                         get_final_mark(packet_submarks.first, local_mark));
+    }
+  } else {
+    source = key.set_from_packet(packet);
+    if (conntrack_->get_classified_mark(key, &local_mark)) {
+      return set_verdict(queue_handle, packet_id, packet_mark,
+                         get_final_mark(packet_submarks.first, local_mark));
+    }
+  }
+
+  // Fetches the Connection object from the conntrack table.
+  Connection* connection;
+  if (use_conntrack_id) {
+    connection = conntrack_->get_connection_or_create(conntrack_id);
+  } else {
+    connection =
+        conntrack_->get_connection_or_create(key, source, direction_orig);
+  }
 
   CHECK(connection != NULL);
   if (direction_orig) {
@@ -181,13 +409,140 @@ int Queue::handle_packet(nfq_q_handle* queue_handle,
   // "Touches" the conntrack to prevent expiration.
   connection->touch();
 
-  // Classifies the packet.
-  uint32 local_mark = connection->classification_mark();
+  // Classifies the packet, and determines if the mark has to be saved in the
+  // kernel conntrack (only done once, on definitive classification).
+  local_mark = connection->classification_mark();
+  bool definitive = connection->definitive();
+  bool save_connmark = save_connmark_ && definitive &&
+                       !connection->connmark_saved();
+  if (save_connmark) {
+    connection->set_connmark_saved();
+  }
   connection->Release();
 
+  // Without the packet's conntrack, the mark is saved through a conntrack
+  // query on the packet's tuple, using the queue's own query socket.
   uint32 final_mark = get_final_mark(packet_submarks.first, local_mark);
-  return nfq_set_verdict_mark(queue_handle, packet_id, NF_ACCEPT,
-                              htonl(final_mark), 0, NULL);
+  if (save_connmark && !use_conntrack_id) {
+    if (!conntrack_query_handler_) {
+      conntrack_query_handler_ = nfct_open(CONNTRACK, 0);
+    }
+    if (conntrack_query_handler_) {
+      ConnTrack::save_connmark(conntrack_query_handler_, packet, final_mark,
+                               mark_mask_);
+    }
+  }
+
+  // Moves definitively classified connections to the fast path.
+  if (definitive) {
+    if (use_conntrack_id) {
+      conntrack_->publish_classified(conntrack_id);
+    } else {
+      conntrack_->publish_classified(key);
+    }
+  }
+
+  // Otherwise, the verdict itself updates the packet's conntrack mark.
+  if (save_connmark && use_conntrack_id) {
+    set_connmark_verdict(packet_id, final_mark);
+    return 0;
+  }
+  return set_verdict(queue_handle, packet_id, packet_mark, final_mark);
+}
+
+int Queue::set_verdict(nfq_q_handle* queue_handle, uint32 packet_id,
+                       uint32 packet_mark, uint32 final_mark) {
+  if (verdict_batch_size_ <= 1) {
+    if (final_mark == packet_mark) {
+      return nfq_set_verdict(queue_handle, packet_id, NF_ACCEPT, 0, NULL);
+    }
+    return nfq_set_verdict_mark(queue_handle, packet_id, NF_ACCEPT,
+                                htonl(final_mark), 0, NULL);
+  }
+
+  if (pending_verdicts_.empty()) {
+    oldest_pending_verdict_us_ = WallTimeMicros();
+  }
+  pending_verdicts_.push_back(pair<uint32, uint32>(packet_id, final_mark));
+  if (static_cast<int>(pending_verdicts_.size()) >= verdict_batch_size_) {
+    flush_verdicts();
+  }
+  return 0;
+}
+
+void Queue::flush_verdicts() {
+  if (pending_verdicts_.empty()) {
+    return;
+  }
+
+  // Builds one verdict message per run of packets with the same mark. A batch
+  // verdict applies to every queued packet whose id is lower or equal to the
+  // verdict's id, hence runs only hold packets with contiguous ids, the first
+  // of which directly follows the last packet given a verdict: all the ids a
+  // batch covers were actually received. Otherwise (eg. after lost messages),
+  // the first packet of the run gets its own verdict.
+  char buffer[kMaxVerdictBatchSize * kVerdictMessageSize];
+  char* position = buffer;
+  for (uint start = 0; start < pending_verdicts_.size();) {
+    uint end = start + 1;
+    if (pending_verdicts_[start].first == last_verdict_id_ + 1) {
+      while (end < pending_verdicts_.size() &&
+             pending_verdicts_[end].second == pending_verdicts_[start].second &&
+             pending_verdicts_[end].first ==
+                 pending_verdicts_[end - 1].first + 1) {
+        ++end;
+      }
+    }
+    last_verdict_id_ = pending_verdicts_[end - 1].first;
+
+    position = put_verdict_message(
+        position, queue_,
+        end - start > 1 ? NFQNL_MSG_VERDICT_BATCH : NFQNL_MSG_VERDICT,
+        pending_verdicts_[end - 1].first, pending_verdicts_[start].second);
+    start = end;
+  }
+  pending_verdicts_.clear();
+
+  // Sends all the verdict messages to the kernel at once.
+  send_verdicts(buffer, position - buffer);
+}
+
+void Queue::set_connmark_verdict(uint32 packet_id, uint32 final_mark) {
+  // Pending verdicts are sent first, so that the verdict ids stay ordered.
+  flush_verdicts();
+
+  // Appends to the verdict the packet's conntrack mark (CTA_MARK), and the
+  // bits it replaces (CTA_MARK_MASK), nested in a NFQA_CT attribute.
+  char buffer[kVerdictMessageSize + 3 * NLA_HDRLEN + 2 * NLA_ALIGN(4)];
+  char* position = put_verdict_message(buffer, queue_, NFQNL_MSG_VERDICT,
+                                       packet_id, final_mark);
+  uint32 conntrack_mark = htonl(final_mark & mark_mask_);
+  uint32 conntrack_mask = htonl(mark_mask_);
+  nlattr* conntrack = reinterpret_cast<nlattr*>(position);
+  char* end = put_attribute(position + NLA_HDRLEN, CTA_MARK,
+                            &conntrack_mark, sizeof(conntrack_mark));
+  end = put_attribute(end, CTA_MARK_MASK,
+                      &conntrack_mask, sizeof(conntrack_mask));
+  conntrack->nla_type = NFQA_CT | NLA_F_NESTED;
+  conntrack->nla_len = end - position;
+  reinterpret_cast<nlmsghdr*>(buffer)->nlmsg_len = end - buffer;
+  last_verdict_id_ = packet_id;
+
+  send_verdicts(buffer, end - buffer);
+}
+
+void Queue::send_verdicts(const char* messages, int length) {
+  sockaddr_nl kernel_address;
+  memset(&kernel_address, 0, sizeof(kernel_address));
+  kernel_address.nl_family = AF_NETLINK;
+
+  int fd = nfnl_fd(nfq_nfnlh(queue_handle_));
+  if (sendto(fd, messages, length, 0,
+             reinterpret_cast<sockaddr*>(&kernel_address),
+             sizeof(kernel_address)) < 0) {
+    LOG(ERROR, "Could not send verdicts for NFQUEUE %d (%s).",
+        queue_, strerror(errno));
+  }
 }
 
 bool Queue::set_mark_mask(uint32 mark_mask) {
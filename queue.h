@@ -22,6 +22,7 @@
 #define QUEUE_H__
 
 #include "conntrack.h"
+#include <vector>
 extern "C" {
 #include <libnetfilter_queue/libnetfilter_queue.h>
 }
@@ -35,12 +36,27 @@ class Queue {
   // Size of the input buffer; should be large enough to handle any packet.
   static const int kBufferSize = 4096;
 
+  // Maximal number of verdicts held in a single verdict batch.
+  static const int kMaxVerdictBatchSize = 1024;
+
   // Sets up the queue, and binds it to the appropriate queue.
   // The @p markmask indicates which part of the NF mark as to be overwritten
   // with our classification-determined result.
   Queue(int queue, uint32 mark_mask, ConnTrack* conntrack);
   ~Queue();
 
+  // Enables verdict batching: instead of being sent one by one, verdicts are
+  // held until the socket is drained, until @p max_size verdicts are pending,
+  // or until the oldest pending verdict is @p max_latency_us old. They are then
+  // sent to the kernel in a single netlink write. A @p max_size of 1 or less
+  // disables batching. Must be called before Run().
+  void set_verdict_batching(int max_size, int max_latency_us);
+
+  // When @p save_connmark is true, the final mark of definitively classified
+  // connections is saved in the kernel conntrack mark (cf. README for the
+  // associated iptables configuration).
+  void set_save_connmark(bool save_connmark) { save_connmark_ = save_connmark; }
+
   // Starts the queue listener; only returns on failure.
   void Run();
   void Stop();
@@ -60,6 +76,32 @@ class Queue {
                     nfgenmsg* nf_msg,
                     nfq_data* nf_data);
 
+  // Accepts the packet @p packet_id with the @p final_mark, either directly or
+  // through the verdict batch. The @p packet_mark is the mark the packet was
+  // received with.
+  int set_verdict(nfq_q_handle* queue_handle, uint32 packet_id,
+                  uint32 packet_mark, uint32 final_mark);
+
+  // Accepts the packet @p packet_id with the @p final_mark, and saves the
+  // bits of the mark mask of the @p final_mark in the packet's conntrack mark
+  // (queue conntrack mode only). Pending verdicts are sent first.
+  void set_connmark_verdict(uint32 packet_id, uint32 final_mark);
+
+  // Sends the pending verdicts to the kernel. Verdicts of packets with the
+  // same mark and contiguous ids are merged in a single
+  // NFQNL_MSG_VERDICT_BATCH message.
+  void flush_verdicts();
+
+  // Sends the @p length bytes of verdict @p messages to the kernel.
+  void send_verdicts(const char* messages, int length);
+
+  // Binds our handler as the nf_queue handler of the AF_INET and AF_INET6
+  // families when the first queue is set up, and unbinds it when the last
+  // queue is destroyed (bindings are process-wide, whatever the
+  // @p queue_handle used).
+  static void bind_protocol_families(nfq_handle* queue_handle);
+  static void unbind_protocol_families(nfq_handle* queue_handle);
+
   // Netfilter mark helpers.
   bool set_mark_mask(uint32 mark_mask);
   pair<uint32, uint32> get_submarks_from_mark(uint32 mark);
@@ -75,11 +117,30 @@ class Queue {
   uint32 mark_mask_first_bit_;
   uint32 mark_mask_;
 
+  // Indicates if definitive marks are saved in the kernel conntrack.
+  bool save_connmark_;
+
   // Queue listener handler.
   nfq_handle* queue_handle_;
   nfq_q_handle* queue_socket_;
   bool must_stop_;
 
+  // Conntrack query handler of the queue's thread, used to save conntrack
+  // marks when the packets do not carry their conntrack (opened on first
+  // use).
+  nfct_handle* conntrack_query_handler_;
+
+  // Verdict batching parameters, and pending verdicts (packet id and mark),
+  // in the order the packets were received.
+  int verdict_batch_size_;
+  int64 verdict_batch_latency_us_;
+  int64 oldest_pending_verdict_us_;
+  std::vector<pair<uint32, uint32> > pending_verdicts_;
+
+  // Id of the last packet given a verdict through flush_verdicts (the kernel
+  // numbers the packets of a queue from 1).
+  uint32 last_verdict_id_;
+
   DISALLOW_EVIL_CONSTRUCTORS(Queue);
 };
 
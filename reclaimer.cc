@@ -0,0 +1,94 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "reclaimer.h"
+
+QuiescentStateReclaimer::QuiescentStateReclaimer()
+  : global_epoch_(1), readers_(), num_readers_(0), retired_(), lock_() {
+  for (int i = 0; i < kMaxReaders; ++i) {
+    Reader* reader = new Reader();
+    reader->epoch = kOffline;
+    readers_.push_back(reader);
+  }
+}
+
+QuiescentStateReclaimer::~QuiescentStateReclaimer() {
+  // Readers are assumed to be gone: deletes all retired objects.
+  for (uint i = 0; i < retired_.size(); ++i) {
+    retired_[i].deleter(retired_[i].object);
+  }
+  for (uint i = 0; i < readers_.size(); ++i) {
+    delete readers_[i];
+  }
+}
+
+int QuiescentStateReclaimer::RegisterReader() {
+  MutexLock ml(&lock_);
+  if (num_readers_ >= kMaxReaders) {
+    LOG(FATAL, "Too many reclaimer readers (max %d).", kMaxReaders);
+  }
+  return num_readers_++;
+}
+
+void QuiescentStateReclaimer::Collect() {
+  MutexLock ml(&lock_);
+  if (!retired_.empty()) {
+    Reclaim();
+  }
+}
+
+int QuiescentStateReclaimer::pending() {
+  MutexLock ml(&lock_);
+  return retired_.size();
+}
+
+void QuiescentStateReclaimer::Retire(void* object, void (*deleter)(void*)) {
+  MutexLock ml(&lock_);
+
+  // The object was unlinked before the epoch increment (which is also a full
+  // memory barrier): readers announcing a later epoch cannot reach it.
+  RetiredObject retired = {object, deleter, global_epoch_};
+  retired_.push_back(retired);
+  AtomicIncrement(&global_epoch_, 1);
+
+  if (static_cast<int>(retired_.size()) >= kReclaimThreshold) {
+    Reclaim();
+  }
+}
+
+void QuiescentStateReclaimer::Reclaim() {
+  // Computes the oldest epoch still announced by an online reader.
+  AtomicWord oldest_epoch = Acquire_Load(&global_epoch_);
+  for (int i = 0; i < num_readers_; ++i) {
+    AtomicWord epoch = Acquire_Load(&readers_[i]->epoch);
+    if (epoch != kOffline && epoch < oldest_epoch) {
+      oldest_epoch = epoch;
+    }
+  }
+
+  // Deletes objects retired before that epoch, and keeps the others.
+  uint kept = 0;
+  for (uint i = 0; i < retired_.size(); ++i) {
+    if (retired_[i].epoch < oldest_epoch) {
+      retired_[i].deleter(retired_[i].object);
+    } else {
+      retired_[kept++] = retired_[i];
+    }
+  }
+  retired_.resize(kept);
+}
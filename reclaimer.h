@@ -0,0 +1,126 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef RECLAIMER_H__
+#define RECLAIMER_H__
+
+#include "base/atomicops.h"
+#include "base/basictypes.h"
+#include "base/mutex.h"
+#include <vector>
+
+using std::vector;
+
+// Quiescent-state based reclamation of objects shared with lock-free readers.
+// Readers access the shared objects without any lock nor reference count;
+// writers unlink the objects from the shared structures, and Retire() them
+// instead of deleting them. Retired objects are only deleted once every
+// reader has gone through a quiescent state (a point where it does not hold
+// any reference to shared objects), or is offline.
+// Readers only write to their own (cache-line sized) state, and only when the
+// global epoch has changed since their last quiescent state.
+class QuiescentStateReclaimer {
+ public:
+  // Number of retired objects above which a reclamation is attempted.
+  static const int kReclaimThreshold = 128;
+
+  QuiescentStateReclaimer();
+  ~QuiescentStateReclaimer();
+
+  // Registers the calling thread as a reader, and returns its reader id. The
+  // reader starts offline.
+  int RegisterReader();
+
+  // Announces that the @p reader does not hold any reference to shared objects
+  // anymore; it also brings an offline reader back online. Must be called
+  // regularly by online readers (eg. between two packets).
+  void Quiescent(int reader) {
+    Reader* state = readers_[reader];
+    AtomicWord epoch = Acquire_Load(&global_epoch_);
+    if (state->epoch != epoch) {
+      // Going online requires a full barrier, so that the reader's subsequent
+      // loads are not reordered before the epoch store.
+      Acquire_Store(&state->epoch, epoch);
+    }
+  }
+
+  // Puts the @p reader offline: offline readers do not prevent reclamation,
+  // and must not access shared objects until their next Quiescent() call.
+  // Should be called before blocking (eg. on a socket read).
+  void Offline(int reader) {
+    Release_Store(&readers_[reader]->epoch, kOffline);
+  }
+
+  // Retires the @p object, which must already be unreachable for readers which
+  // go through a quiescent state. The object is deleted later on.
+  template <typename T>
+  void Retire(T* object) {
+    Retire(object, &DeleteObject<T>);
+  }
+
+  // Deletes the retired objects no reader can hold anymore, without waiting
+  // for kReclaimThreshold retired objects (eg. to free large objects early).
+  void Collect();
+
+  // Returns the number of retired objects not yet deleted.
+  int pending();
+
+ private:
+  // Reader epoch of offline readers.
+  static const AtomicWord kOffline = 0;
+
+  // Per-reader state, alone on its cache line.
+  struct Reader {
+    volatile AtomicWord epoch;
+    char padding[64 - sizeof(AtomicWord)];
+  };
+
+  // Retired object, with its deletion function, and the epoch it was retired
+  // at.
+  struct RetiredObject {
+    void* object;
+    void (*deleter)(void*);
+    AtomicWord epoch;
+  };
+
+  template <typename T>
+  static void DeleteObject(void* object) {
+    delete static_cast<T*>(object);
+  }
+
+  void Retire(void* object, void (*deleter)(void*));
+
+  // Deletes the retired objects no reader can hold anymore. Assumes the caller
+  // owns the lock_.
+  void Reclaim();
+
+  // Global epoch; starts at 1, since 0 is kOffline.
+  volatile AtomicWord global_epoch_;
+
+  // Readers, and retired objects. Readers are never removed, and at most
+  // kMaxReaders readers are supported, so that readers_ is never reallocated
+  // (readers access it without lock).
+  static const int kMaxReaders = 256;
+  vector<Reader*> readers_;
+  int num_readers_;
+  vector<RetiredObject> retired_;
+  Mutex lock_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(QuiescentStateReclaimer);
+};
+
+#endif  // RECLAIMER_H__
@@ -0,0 +1,956 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "regex_set.h"
+#include "serializer.h"
+#include <algorithm>
+#include <map>
+#include <ctype.h>
+#include <string.h>
+
+using std::map;
+
+const int RegexSet::kMaxStates;
+const int RegexSet::kMaxPatternStates;
+
+//
+// Byte sets, and nondeterministic automata of the patterns.
+//
+
+// Set of bytes, as a 256 bits bitmap.
+struct ByteSet {
+  uint32 bits[8];
+
+  ByteSet() { memset(bits, 0, sizeof(bits)); }
+
+  bool has(uint8 byte) const { return bits[byte >> 5] & (1U << (byte & 31)); }
+  void add(uint8 byte) { bits[byte >> 5] |= 1U << (byte & 31); }
+  void add_range(int first, int last) {
+    for (int byte = first; byte <= last; ++byte) {
+      add(byte);
+    }
+  }
+  void negate() {
+    for (int i = 0; i < 8; ++i) {
+      bits[i] = ~bits[i];
+    }
+  }
+
+  // Makes the set case-insensitive (only for ASCII letters, as in the "C"
+  // locale used by the boost::regex).
+  void fold_case() {
+    for (int byte = 'a'; byte <= 'z'; ++byte) {
+      if (has(byte) || has(toupper(byte))) {
+        add(byte);
+        add(toupper(byte));
+      }
+    }
+  }
+
+  bool operator<(const ByteSet& other) const {
+    return memcmp(bits, other.bits, sizeof(bits)) < 0;
+  }
+};
+
+struct RegexSet::ByteSetTable {
+  vector<ByteSet> sets;
+  map<ByteSet, int> index;
+
+  // Returns the index of the @p set, adding it if needed.
+  int get(const ByteSet& set) {
+    map<ByteSet, int>::const_iterator it = index.find(set);
+    if (it != index.end()) {
+      return it->second;
+    }
+    sets.push_back(set);
+    index[set] = sets.size() - 1;
+    return sets.size() - 1;
+  }
+};
+
+// State of a nondeterministic automaton: it moves to the next state on any
+// byte of its byte set (if any), and to its epsilon states without consuming
+// any input.
+struct NfaState {
+  int byte_set;
+  int next;
+  vector<int> epsilon;
+
+  NfaState() : byte_set(-1), next(-1), epsilon() {}
+};
+
+// Pattern, split in pieces whose concatenation is the pattern: the top-level
+// atoms with their repetition operators (anchors, which are no-ops, are
+// dropped), or the whole pattern if it is an alternation. Patterns sharing
+// their first pieces share the states of these pieces in the automata.
+struct RegexSet::Pattern {
+  int id;
+  vector<string> pieces;
+};
+
+// Deterministic automaton. Bytes of a same class are never distinguished by
+// the automaton, which makes transition tables much smaller.
+// States are identified by the offset of their row in the transition table
+// (that is their index times num_classes): the transition from the state at
+// offset o on byte b is transitions[o + byte_class[b]]. The dead state (from
+// which no pattern can match anymore) is at offset 0, and the start state is
+// the next one.
+// Patterns reaching a sticky state are matched on the spot, and then dropped
+// from the automaton's states (otherwise the automaton would have to remember
+// every combination of patterns already matched); transitions to states where
+// patterns are matched are negated.
+struct RegexSet::Automaton {
+  uint8 byte_class[256];
+  int num_classes;
+  vector<int32> transitions;
+
+  // Ids of the patterns matched when entering the state of index s, and of
+  // the patterns accepted when the input ends in that state, in increasing
+  // order, are in matched[first_matched[s], first_matched[s + 1][ and in
+  // accepted[first_accepted[s], first_accepted[s + 1][.
+  vector<int> first_matched;
+  vector<int> matched;
+  vector<int> first_accepted;
+  vector<int> accepted;
+};
+
+//
+// Parser of the patterns, which builds their nondeterministic automata (using
+// Thompson's construction).
+//
+class RegexSet::Parser {
+ public:
+  // Prepares the parsing of the @p pattern, whose states are to be added to
+  // the @p states.
+  Parser(const string& pattern, vector<NfaState>* states,
+         ByteSetTable* byte_sets)
+    : pattern_(pattern), pos_(0), depth_(0), alternation_(false), anchors_(0),
+      pieces_(NULL),
+      states_(states), first_state_(states->size()), byte_sets_(byte_sets) {
+  }
+
+  // Parses the pattern into an automaton from @p start to @p end, and splits
+  // it into @p pieces (unless NULL). Returns false if the pattern is
+  // unsupported.
+  bool Parse(int* start, int* end, vector<string>* pieces) {
+    pieces_ = pieces;
+    bool ended = false;
+    if (!ParseAlternation(true, start, end, &ended) || !AtEnd() ||
+        TooLarge()) {
+      return false;
+    }
+    if (pieces_ && alternation_) {
+      pieces_->assign(1, pattern_);
+    }
+    return true;
+  }
+
+ private:
+  // Parsers of the pattern's components, building the automaton of the
+  // component between its @p start and @p end states. @p at_start indicates
+  // that nothing can precede the component (a '^' is then a no-op), and
+  // @p ended is set when nothing can follow it (because of a '$').
+  bool ParseAlternation(bool at_start, int* start, int* end, bool* ended);
+  bool ParseSequence(bool at_start, int* start, int* end, bool* ended);
+  bool ParseAtom(bool at_start, int* start, int* end, bool* ended);
+
+  // Parses a repetition operator (the current character), and applies it to
+  // the atom parsed at @p atom_pos, whose automaton is (@p start, @p end).
+  bool ParseRepetition(int atom_pos, int* start, int* end);
+
+  // Parses a bracket expression (after the '[') into the @p set.
+  bool ParseBracket(ByteSet* set);
+
+  // Parses an interval "{m}", "{m,}" or "{m,n}"; @p max is -1 if unbounded.
+  bool ParseInterval(int* min, int* max);
+
+  // Returns a new state, moving to @p next on the bytes of @p set if any.
+  int NewState() {
+    states_->push_back(NfaState());
+    return states_->size() - 1;
+  }
+  int NewState(const ByteSet& set, int next) {
+    int state = NewState();
+    (*states_)[state].byte_set = byte_sets_->get(set);
+    (*states_)[state].next = next;
+    return state;
+  }
+  void AddEpsilon(int from, int to) {
+    (*states_)[from].epsilon.push_back(to);
+  }
+  bool TooLarge() const {
+    return static_cast<int>(states_->size() - first_state_) >
+        kMaxPatternStates;
+  }
+
+  bool AtEnd() const { return pos_ >= pattern_.size(); }
+  char Peek() const { return pattern_[pos_]; }
+
+  const string& pattern_;
+  uint32 pos_;
+
+  // Number of groups the parser is in, and whether the pattern has a
+  // top-level alternation.
+  int depth_;
+  bool alternation_;
+
+  // Number of anchors seen so far (anchored atoms can't be repeated).
+  int anchors_;
+
+  // Pieces of the pattern, if requested.
+  vector<string>* pieces_;
+
+  vector<NfaState>* states_;
+  uint32 first_state_;
+  ByteSetTable* byte_sets_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Parser);
+};
+
+bool RegexSet::Parser::ParseAlternation(bool at_start, int* start, int* end,
+                                        bool* ended) {
+  int first_start, first_end;
+  if (!ParseSequence(at_start, &first_start, &first_end, ended)) {
+    return false;
+  }
+  if (AtEnd() || Peek() != '|') {
+    *start = first_start;
+    *end = first_end;
+    return true;
+  }
+
+  alternation_ = alternation_ || depth_ == 0;
+  *start = NewState();
+  *end = NewState();
+  AddEpsilon(*start, first_start);
+  AddEpsilon(first_end, *end);
+  while (!AtEnd() && Peek() == '|') {
+    pos_++;
+    int next_start, next_end;
+    bool next_ended = false;
+    if (!ParseSequence(at_start, &next_start, &next_end, &next_ended)) {
+      return false;
+    }
+    AddEpsilon(*start, next_start);
+    AddEpsilon(next_end, *end);
+    *ended = *ended || next_ended;
+  }
+  return true;
+}
+
+bool RegexSet::Parser::ParseSequence(bool at_start, int* start, int* end,
+                                     bool* ended) {
+  *start = *end = NewState();
+  *ended = false;
+  while (!AtEnd() && Peek() != '|' && Peek() != ')') {
+    if (*ended || TooLarge()) {
+      return false;
+    }
+
+    // Anchors are only supported where they are no-ops in a full match.
+    if (Peek() == '^') {
+      if (!at_start) {
+        return false;
+      }
+      pos_++;
+      anchors_++;
+      continue;
+    }
+    if (Peek() == '$') {
+      pos_++;
+      anchors_++;
+      *ended = true;
+      continue;
+    }
+
+    int atom_pos = pos_, atom_anchors = anchors_;
+    int atom_start, atom_end;
+    if (!ParseAtom(at_start, &atom_start, &atom_end, ended)) {
+      return false;
+    }
+    bool repeated = false;
+    while (!AtEnd() &&
+           (Peek() == '*' || Peek() == '+' || Peek() == '?' || Peek() == '{')) {
+      if (anchors_ != atom_anchors || (repeated && Peek() == '{')) {
+        return false;
+      }
+      if (!ParseRepetition(atom_pos, &atom_start, &atom_end)) {
+        return false;
+      }
+      repeated = true;
+    }
+
+    AddEpsilon(*end, atom_start);
+    *end = atom_end;
+    at_start = false;
+    if (pieces_ && depth_ == 0) {
+      pieces_->push_back(pattern_.substr(atom_pos, pos_ - atom_pos));
+    }
+  }
+  return true;
+}
+
+bool RegexSet::Parser::ParseAtom(bool at_start, int* start, int* end,
+                                 bool* ended) {
+  ByteSet set;
+  char c = Peek();
+  pos_++;
+  switch (c) {
+    case '(':
+      if (!AtEnd() && Peek() == '?') {
+        return false;
+      }
+      depth_++;
+      if (!ParseAlternation(at_start, start, end, ended)) {
+        return false;
+      }
+      depth_--;
+      if (AtEnd() || Peek() != ')') {
+        return false;
+      }
+      pos_++;
+      return true;
+
+    case '[':
+      if (!ParseBracket(&set)) {
+        return false;
+      }
+      break;
+
+    case '.':
+      set.negate();
+      break;
+
+    case '\\':
+      // Only escaped punctuation and the \w, \d and \s classes (and their
+      // negations) are supported: other letters and digits introduce
+      // back-references and other classes, and some punctuation introduces
+      // word and buffer boundaries.
+      if (AtEnd()) {
+        return false;
+      }
+      c = Peek();
+      pos_++;
+      if (tolower(c) == 'w' || tolower(c) == 'd' || tolower(c) == 's') {
+        for (int byte = 0; byte < 128; ++byte) {
+          if ((tolower(c) == 'w' && (isalnum(byte) || byte == '_')) ||
+              (tolower(c) == 'd' && isdigit(byte)) ||
+              (tolower(c) == 's' && isspace(byte))) {
+            set.add(byte);
+          }
+        }
+        if (isupper(c)) {
+          set.negate();
+        }
+      } else if (isalnum(c) || strchr("<>`'", c)) {
+        return false;
+      } else {
+        set.add(c);
+      }
+      break;
+
+    case '*': case '+': case '?': case '{': case '}':
+      return false;
+
+    default:
+      set.add(c);
+      set.fold_case();
+      break;
+  }
+
+  *end = NewState();
+  *start = NewState(set, *end);
+  return true;
+}
+
+bool RegexSet::Parser::ParseRepetition(int atom_pos, int* start, int* end) {
+  int min = 0, max = -1;
+  char c = Peek();
+  pos_++;
+  if (c == '?') {
+    max = 1;
+  } else if (c == '+') {
+    min = 1;
+  } else if (c == '{' && !ParseInterval(&min, &max)) {
+    return false;
+  }
+
+  // Usual operators only need a few epsilon transitions.
+  if (c != '{' || (min == 0 && max == -1) || (min == 1 && max <= 1)) {
+    int repeat_start = NewState(), repeat_end = NewState();
+    AddEpsilon(repeat_start, *start);
+    AddEpsilon(*end, repeat_end);
+    if (min == 0) {
+      AddEpsilon(repeat_start, repeat_end);
+    }
+    if (max == -1) {
+      AddEpsilon(*end, *start);
+    }
+    *start = repeat_start;
+    *end = repeat_end;
+    return true;
+  }
+
+  // Intervals copy the atom (by parsing it again) as many times as needed:
+  // "a{2,4}" is built as "aaa?a?", and "a{2,}" as "aa+".
+  uint32 next_pos = pos_;
+  int last = (max == -1) ? min : max;
+  int repeat_start = NewState(), repeat_end = repeat_start;
+  for (int copy = 0; copy < last; ++copy) {
+    int copy_start = *start, copy_end = *end;
+    if (copy > 0) {
+      pos_ = atom_pos;
+      bool ended = false;
+      if (TooLarge() || !ParseAtom(false, &copy_start, &copy_end, &ended)) {
+        return false;
+      }
+    }
+    // Copies are wrapped between new states, as the atom's own states may
+    // already have epsilon transitions (e.g. a loop for a nested "+").
+    int copy_in = NewState(), copy_out = NewState();
+    AddEpsilon(copy_in, copy_start);
+    AddEpsilon(copy_end, copy_out);
+    if (copy >= min) {
+      AddEpsilon(copy_in, copy_out);
+    }
+    if (max == -1 && copy == last - 1) {
+      AddEpsilon(copy_out, copy_in);
+    }
+    AddEpsilon(repeat_end, copy_in);
+    repeat_end = copy_out;
+  }
+  pos_ = next_pos;
+  *start = repeat_start;
+  *end = repeat_end;
+  return !TooLarge();
+}
+
+bool RegexSet::Parser::ParseBracket(ByteSet* set) {
+  bool negated = false;
+  if (!AtEnd() && Peek() == '^') {
+    negated = true;
+    pos_++;
+  }
+
+  // A leading ']' is a literal.
+  bool first = true;
+  while (!AtEnd() && (first || Peek() != ']')) {
+    char c = Peek();
+    first = false;
+    pos_++;
+
+    // Character classes; collating elements and equivalence classes are not
+    // supported, and neither are escapes (to avoid depending on whether the
+    // boost::regex interprets them).
+    if (c == '[' && !AtEnd() && (Peek() == '.' || Peek() == '=')) {
+      return false;
+    }
+    if (c == '[' && !AtEnd() && Peek() == ':') {
+      string::size_type close = pattern_.find(":]", pos_ + 1);
+      if (close == string::npos) {
+        return false;
+      }
+      string name = pattern_.substr(pos_ + 1, close - pos_ - 1);
+      pos_ = close + 2;
+      int (*predicate)(int) = NULL;
+      if (name == "alpha") predicate = &isalpha;
+      if (name == "digit") predicate = &isdigit;
+      if (name == "alnum") predicate = &isalnum;
+      if (name == "space") predicate = &isspace;
+      if (name == "blank") predicate = &isblank;
+      if (name == "punct") predicate = &ispunct;
+      if (name == "xdigit") predicate = &isxdigit;
+      if (name == "cntrl") predicate = &iscntrl;
+      if (name == "print") predicate = &isprint;
+      if (name == "graph") predicate = &isgraph;
+      if (!predicate) {
+        return false;
+      }
+      for (int byte = 0; byte < 128; ++byte) {
+        if (predicate(byte)) {
+          set->add(byte);
+        }
+      }
+      continue;
+    }
+    if (c == '\\') {
+      return false;
+    }
+
+    // Ranges are only supported between digits, or letters of the same case.
+    if (pos_ + 1 < pattern_.size() && Peek() == '-' &&
+        pattern_[pos_ + 1] != ']') {
+      char last = pattern_[pos_ + 1];
+      pos_ += 2;
+      bool same_kind = (isdigit(c) && isdigit(last)) ||
+          (islower(c) && islower(last)) || (isupper(c) && isupper(last));
+      if (!same_kind || c > last) {
+        return false;
+      }
+      set->add_range(c, last);
+      continue;
+    }
+    set->add(c);
+  }
+  if (AtEnd()) {
+    return false;
+  }
+  pos_++;
+
+  set->fold_case();
+  if (negated) {
+    set->negate();
+  }
+  return true;
+}
+
+bool RegexSet::Parser::ParseInterval(int* min, int* max) {
+  if (AtEnd() || !isdigit(Peek())) {
+    return false;
+  }
+  *min = 0;
+  while (!AtEnd() && isdigit(Peek()) && *min <= kMaxPatternStates) {
+    *min = *min * 10 + (Peek() - '0');
+    pos_++;
+  }
+  *max = *min;
+  if (!AtEnd() && Peek() == ',') {
+    pos_++;
+    *max = -1;
+    if (!AtEnd() && isdigit(Peek())) {
+      *max = 0;
+      while (!AtEnd() && isdigit(Peek()) && *max <= kMaxPatternStates) {
+        *max = *max * 10 + (Peek() - '0');
+        pos_++;
+      }
+    }
+  }
+  if (AtEnd() || Peek() != '}') {
+    return false;
+  }
+  pos_++;
+  return *min <= kMaxPatternStates && *max <= kMaxPatternStates &&
+      (*max == -1 || *max >= *min);
+}
+
+// Appends the ids of @p lists[@p first[@p index], @p first[@p index + 1][
+// to @p ids. Returns 1 if some ids were appended, and 0 otherwise.
+static int append_ids(const vector<int>& first, const vector<int>& lists,
+                     int index, vector<int>* ids) {
+  if (first[index] == first[index + 1]) {
+    return 0;
+  }
+  ids->insert(ids->end(), lists.begin() + first[index],
+              lists.begin() + first[index + 1]);
+  return 1;
+}
+
+//
+// Implementation of the RegexSet class.
+//
+RegexSet::RegexSet()
+  : byte_sets_(new ByteSetTable()), pending_(), automata_(),
+    num_compiled_(0) {
+}
+
+RegexSet::~RegexSet() {
+  for (uint i = 0; i < pending_.size(); ++i) {
+    delete pending_[i];
+  }
+  for (uint i = 0; i < automata_.size(); ++i) {
+    delete automata_[i];
+  }
+  delete byte_sets_;
+}
+
+bool RegexSet::Add(int id, const string& pattern) {
+  // The pattern is parsed once to check it is supported, and to split it; its
+  // automaton is built again by BuildAutomaton().
+  Pattern* parsed = new Pattern();
+  parsed->id = id;
+  vector<NfaState> states;
+  int start, end;
+  Parser parser(pattern, &states, byte_sets_);
+  if (!parser.Parse(&start, &end, &parsed->pieces)) {
+    delete parsed;
+    return false;
+  }
+  pending_.push_back(parsed);
+  return true;
+}
+
+void RegexSet::Compile(vector<int>* rejected) {
+  // Sorts the patterns by size of their own automaton, so that patterns with
+  // large automata (e.g. counters, which multiply the size of the automata
+  // they are merged with) end up together.
+  vector<std::pair<int, int> > sizes;
+  for (uint p = 0; p < pending_.size(); ++p) {
+    Automaton* automaton = BuildAutomaton(p, p + 1);
+    if (automaton) {
+      sizes.push_back(std::make_pair(automaton->first_accepted.size(), p));
+      delete automaton;
+    } else {
+      rejected->push_back(pending_[p]->id);
+    }
+  }
+  std::sort(sizes.begin(), sizes.end());
+  vector<Pattern*> patterns(pending_);
+  pending_.clear();
+  for (uint i = 0; i < sizes.size(); ++i) {
+    pending_.push_back(patterns[sizes[i].second]);
+  }
+
+  if (!pending_.empty()) {
+    CompileGroup(0, pending_.size(), rejected);
+  }
+  for (uint i = 0; i < patterns.size(); ++i) {
+    delete patterns[i];
+  }
+  pending_.clear();
+}
+
+void RegexSet::CompileGroup(int first, int last, vector<int>* rejected) {
+  Automaton* automaton = BuildAutomaton(first, last);
+  if (automaton) {
+    automata_.push_back(automaton);
+    num_compiled_ += last - first;
+  } else if (last - first == 1) {
+    rejected->push_back(pending_[first]->id);
+  } else {
+    int middle = (first + last) / 2;
+    CompileGroup(first, middle, rejected);
+    CompileGroup(middle, last, rejected);
+  }
+}
+
+// Computes the epsilon closure of the @p seeds in the @p nfa, and returns the
+// resulting automaton state into @p closure: the states with a byte
+// transition or accepting a pattern, in increasing order, followed (if some
+// sticky states are reached) by -1 and the ids of their patterns, in
+// increasing order. The patterns accepted and matched by each state are given
+// by @p accepts and @p matches (-1 if none). The @p visited states are marked
+// with @p generation. Returns true if some patterns are matched.
+static bool get_closure(const vector<NfaState>& nfa, const vector<int>& accepts,
+                        const vector<int>& matches, const vector<int>& seeds,
+                        vector<int>* visited, int generation,
+                        vector<int>* closure) {
+  closure->clear();
+  vector<int> matched;
+  vector<int> stack(seeds);
+  while (!stack.empty()) {
+    int state = stack.back();
+    stack.pop_back();
+    if ((*visited)[state] == generation) {
+      continue;
+    }
+    (*visited)[state] = generation;
+    if (matches[state] >= 0) {
+      matched.push_back(matches[state]);
+      continue;
+    }
+    if (nfa[state].byte_set >= 0 || accepts[state] >= 0) {
+      closure->push_back(state);
+    }
+    const vector<int>& epsilon = nfa[state].epsilon;
+    for (uint i = 0; i < epsilon.size(); ++i) {
+      if ((*visited)[epsilon[i]] != generation) {
+        stack.push_back(epsilon[i]);
+      }
+    }
+  }
+  std::sort(closure->begin(), closure->end());
+  if (!matched.empty()) {
+    std::sort(matched.begin(), matched.end());
+    closure->push_back(-1);
+    closure->insert(closure->end(), matched.begin(),
+                    std::unique(matched.begin(), matched.end()));
+  }
+  return !matched.empty();
+}
+
+RegexSet::Automaton* RegexSet::BuildAutomaton(int first, int last) {
+  // Builds the patterns' automata from a common start state; the first
+  // pieces of the patterns are merged into a trie, but the last piece of each
+  // pattern is not shared, so that it can be sticky (if it is ".*").
+  vector<NfaState> nfa(1);
+  vector<int> accepts, matches;
+  map<std::pair<int, string>, int> trie;
+  for (int p = first; p < last; ++p) {
+    const Pattern* pattern = pending_[p];
+    int node = 0, sticky = -1;
+    for (uint i = 0; i < pattern->pieces.size(); ++i) {
+      const string& piece = pattern->pieces[i];
+      bool last_piece = (i + 1 == pattern->pieces.size());
+      std::pair<int, string> key(node, piece);
+      map<std::pair<int, string>, int>::const_iterator child = trie.find(key);
+      if (!last_piece && child != trie.end()) {
+        node = child->second;
+        continue;
+      }
+
+      int start, end;
+      Parser parser(piece, &nfa, byte_sets_);
+      CHECK(parser.Parse(&start, &end, NULL));
+      nfa[node].epsilon.push_back(start);
+      node = end;
+      if (last_piece && piece == ".*") {
+        sticky = start;
+      } else if (!last_piece) {
+        trie[key] = end;
+      }
+    }
+
+    int accept = nfa.size();
+    nfa.push_back(NfaState());
+    nfa[node].epsilon.push_back(accept);
+    accepts.resize(nfa.size(), -1);
+    matches.resize(nfa.size(), -1);
+    accepts[accept] = pattern->id;
+    if (sticky >= 0) {
+      matches[sticky] = pattern->id;
+    }
+  }
+
+  // Splits the bytes into classes: two bytes are in the same class if every
+  // byte set used by the patterns contains both or none of them.
+  Automaton* automaton = new Automaton();
+  const vector<ByteSet>& byte_sets = byte_sets_->sets;
+  vector<bool> used(byte_sets.size(), false);
+  for (uint s = 0; s < nfa.size(); ++s) {
+    if (nfa[s].byte_set >= 0) {
+      used[nfa[s].byte_set] = true;
+    }
+  }
+  memset(automaton->byte_class, 0, sizeof(automaton->byte_class));
+  automaton->num_classes = 1;
+  for (uint b = 0; b < byte_sets.size(); ++b) {
+    if (!used[b]) {
+      continue;
+    }
+    int split[256][2];
+    memset(split, -1, sizeof(split));
+    int num_classes = 0;
+    for (int byte = 0; byte < 256; ++byte) {
+      uint8& byte_class = automaton->byte_class[byte];
+      int& split_class = split[byte_class][byte_sets[b].has(byte)];
+      if (split_class < 0) {
+        split_class = num_classes++;
+      }
+      byte_class = split_class;
+    }
+    automaton->num_classes = num_classes;
+  }
+  const int num_classes = automaton->num_classes;
+
+  // Lists the classes included in each used byte set.
+  vector<vector<int> > set_classes(byte_sets.size());
+  for (uint b = 0; b < byte_sets.size(); ++b) {
+    vector<bool> included(num_classes, false);
+    for (int byte = 0; used[b] && byte < 256; ++byte) {
+      if (byte_sets[b].has(byte) && !included[automaton->byte_class[byte]]) {
+        included[automaton->byte_class[byte]] = true;
+        set_classes[b].push_back(automaton->byte_class[byte]);
+      }
+    }
+  }
+
+  // Builds the deterministic automaton with the subset construction; a state
+  // is the set of nondeterministic states (with a byte transition, or
+  // accepting) the patterns can be in, along with the patterns matched when
+  // entering it.
+  typedef map<vector<int>, int> StateMap;
+  StateMap state_ids;
+  vector<const vector<int>*> states;
+  vector<int> visited(nfa.size(), 0), closure;
+  int generation = 0;
+
+  StateMap::iterator dead =
+      state_ids.insert(std::make_pair(vector<int>(), 0)).first;
+  states.push_back(&dead->first);
+  get_closure(nfa, accepts, matches, vector<int>(1, 0), &visited, ++generation,
+              &closure);
+  StateMap::iterator start = state_ids.insert(std::make_pair(closure, 1)).first;
+  states.push_back(&start->first);
+
+  vector<vector<int> > next_states(num_classes);
+  for (uint s = 0; s < states.size(); ++s) {
+    const vector<int>& state = *states[s];
+    for (int c = 0; c < num_classes; ++c) {
+      next_states[c].clear();
+    }
+    automaton->first_matched.push_back(automaton->matched.size());
+    automaton->first_accepted.push_back(automaton->accepted.size());
+    uint i = 0;
+    for (; i < state.size() && state[i] >= 0; ++i) {
+      const NfaState& nfa_state = nfa[state[i]];
+      if (accepts[state[i]] >= 0) {
+        automaton->accepted.push_back(accepts[state[i]]);
+      }
+      if (nfa_state.byte_set >= 0) {
+        const vector<int>& classes = set_classes[nfa_state.byte_set];
+        for (uint c = 0; c < classes.size(); ++c) {
+          next_states[classes[c]].push_back(nfa_state.next);
+        }
+      }
+    }
+    std::sort(automaton->accepted.begin() + automaton->first_accepted.back(),
+              automaton->accepted.end());
+    if (i < state.size()) {
+      automaton->matched.insert(automaton->matched.end(),
+                                state.begin() + i + 1, state.end());
+    }
+
+    for (int c = 0; c < num_classes; ++c) {
+      bool matching = get_closure(nfa, accepts, matches, next_states[c],
+                                  &visited, ++generation, &closure);
+      std::pair<StateMap::iterator, bool> target =
+          state_ids.insert(std::make_pair(closure, states.size()));
+      if (target.second) {
+        if (static_cast<int>(states.size()) >= kMaxStates) {
+          delete automaton;
+          return NULL;
+        }
+        states.push_back(&target.first->first);
+      }
+      int32 transition = target.first->second * num_classes;
+      automaton->transitions.push_back(matching ? -transition : transition);
+    }
+  }
+  automaton->first_matched.push_back(automaton->matched.size());
+  automaton->first_accepted.push_back(automaton->accepted.size());
+  return automaton;
+}
+
+void RegexSet::Match(const char* data, uint32 length, vector<int>* ids) const {
+  uint32 first_id = ids->size();
+  int matches = 0;
+  for (vector<Automaton*>::const_iterator it = automata_.begin();
+       it != automata_.end(); ++it) {
+    const Automaton* automaton = *it;
+    const int32* transitions = &automaton->transitions[0];
+    const uint8* byte_class = automaton->byte_class;
+    const int num_classes = automaton->num_classes;
+
+    // Patterns may be matched by the start state, and on each transition to a
+    // state where patterns are matched (negated transitions).
+    int32 state = num_classes;
+    matches += append_ids(automaton->first_matched, automaton->matched, 1, ids);
+    for (uint32 i = 0; i < length; ++i) {
+      state = transitions[state + byte_class[static_cast<uint8>(data[i])]];
+      if (state <= 0) {
+        if (state == 0) {
+          break;
+        }
+        state = -state;
+        matches += append_ids(automaton->first_matched, automaton->matched,
+                             state / num_classes, ids);
+      }
+    }
+    matches += append_ids(automaton->first_accepted, automaton->accepted,
+                         state / num_classes, ids);
+  }
+
+  // Ids are sorted, and unique, within each list.
+  if (matches > 1) {
+    std::sort(ids->begin() + first_id, ids->end());
+    ids->erase(std::unique(ids->begin() + first_id, ids->end()), ids->end());
+  }
+}
+
+void RegexSet::Save(Serializer* out) const {
+  out->WriteInt32(num_compiled_);
+  out->WriteUint32(automata_.size());
+  for (uint i = 0; i < automata_.size(); ++i) {
+    const Automaton* automaton = automata_[i];
+    out->WriteBytes(automaton->byte_class, sizeof(automaton->byte_class));
+    out->WriteInt32(automaton->num_classes);
+    out->WriteVector(automaton->transitions);
+    out->WriteVector(automaton->first_matched);
+    out->WriteVector(automaton->matched);
+    out->WriteVector(automaton->first_accepted);
+    out->WriteVector(automaton->accepted);
+  }
+}
+
+// Returns true iff the @p first offsets delimit the @p num_states lists of
+// @p ids, and the ids are in [0, @p num_ids[.
+static bool valid_id_lists(const vector<int>& first, const vector<int>& ids,
+                           uint32 num_states, int num_ids) {
+  if (first.size() != num_states + 1 || first[0] != 0 ||
+      first[num_states] != static_cast<int>(ids.size())) {
+    return false;
+  }
+  for (uint32 s = 0; s < num_states; ++s) {
+    if (first[s] > first[s + 1]) {
+      return false;
+    }
+  }
+  for (uint i = 0; i < ids.size(); ++i) {
+    if (ids[i] < 0 || ids[i] >= num_ids) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RegexSet::Load(Deserializer* in, int num_ids) {
+  CHECK(automata_.empty() && pending_.empty());
+  uint32 num_automata;
+  if (!in->ReadInt32(&num_compiled_) || !in->ReadUint32(&num_automata)) {
+    return false;
+  }
+  for (uint32 i = 0; i < num_automata; ++i) {
+    Automaton* automaton = new Automaton();
+    automata_.push_back(automaton);
+    if (!in->ReadBytes(automaton->byte_class, sizeof(automaton->byte_class)) ||
+        !in->ReadInt32(&automaton->num_classes) ||
+        !in->ReadVector(&automaton->transitions) ||
+        !in->ReadVector(&automaton->first_matched) ||
+        !in->ReadVector(&automaton->matched) ||
+        !in->ReadVector(&automaton->first_accepted) ||
+        !in->ReadVector(&automaton->accepted)) {
+      return false;
+    }
+
+    // Match() trusts the automata: checks that all the transitions and
+    // byte classes stay within the tables.
+    int num_classes = automaton->num_classes;
+    int32 size = automaton->transitions.size();
+    if (num_classes <= 0 || size < 2 * num_classes || size % num_classes) {
+      return false;
+    }
+    for (int b = 0; b < 256; ++b) {
+      if (automaton->byte_class[b] >= num_classes) {
+        return false;
+      }
+    }
+    for (int32 t = 0; t < size; ++t) {
+      int32 state = automaton->transitions[t];
+      if (state <= -size || state >= size || state % num_classes) {
+        return false;
+      }
+    }
+    if (!valid_id_lists(automaton->first_matched, automaton->matched,
+                        size / num_classes, num_ids) ||
+        !valid_id_lists(automaton->first_accepted, automaton->accepted,
+                        size / num_classes, num_ids)) {
+      return false;
+    }
+  }
+  return true;
+}
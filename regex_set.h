@@ -0,0 +1,99 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REGEX_SET_H__
+#define REGEX_SET_H__
+
+#include "base/basictypes.h"
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+class Deserializer;
+class Serializer;
+
+// Set of regular expressions, compiled together into deterministic automata
+// which find all the expressions fully matching a string in a single pass over
+// it. Expressions use the POSIX extended syntax, and are case-insensitive (as
+// the classifier's boost::regex are); they are identified by caller-provided
+// ids.
+// Only a subset of the syntax is supported: Add() rejects back-references,
+// escape sequences (other than escaped punctuation and the \w, \d and \s
+// classes), collating elements, and anchors which are not at the boundaries
+// of the expression. Rejected expressions are to be matched by other means.
+// Expressions are merged into as few automata as possible, each automaton
+// having at most kMaxStates states; an expression whose automaton alone is too
+// large is rejected by Compile().
+class RegexSet {
+ public:
+  // Maximal number of states of an automaton, and of nondeterministic states
+  // of an expression (which bounds the counted repetitions).
+  static const int kMaxStates = 10000;
+  static const int kMaxPatternStates = 8192;
+
+  RegexSet();
+  ~RegexSet();
+
+  // Number of automata, and number of expressions they match.
+  int num_automata() const { return automata_.size(); }
+  int size() const { return num_compiled_; }
+
+  // Adds the @p pattern, identified by @p id, to the set. Returns false if the
+  // pattern uses unsupported constructs. Patterns must be valid expressions.
+  bool Add(int id, const string& pattern);
+
+  // Compiles the patterns added since the last call into automata. Appends
+  // the ids of the patterns whose automaton is too large to @p rejected.
+  void Compile(vector<int>* rejected);
+
+  // Appends the ids of the compiled patterns fully matching the @p length
+  // bytes of @p data to @p ids, in increasing order.
+  void Match(const char* data, uint32 length, vector<int>* ids) const;
+
+  // Saves the compiled automata to @p out (patterns not compiled yet are not
+  // saved), or loads them from @p in into an empty set. Load() returns false
+  // if the automata are not consistent, or match ids outside [0, @p num_ids[.
+  void Save(Serializer* out) const;
+  bool Load(Deserializer* in, int num_ids);
+
+ private:
+  struct ByteSetTable;
+  struct Pattern;
+  struct Automaton;
+  class Parser;
+
+  // Builds a single automaton for the patterns [@p first, @p last[ of
+  // pending_, or splits them in smaller groups if it is too large.
+  void CompileGroup(int first, int last, vector<int>* rejected);
+
+  // Returns the automaton for the patterns [@p first, @p last[ of pending_,
+  // or NULL if it has more than kMaxStates states.
+  Automaton* BuildAutomaton(int first, int last);
+
+  // Distinct byte sets used by the patterns' transitions.
+  ByteSetTable* byte_sets_;
+
+  // Patterns added but not compiled yet, and compiled automata.
+  vector<Pattern*> pending_;
+  vector<Automaton*> automata_;
+  int num_compiled_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(RegexSet);
+};
+
+#endif  // REGEX_SET_H__
@@ -0,0 +1,225 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Differential test of the RegexSet automata against boost::regex (with the
+// extended and icase flags of the classifier's rules): sets of handpicked and
+// of random patterns are matched against random strings made of fragments of
+// these patterns, and each pattern accepted by the set must be reported
+// exactly for the strings boost::regex_match matches in full. Failed checks
+// abort the test with an error.
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "regex_set.h"
+#include "serializer.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+
+using std::string;
+using std::vector;
+
+// Number of random strings matched against each set, and number of random
+// sets (of kRandomSetSize patterns each).
+static const int kNumStrings = 2000;
+static const int kNumRandomSets = 40;
+static const int kRandomSetSize = 50;
+
+// Patterns exercising the corner cases of the automata: sticky trailing
+// ".*", patterns sharing their first pieces, counted repetitions, bracket
+// expressions, classes, anchors, alternations and escaped punctuation.
+static const char* kPatterns[] = {
+  ".*", "^/ads/.*", "/ads/.*", ".*\\.exe", "/a.*b.*", "(/ads/)?.*",
+  "/ads/banner", "/ads/ban.*", "/ads/[0-9]+", "/ads/(x|y)z", "/ads/.*\\.js",
+  "a{2}", "a{2,}", "a{1,3}b", "(ab){0,2}c", "x{0}y", "[0-9]{2,3}/.*",
+  "[]a]+", "[^/]+\\.js", "[a-c-]x", "[[:digit:]]+", "[[:alpha:]_]*",
+  "[^]x]y", "[.]*", "\\d+", "\\w+\\.\\s?", "\\.\\*\\?\\+", "\\(a\\)",
+  "^abc$", "abc$", "^$", "foo|bar", "(a|ab)(c|bcd)", "(foo|bar)+.*",
+  "a*b?a+", "(a*)*", "(a|)+b", ".*foo.*bar.*", "a|^b", "(^a)", "\\W\\S\\D",
+};
+
+// Valid patterns using constructs the automata don't support, which must be
+// rejected.
+static const char* kRejectedPatterns[] = {
+  "a^b", "a$b", "[[.a.]]", "[[=a=]]", "[[:word:]]", "[\\d]", "\\bfoo",
+  "\\<foo\\>", "foo\\B", "\\`foo", "a\\Z", "\\n", "\\x41", "\\Qa",
+};
+
+// Fragments of the patterns, from which the strings are made.
+static const char* kFragments[] = {
+  "/", "ads", "/ads/", "banner", "a", "A", "b", "c", "x", "y", "z", ".",
+  "exe", ".js", "foo", "bar", "0", "9", "]", "-", "_", " ", "\t", "*", "?",
+  "+", "(", ")", "\n", "\xe9", "ab", "bcd",
+};
+
+// Atoms and repetition operators of the random patterns.
+static const char* kRandomAtoms[] = {
+  "a", "b", "A", ".", "[ab]", "[^a]", "(a|b)", "(ab|a)", "\\.", "[[:digit:]]",
+  "(a*b)", "x",
+};
+static const char* kRandomOperators[] = {
+  "", "", "", "*", "+", "?", "{2}", "{0,2}", "{1,}",
+};
+static const char* kRandomFragments[] = {
+  "a", "b", "A", "B", ".", "x", "0", "ab",
+};
+
+#define ARRAY_SIZE(array) static_cast<int>(sizeof(array) / sizeof(*array))
+
+// Returns a string of up to @p max_fragments random @p fragments.
+static string get_random_string(const char** fragments, int num_fragments,
+                                int max_fragments, unsigned int* seed) {
+  string text;
+  int length = rand_r(seed) % (max_fragments + 1);
+  for (int i = 0; i < length; ++i) {
+    text += fragments[rand_r(seed) % num_fragments];
+  }
+  return text;
+}
+
+// Returns a random pattern of up to 4 repeated atoms, possibly followed by a
+// sticky ".*".
+static string get_random_pattern(unsigned int* seed) {
+  string pattern;
+  int length = 1 + rand_r(seed) % 4;
+  for (int i = 0; i < length; ++i) {
+    pattern += kRandomAtoms[rand_r(seed) % ARRAY_SIZE(kRandomAtoms)];
+    pattern += kRandomOperators[rand_r(seed) % ARRAY_SIZE(kRandomOperators)];
+  }
+  if (rand_r(seed) % 4 == 0) {
+    pattern += ".*";
+  }
+  return pattern;
+}
+
+static boost::regex get_boost_regex(const string& pattern) {
+  boost::regex regex(pattern, boost::regex_constants::extended |
+                                  boost::regex_constants::icase |
+                                  boost::regex_constants::no_except);
+  if (regex.status() != 0) {
+    LOG(FATAL, "Invalid pattern '%s'.", pattern.c_str());
+  }
+  return regex;
+}
+
+// Checks that the @p patterns compiled together in a RegexSet (and in a copy
+// saved and loaded again) match the @p strings as boost::regex does. Returns
+// the number of patterns compiled into the set, and adds the number of
+// matches to @p matches.
+static int check_patterns(const vector<string>& patterns,
+                          const vector<string>& strings, int* matches) {
+  RegexSet set;
+  vector<bool> compiled(patterns.size(), false);
+  for (uint i = 0; i < patterns.size(); ++i) {
+    compiled[i] = set.Add(i, patterns[i]);
+  }
+  vector<int> rejected;
+  set.Compile(&rejected);
+  for (uint i = 0; i < rejected.size(); ++i) {
+    compiled[rejected[i]] = false;
+  }
+
+  string saved;
+  Serializer out(&saved);
+  set.Save(&out);
+  RegexSet loaded;
+  Deserializer in(saved.data(), saved.size());
+  CHECK(loaded.Load(&in, patterns.size()) && in.done());
+
+  vector<boost::regex> regexes;
+  for (uint i = 0; i < patterns.size(); ++i) {
+    regexes.push_back(get_boost_regex(patterns[i]));
+  }
+  for (uint s = 0; s < strings.size(); ++s) {
+    const string& text = strings[s];
+    vector<int> expected, ids, loaded_ids;
+    for (uint i = 0; i < patterns.size(); ++i) {
+      if (compiled[i] &&
+          boost::regex_match(text.begin(), text.end(), regexes[i])) {
+        expected.push_back(i);
+      }
+    }
+    *matches += expected.size();
+    set.Match(text.data(), text.size(), &ids);
+    loaded.Match(text.data(), text.size(), &loaded_ids);
+    if (ids != expected || loaded_ids != expected) {
+      for (uint i = 0; i < patterns.size(); ++i) {
+        bool matched = std::find(ids.begin(), ids.end(),
+                                 static_cast<int>(i)) != ids.end();
+        bool boost_matched = std::find(expected.begin(), expected.end(),
+                                       static_cast<int>(i)) != expected.end();
+        if (matched != boost_matched) {
+          fprintf(stderr, "'%s' on '%s': RegexSet %d, boost::regex %d\n",
+                  patterns[i].c_str(), text.c_str(), matched, boost_matched);
+        }
+      }
+      CHECK(ids == expected && loaded_ids == expected);
+    }
+  }
+  return set.size();
+}
+
+int main() {
+  unsigned int seed = 42;
+  vector<string> strings;
+  for (int i = 0; i < kNumStrings; ++i) {
+    strings.push_back(get_random_string(kFragments, ARRAY_SIZE(kFragments), 6,
+                                        &seed));
+  }
+
+  // Handpicked patterns, together and each on its own.
+  vector<string> patterns(kPatterns, kPatterns + ARRAY_SIZE(kPatterns));
+  int matches = 0;
+  int compiled = check_patterns(patterns, strings, &matches);
+  CHECK_EQ(compiled, ARRAY_SIZE(kPatterns));
+  for (int i = 0; i < ARRAY_SIZE(kPatterns); ++i) {
+    CHECK_EQ(check_patterns(vector<string>(1, kPatterns[i]), strings,
+                            &matches), 1);
+  }
+  for (int i = 0; i < ARRAY_SIZE(kRejectedPatterns); ++i) {
+    get_boost_regex(kRejectedPatterns[i]);
+    RegexSet set;
+    CHECK(!set.Add(0, kRejectedPatterns[i]));
+  }
+  printf("%d handpicked patterns matched as by boost::regex (%d matches), "
+         "%d rejected\n", compiled, matches, ARRAY_SIZE(kRejectedPatterns));
+
+  // Random patterns.
+  strings.clear();
+  for (int i = 0; i < kNumStrings; ++i) {
+    strings.push_back(get_random_string(kRandomFragments,
+                                        ARRAY_SIZE(kRandomFragments), 8,
+                                        &seed));
+  }
+  compiled = matches = 0;
+  for (int s = 0; s < kNumRandomSets; ++s) {
+    patterns.clear();
+    for (int i = 0; i < kRandomSetSize; ++i) {
+      patterns.push_back(get_random_pattern(&seed));
+    }
+    compiled += check_patterns(patterns, strings, &matches);
+  }
+  printf("%d random patterns matched as by boost::regex (%d matches)\n",
+         compiled, matches);
+
+  printf("PASSED\n");
+  return 0;
+}
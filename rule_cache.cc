@@ -0,0 +1,135 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "classifier.h"
+#include "mapped_file.h"
+#include "rule_cache.h"
+#include "serializer.h"
+#include <string.h>
+
+// Header of the cache files.
+static const char kRuleCacheMagic[8] = {'U', 'R', 'L', 'R', 'U', 'L', 'E', 'S'};
+static const uint32 kByteOrderMark = 0x01020304;
+static const uint32 kRuleCacheHeaderSize = 8 + 4 + 4 + 8 + 8 + 8;
+
+// Returns into @p fingerprint the fingerprint of the file at @p path, or
+// returns false if the file can't be read.
+static bool get_file_fingerprint(const string& path, uint64* fingerprint) {
+  MappedFile file;
+  if (!file.Map(path)) {
+    return false;
+  }
+  *fingerprint = Fingerprint(file.data(), file.size());
+  return true;
+}
+
+bool WriteRuleCache(const Classifier& classifier, const string& rules_path,
+                    const string& cache_path) {
+  uint64 rules_fingerprint;
+  if (!get_file_fingerprint(rules_path, &rules_fingerprint)) {
+    LOG(ERROR, "Could not read the rules file '%s'.", rules_path.c_str());
+    return false;
+  }
+
+  string payload;
+  Serializer payload_out(&payload);
+  classifier.Save(&payload_out);
+
+  string cache;
+  Serializer out(&cache);
+  out.WriteBytes(kRuleCacheMagic, sizeof(kRuleCacheMagic));
+  out.WriteUint32(kRuleCacheVersion);
+  out.WriteUint32(kByteOrderMark);
+  out.WriteUint64(rules_fingerprint);
+  out.WriteUint64(payload.size());
+  out.WriteUint64(Fingerprint(payload.data(), payload.size()));
+  CHECK(cache.size() == kRuleCacheHeaderSize);
+  cache.append(payload);
+
+  if (!ReplaceFile(cache_path, cache)) {
+    return false;
+  }
+
+  LOG(INFO, "Saved %d rules to the rule cache '%s' (%d bytes).",
+      static_cast<int>(classifier.rules().size()), cache_path.c_str(),
+      static_cast<int>(cache.size()));
+  return true;
+}
+
+Classifier* LoadRuleCache(const string& cache_path, const string& rules_path,
+                          bool use_automata, bool use_prefilter) {
+  MappedFile file;
+  if (!file.Map(cache_path)) {
+    LOG(INFO, "No rule cache at '%s'.", cache_path.c_str());
+    return NULL;
+  }
+
+  // Checks the header.
+  Deserializer header(file.data(), file.size());
+  char magic[sizeof(kRuleCacheMagic)];
+  uint32 version = 0, byte_order = 0;
+  uint64 rules_fingerprint = 0, payload_size = 0, payload_fingerprint = 0;
+  header.ReadBytes(magic, sizeof(magic));
+  header.ReadUint32(&version);
+  header.ReadUint32(&byte_order);
+  header.ReadUint64(&rules_fingerprint);
+  header.ReadUint64(&payload_size);
+  header.ReadUint64(&payload_fingerprint);
+  if (!header.ok() || memcmp(magic, kRuleCacheMagic, sizeof(magic)) != 0 ||
+      version != kRuleCacheVersion || byte_order != kByteOrderMark ||
+      payload_size != file.size() - kRuleCacheHeaderSize) {
+    LOG(WARNING, "Rule cache '%s' has an invalid header, or an unsupported "
+                 "version; ignoring it.", cache_path.c_str());
+    return NULL;
+  }
+
+  // Checks that the cache is up to date, and not corrupted.
+  uint64 current_fingerprint;
+  if (!get_file_fingerprint(rules_path, &current_fingerprint) ||
+      current_fingerprint != rules_fingerprint) {
+    LOG(WARNING, "Rule cache '%s' is stale (the rules file '%s' changed); "
+                 "ignoring it.", cache_path.c_str(), rules_path.c_str());
+    return NULL;
+  }
+  const char* payload = file.data() + kRuleCacheHeaderSize;
+  if (Fingerprint(payload, payload_size) != payload_fingerprint) {
+    LOG(WARNING, "Rule cache '%s' is corrupted; ignoring it.",
+        cache_path.c_str());
+    return NULL;
+  }
+
+  Deserializer in(payload, payload_size);
+  Classifier* classifier = new Classifier();
+  if (!classifier->Load(&in) || !in.done()) {
+    LOG(WARNING, "Rule cache '%s' could not be loaded; ignoring it.",
+        cache_path.c_str());
+    classifier->Release();
+    return NULL;
+  }
+  if (classifier->use_automata() != use_automata ||
+      classifier->use_prefilter() != use_prefilter) {
+    LOG(WARNING, "Rule cache '%s' was built with other compilation options; "
+                 "ignoring it.", cache_path.c_str());
+    classifier->Release();
+    return NULL;
+  }
+
+  LOG(INFO, "Loaded %d rules from the rule cache '%s'.",
+      static_cast<int>(classifier->rules().size()), cache_path.c_str());
+  return classifier;
+}
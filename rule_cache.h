@@ -0,0 +1,51 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Rule caches: compiled classifiers saved to a binary file (by "urlfilter
+// --compile_rules"), so that urlfilter can start, or reload its rules, without
+// parsing and compiling them again. A cache starts with a header (magic,
+// format version, and fingerprints of the rules file it was built from and of
+// the payload), followed by the Classifier::Save() payload. Caches use the
+// native byte order, and are meant for the machine which built them.
+
+#ifndef RULE_CACHE_H__
+#define RULE_CACHE_H__
+
+#include "base/basictypes.h"
+#include <string>
+
+using std::string;
+class Classifier;
+
+// Version of the cache format, to be increased on each format change.
+static const uint32 kRuleCacheVersion = 2;
+
+// Saves the compiled @p classifier, built from the rules file @p rules_path,
+// to the cache file @p cache_path (replaced atomically). Returns false on
+// failure.
+bool WriteRuleCache(const Classifier& classifier, const string& rules_path,
+                    const string& cache_path);
+
+// Loads the compiled classifier of the cache file @p cache_path, which must
+// have been built from the current content of the rules file @p rules_path,
+// with the @p use_automata and @p use_prefilter options (cf.
+// Classifier::Compile). Returns NULL if the cache is missing, stale, or
+// invalid.
+Classifier* LoadRuleCache(const string& cache_path, const string& rules_path,
+                          bool use_automata, bool use_prefilter);
+
+#endif  // RULE_CACHE_H__
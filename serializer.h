@@ -0,0 +1,129 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SERIALIZER_H__
+#define SERIALIZER_H__
+
+#include "base/basictypes.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Returns the 64 bits FNV-1a hash of the @p length bytes of @p data, used as
+// checksum of the rule caches.
+uint64 Fingerprint(const char* data, uint64 length);
+
+// Binary writer of the rule caches (cf. rule_cache.h). Values are appended
+// to a string in the native byte order; vectors are only supported for plain
+// old data types.
+class Serializer {
+ public:
+  explicit Serializer(string* out) : out_(out) {}
+
+  void WriteBytes(const void* data, uint32 length) {
+    out_->append(static_cast<const char*>(data), length);
+  }
+  void WriteUint8(uint8 value) { WriteBytes(&value, sizeof(value)); }
+  void WriteInt32(int32 value) { WriteBytes(&value, sizeof(value)); }
+  void WriteUint32(uint32 value) { WriteBytes(&value, sizeof(value)); }
+  void WriteUint64(uint64 value) { WriteBytes(&value, sizeof(value)); }
+  void WriteString(const string& value) {
+    WriteUint32(value.size());
+    WriteBytes(value.data(), value.size());
+  }
+  template <typename T>
+  void WriteVector(const vector<T>& values) {
+    WriteUint32(values.size());
+    if (!values.empty()) {
+      WriteBytes(&values[0], values.size() * sizeof(T));
+    }
+  }
+
+ private:
+  string* out_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Serializer);
+};
+
+// Binary reader of the values written by a Serializer. Reads are bounds
+// checked: once a read goes past the end of the data, the Deserializer is in
+// error, and all subsequent reads fail.
+class Deserializer {
+ public:
+  Deserializer(const char* data, uint64 length)
+    : data_(data), remaining_(length), ok_(true) {}
+
+  // Returns true iff no read failed so far.
+  bool ok() const { return ok_; }
+
+  // Returns true iff all the data was read, without error.
+  bool done() const { return ok_ && remaining_ == 0; }
+
+  bool ReadBytes(void* data, uint64 length) {
+    if (!ok_ || length > remaining_) {
+      ok_ = false;
+      return false;
+    }
+    memcpy(data, data_, length);
+    data_ += length;
+    remaining_ -= length;
+    return true;
+  }
+  bool ReadUint8(uint8* value) { return ReadBytes(value, sizeof(*value)); }
+  bool ReadInt32(int32* value) { return ReadBytes(value, sizeof(*value)); }
+  bool ReadUint32(uint32* value) { return ReadBytes(value, sizeof(*value)); }
+  bool ReadUint64(uint64* value) { return ReadBytes(value, sizeof(*value)); }
+  bool ReadString(string* value) {
+    uint32 length;
+    if (!ReadUint32(&length) || !check_length(length)) {
+      return false;
+    }
+    value->assign(data_, length);
+    data_ += length;
+    remaining_ -= length;
+    return true;
+  }
+  template <typename T>
+  bool ReadVector(vector<T>* values) {
+    uint32 size;
+    if (!ReadUint32(&size) || !check_length(uint64(size) * sizeof(T))) {
+      return false;
+    }
+    values->resize(size);
+    return size == 0 || ReadBytes(&(*values)[0], uint64(size) * sizeof(T));
+  }
+
+ private:
+  // Fails the Deserializer if less than @p length bytes remain.
+  bool check_length(uint64 length) {
+    if (length > remaining_) {
+      ok_ = false;
+    }
+    return ok_;
+  }
+
+  const char* data_;
+  uint64 remaining_;
+  bool ok_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(Deserializer);
+};
+
+#endif  // SERIALIZER_H__
@@ -0,0 +1,97 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "stream_buffer.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+const uint32 StreamBuffer::kMinCapacity;
+
+StreamBuffer::StreamBuffer(uint32 max_size)
+  : max_size_(std::max(max_size, kMinCapacity)), storage_(NULL),
+    capacity_(0), start_(0), end_(0) {
+}
+
+StreamBuffer::~StreamBuffer() {
+  free(storage_);
+}
+
+void StreamBuffer::Append(const char* data, uint32 length) {
+  if (length == 0) {
+    return;
+  }
+
+  if (end_ + length > capacity_) {
+    uint32 live = size();
+    CHECK(live + length <= max_size_);
+
+    // Grows the storage, keeping at least as much free space as live data, so
+    // that growth is amortized; but for the maximal size.
+    uint32 capacity = std::max(capacity_, kMinCapacity);
+    while (capacity < 2 * (live + length) && capacity < max_size_) {
+      capacity *= 2;
+    }
+    capacity = std::min(capacity, max_size_);
+
+    if (live + length <= capacity_ &&
+        (start_ >= live || capacity == capacity_)) {
+      // Enough room once the consumed prefix is reclaimed; since that prefix
+      // is larger than the moved data (unless the storage cannot grow),
+      // compaction is amortized.
+      memmove(storage_, storage_ + start_, live);
+    } else {
+      // Grows the storage (and reclaims the consumed prefix).
+      char* storage = reinterpret_cast<char*>(malloc(capacity));
+      CHECK(storage != NULL);
+      if (live > 0) {
+        memcpy(storage, storage_ + start_, live);
+      }
+      free(storage_);
+      storage_ = storage;
+      capacity_ = capacity;
+    }
+    start_ = 0;
+    end_ = live;
+  }
+
+  memcpy(storage_ + end_, data, length);
+  end_ += length;
+}
+
+void StreamBuffer::Consume(uint32 length) {
+  CHECK(length <= size());
+  start_ += length;
+  if (start_ == end_) {
+    start_ = end_ = 0;
+  }
+}
+
+void StreamBuffer::Clear() {
+  free(storage_);
+  storage_ = NULL;
+  capacity_ = start_ = end_ = 0;
+}
+
+void StreamBuffer::Swap(StreamBuffer* other) {
+  std::swap(max_size_, other->max_size_);
+  std::swap(storage_, other->storage_);
+  std::swap(capacity_, other->capacity_);
+  std::swap(start_, other->start_);
+  std::swap(end_, other->end_);
+}
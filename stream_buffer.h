@@ -0,0 +1,73 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef STREAM_BUFFER_H__
+#define STREAM_BUFFER_H__
+
+#include "base/basictypes.h"
+
+// Byte buffer holding the payload of one direction of a connection. Data is
+// appended at the end, and consumed from the front by advancing an offset,
+// without copying. The live data is moved back to the start of the storage
+// only when the consumed prefix is larger than the live data itself, which
+// keeps appends and consumption amortized O(1) per byte. The live data is
+// always contiguous, so that it can be parsed in place.
+class StreamBuffer {
+ public:
+  // Minimal size of the storage, once allocated.
+  static const uint32 kMinCapacity = 512;
+
+  // Creates an empty buffer, which may hold at most @p max_size bytes; its
+  // storage never exceeds max_size bytes either (nor kMinCapacity).
+  explicit StreamBuffer(uint32 max_size);
+  ~StreamBuffer();
+
+  // Live data accessors.
+  const char* data() const { return storage_ + start_; }
+  uint32 size() const { return end_ - start_; }
+  bool empty() const { return end_ == start_; }
+
+  // Size of the allocated storage.
+  uint32 capacity() const { return capacity_; }
+
+  // Appends @p length bytes of @p data at the end of the buffer; the buffer
+  // must not grow above its maximal size.
+  void Append(const char* data, uint32 length);
+
+  // Drops the first @p length bytes of the buffer.
+  void Consume(uint32 length);
+
+  // Drops the whole content of the buffer, and releases its storage.
+  void Clear();
+
+  // Exchanges the content of the buffer with the @p other buffer.
+  void Swap(StreamBuffer* other);
+
+ private:
+  // Maximal size of the live data, and of the storage.
+  uint32 max_size_;
+
+  // Storage; the live data is in [start_, end_[.
+  char* storage_;
+  uint32 capacity_;
+  uint32 start_;
+  uint32 end_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(StreamBuffer);
+};
+
+#endif  // STREAM_BUFFER_H__
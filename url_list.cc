@@ -0,0 +1,311 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "base/logging.h"
+#include "protocol_parser.h"
+#include "serializer.h"
+#include "url_list.h"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+#include <vector>
+
+using std::vector;
+
+const uint32 UrlList::kVersion;
+
+// Header of the compiled lists: magic, version, byte order mark, number of
+// hosts, host suffixes and url prefixes, size of the blob, and fingerprint of
+// the data following the header (the offsets of the three tables, the url
+// prefix parents, and the blob).
+static const char kUrlListMagic[8] = {'U', 'R', 'L', 'L', 'I', 'S', 'T', 'S'};
+static const uint32 kByteOrderMark = 0x01020304;
+static const uint32 kUrlListHeaderSize = 8 + 6 * 4 + 8;
+
+// Compares the lower case @p entry with the @p key, ignoring the case of the
+// key. Returns a negative value, zero, or a positive value, as strcmp.
+static int compare_entry(const StringPiece& entry, const StringPiece& key) {
+  uint32 length = std::min(entry.size(), key.size());
+  for (uint32 i = 0; i < length; ++i) {
+    int difference = static_cast<uint8>(entry[i]) -
+        static_cast<uint8>(tolower(static_cast<uint8>(key[i])));
+    if (difference) {
+      return difference;
+    }
+  }
+  return static_cast<int>(entry.size()) - static_cast<int>(key.size());
+}
+
+// Returns true iff the @p key starts with the lower case @p entry, ignoring
+// the case of the key.
+static bool is_entry_prefix(const StringPiece& entry, const StringPiece& key) {
+  return entry.size() <= key.size() &&
+      compare_entry(entry, StringPiece(key.data(), entry.size())) == 0;
+}
+
+// Appends the @p entries (sorted) to the @p blob, and their offsets to the
+// @p out.
+static void write_table(const vector<string>& entries, string* blob,
+                        Serializer* out) {
+  for (uint i = 0; i < entries.size(); ++i) {
+    out->WriteUint32(blob->size());
+    blob->append(entries[i]);
+  }
+  out->WriteUint32(blob->size());
+}
+
+// Sorts the @p entries, and removes the duplicates.
+static void sort_entries(vector<string>* entries) {
+  std::sort(entries->begin(), entries->end());
+  entries->erase(std::unique(entries->begin(), entries->end()),
+                 entries->end());
+}
+
+UrlList::UrlList()
+  : file_(), path_(), url_prefix_parents_(NULL), blob_(NULL) {
+  hosts_.offsets = host_suffixes_.offsets = url_prefixes_.offsets = NULL;
+  hosts_.size = host_suffixes_.size = url_prefixes_.size = 0;
+}
+
+UrlList::~UrlList() {
+}
+
+bool UrlList::Compile(const string& source_path, const string& output_path) {
+  MappedFile source;
+  if (!source.Map(source_path)) {
+    LOG(ERROR, "Could not read the url list '%s'.", source_path.c_str());
+    return false;
+  }
+
+  // Parses the entries, one per line.
+  vector<string> hosts, host_suffixes, url_prefixes;
+  const char* end = source.data() + source.size();
+  for (const char* line = source.data(); line < end; ) {
+    const char* eol = line;
+    while (eol < end && *eol != '\n' && *eol != '\r') {
+      ++eol;
+    }
+    const char* start = line;
+    const char* stop = eol;
+    line = eol + 1;
+    while (start < stop && isspace(static_cast<uint8>(*start))) {
+      ++start;
+    }
+    while (stop > start && isspace(static_cast<uint8>(stop[-1]))) {
+      --stop;
+    }
+    if (start == stop || *start == '#') {
+      continue;
+    }
+
+    StringPiece entry = StripUrlScheme(StringPiece(start, stop - start));
+    string lower(entry.data(), entry.size());
+    for (uint i = 0; i < lower.size(); ++i) {
+      lower[i] = tolower(static_cast<uint8>(lower[i]));
+    }
+    if (lower.find('/') != string::npos) {
+      url_prefixes.push_back(lower);
+    } else if (lower.size() > 2 && lower.compare(0, 2, "*.") == 0) {
+      host_suffixes.push_back(lower.substr(2));
+    } else {
+      hosts.push_back(lower);
+    }
+  }
+  sort_entries(&hosts);
+  sort_entries(&host_suffixes);
+  sort_entries(&url_prefixes);
+
+  // The parent of an url prefix is the closest previous prefix it starts
+  // with: the stack holds the chain of the prefixes of the last entry.
+  vector<int32> parents;
+  vector<int32> stack;
+  for (uint i = 0; i < url_prefixes.size(); ++i) {
+    while (!stack.empty() &&
+           url_prefixes[i].compare(0, url_prefixes[stack.back()].size(),
+                                   url_prefixes[stack.back()]) != 0) {
+      stack.pop_back();
+    }
+    parents.push_back(stack.empty() ? -1 : stack.back());
+    stack.push_back(i);
+  }
+
+  string data, blob;
+  Serializer data_out(&data);
+  write_table(hosts, &blob, &data_out);
+  write_table(host_suffixes, &blob, &data_out);
+  write_table(url_prefixes, &blob, &data_out);
+  for (uint i = 0; i < parents.size(); ++i) {
+    data_out.WriteInt32(parents[i]);
+  }
+  data.append(blob);
+
+  string list;
+  Serializer out(&list);
+  out.WriteBytes(kUrlListMagic, sizeof(kUrlListMagic));
+  out.WriteUint32(kVersion);
+  out.WriteUint32(kByteOrderMark);
+  out.WriteUint32(hosts.size());
+  out.WriteUint32(host_suffixes.size());
+  out.WriteUint32(url_prefixes.size());
+  out.WriteUint32(blob.size());
+  out.WriteUint64(Fingerprint(data.data(), data.size()));
+  CHECK(list.size() == kUrlListHeaderSize);
+  list.append(data);
+  if (!ReplaceFile(output_path, list)) {
+    return false;
+  }
+
+  LOG(INFO, "Compiled the url list '%s' into '%s' (%d hosts, %d host "
+            "suffixes, %d url prefixes).", source_path.c_str(),
+      output_path.c_str(), static_cast<int>(hosts.size()),
+      static_cast<int>(host_suffixes.size()),
+      static_cast<int>(url_prefixes.size()));
+  return true;
+}
+
+UrlList* UrlList::Open(const string& path) {
+  UrlList* list = new UrlList();
+  list->path_ = path;
+  if (!list->file_.Map(path)) {
+    LOG(ERROR, "Could not map the url list '%s'.", path.c_str());
+    delete list;
+    return NULL;
+  }
+
+  // Checks the header, and the size and fingerprint of the data.
+  Deserializer header(list->file_.data(), list->file_.size());
+  char magic[sizeof(kUrlListMagic)];
+  uint32 version = 0, byte_order = 0, blob_size = 0;
+  uint64 fingerprint = 0;
+  header.ReadBytes(magic, sizeof(magic));
+  header.ReadUint32(&version);
+  header.ReadUint32(&byte_order);
+  header.ReadUint32(&list->hosts_.size);
+  header.ReadUint32(&list->host_suffixes_.size);
+  header.ReadUint32(&list->url_prefixes_.size);
+  header.ReadUint32(&blob_size);
+  header.ReadUint64(&fingerprint);
+  uint64 expected_size = kUrlListHeaderSize + blob_size + sizeof(uint32) *
+      (uint64(list->hosts_.size) + list->host_suffixes_.size +
+       2 * uint64(list->url_prefixes_.size) + 3);
+  const char* data = list->file_.data() + kUrlListHeaderSize;
+  if (!header.ok() || memcmp(magic, kUrlListMagic, sizeof(magic)) != 0 ||
+      version != kVersion || byte_order != kByteOrderMark ||
+      list->file_.size() != expected_size ||
+      Fingerprint(data, expected_size - kUrlListHeaderSize) != fingerprint) {
+    LOG(ERROR, "The url list '%s' is invalid, corrupted, or has an "
+               "unsupported version.", path.c_str());
+    delete list;
+    return NULL;
+  }
+
+  const uint32* offsets = reinterpret_cast<const uint32*>(data);
+  Table* tables[] = {&list->hosts_, &list->host_suffixes_,
+                     &list->url_prefixes_};
+  for (int t = 0; t < 3; ++t) {
+    tables[t]->offsets = offsets;
+    offsets += tables[t]->size + 1;
+  }
+  list->url_prefix_parents_ = reinterpret_cast<const int32*>(offsets);
+  list->blob_ = reinterpret_cast<const char*>(
+      list->url_prefix_parents_ + list->url_prefixes_.size);
+
+  // Lookups trust the tables: checks that the entries are within the blob.
+  bool valid = true;
+  for (int t = 0; t < 3 && valid; ++t) {
+    for (uint32 i = 0; i < tables[t]->size && valid; ++i) {
+      valid = tables[t]->offsets[i] <= tables[t]->offsets[i + 1] &&
+          tables[t]->offsets[i + 1] <= blob_size;
+    }
+  }
+  for (uint32 i = 0; i < list->url_prefixes_.size && valid; ++i) {
+    valid = list->url_prefix_parents_[i] >= -1 &&
+        list->url_prefix_parents_[i] < static_cast<int32>(i);
+  }
+  if (!valid) {
+    LOG(ERROR, "The url list '%s' is not consistent.", path.c_str());
+    delete list;
+    return NULL;
+  }
+
+  LOG(INFO, "Mapped the url list '%s' (%d hosts, %d host suffixes, %d url "
+            "prefixes).", path.c_str(), list->hosts_.size,
+      list->host_suffixes_.size, list->url_prefixes_.size);
+  return list;
+}
+
+int32 UrlList::find_floor(const Table& table, const StringPiece& key) const {
+  // Finds the first entry greater than the key.
+  uint32 low = 0, high = table.size;
+  while (low < high) {
+    uint32 middle = low + (high - low) / 2;
+    if (compare_entry(get_entry(table, middle), key) <= 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return static_cast<int32>(low) - 1;
+}
+
+bool UrlList::has(const Table& table, const StringPiece& key) const {
+  int32 floor = find_floor(table, key);
+  return floor >= 0 && compare_entry(get_entry(table, floor), key) == 0;
+}
+
+bool UrlList::has_url_prefix(const StringPiece& key) const {
+  // The url prefixes which the key starts with are the last entry not greater
+  // than the key, and its parents.
+  for (int32 i = find_floor(url_prefixes_, key); i >= 0;
+       i = url_prefix_parents_[i]) {
+    if (is_entry_prefix(get_entry(url_prefixes_, i), key)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool UrlList::Match(const StringPiece& url, const StringPiece& host) const {
+  // Looks the host, and all its parent domains, up.
+  if ((hosts_.size || host_suffixes_.size) && !host.empty()) {
+    if (has(hosts_, host)) {
+      return true;
+    }
+    for (uint32 start = 0; start < host.size(); ++start) {
+      if ((start == 0 || host[start - 1] == '.') &&
+          has(host_suffixes_, StringPiece(host.data() + start,
+                                          host.size() - start))) {
+        return true;
+      }
+    }
+  }
+
+  // Urls without a scheme (sent to the server itself) are also looked up
+  // prefixed by their host.
+  if (url_prefixes_.size) {
+    StringPiece key = StripUrlScheme(url);
+    if (has_url_prefix(key)) {
+      return true;
+    }
+    if (key.data() == url.data() && !host.empty()) {
+      string absolute(host.data(), host.size());
+      absolute.append(url.data(), url.size());
+      return has_url_prefix(absolute);
+    }
+  }
+  return false;
+}
@@ -0,0 +1,113 @@
+// Copyright 2008, Stephane Jacob <stephane.jacob@m4x.org>
+// Copyright 2008, John Whitbeck <john.whitbeck@m4x.org>
+// Copyright 2008, Vincent Zanotti <vincent.zanotti@m4x.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef URL_LIST_H__
+#define URL_LIST_H__
+
+#include "base/basictypes.h"
+#include "base/stringpiece.h"
+#include "mapped_file.h"
+#include <string>
+
+using std::string;
+
+// Large list of hosts and urls (eg. a category feed of blocked sites), used
+// by the url_list rules. The list is compiled from a text file into a binary
+// index of sorted tables, which is memory-mapped and shared read-only by all
+// the threads, so that lists of millions of entries neither need parsing nor
+// private memory.
+// Entries of the text lists are one per line (lines starting with '#' are
+// comments), with an optional "scheme://" prefix, and are case-insensitive:
+//   - "www.example.com" matches the urls whose host is www.example.com;
+//   - "*.example.com" matches the urls whose host is example.com, or any of
+//     its subdomains;
+//   - "example.com/ads/" matches the urls starting with example.com/ads/
+//     (once their "scheme://" prefix is removed), or the urls starting with
+//     /ads/ requested from the example.com host; entries starting with '/'
+//     match the urls of the http requests sent to the server itself.
+// The host of a request is the host of its absolute url (as sent to
+// proxies), or else the host of its Host header.
+class UrlList {
+ public:
+  // Version of the compiled format, to be increased on each format change.
+  static const uint32 kVersion = 1;
+
+  ~UrlList();
+
+  // Compiles the text list @p source_path into the @p output_path file.
+  // Returns false on failure.
+  static bool Compile(const string& source_path, const string& output_path);
+
+  // Maps the compiled list @p path. Returns NULL if the list is missing or
+  // invalid.
+  static UrlList* Open(const string& path);
+
+  // Path of the compiled list, and number of entries of each type.
+  const string& path() const { return path_; }
+  uint32 num_hosts() const { return hosts_.size; }
+  uint32 num_host_suffixes() const { return host_suffixes_.size; }
+  uint32 num_url_prefixes() const { return url_prefixes_.size; }
+
+  // Returns true iff the @p url, requested from the @p host (empty if
+  // unknown), is matched by some entry of the list. Host lookups take
+  // O(log n) time, and url prefix lookups O(log n + d), d being the number of
+  // entries which are prefixes of one another.
+  bool Match(const StringPiece& url, const StringPiece& host) const;
+
+ private:
+  // Sorted table of lower case entries: the entry i is
+  // blob_[offsets[i], offsets[i + 1][.
+  struct Table {
+    const uint32* offsets;
+    uint32 size;
+  };
+
+  UrlList();
+
+  // Returns the entry @p i of the @p table.
+  StringPiece get_entry(const Table& table, uint32 i) const {
+    return StringPiece(blob_ + table.offsets[i],
+                       table.offsets[i + 1] - table.offsets[i]);
+  }
+
+  // Returns the index of the last entry of the @p table which is not greater
+  // than the @p key, or -1.
+  int32 find_floor(const Table& table, const StringPiece& key) const;
+
+  // Returns true iff the @p table contains the @p key.
+  bool has(const Table& table, const StringPiece& key) const;
+
+  // Returns true iff some url prefix is a prefix of the @p key.
+  bool has_url_prefix(const StringPiece& key) const;
+
+  // Mapped compiled list.
+  MappedFile file_;
+  string path_;
+
+  // Entries: the tables of hosts, host suffixes and url prefixes, and the
+  // strings of their entries. The parent of the url prefix i is the longest
+  // other url prefix it starts with, or -1.
+  Table hosts_;
+  Table host_suffixes_;
+  Table url_prefixes_;
+  const int32* url_prefix_parents_;
+  const char* blob_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(UrlList);
+};
+
+#endif  // URL_LIST_H__
@@ -21,24 +21,110 @@
 #include "classifier.h"
 #include "conntrack.h"
 #include "queue.h"
+#include "rule_cache.h"
+#include "url_list.h"
 #include <map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <unistd.h>
 #include <boost/regex.h>
 #include <google/gflags.h>
 
 using std::map;
+using std::vector;
 
 DEFINE_int32(queue, 0,
              "No. of the NFQUEUE to listen to for packets to classify.");
+DEFINE_string(queues, "",
+              "Range of NFQUEUEs to listen to, in the 'N-M' format (eg. "
+              "'0-3'). One worker thread is started for each queue of the "
+              "range; it is meant to be used with iptables' --queue-balance. "
+              "Overrides --queue when set.");
+DEFINE_bool(queue_affinity, false,
+            "Pins each queue worker thread to its own CPU core (the n-th "
+            "queue of the range being pinned to the n-th online CPU).");
+DEFINE_int32(verdict_batch_size, 1,
+             "Maximal number of packet verdicts sent to the kernel in a single "
+             "netlink write; 1 disables verdict batching. Batching requires "
+             "kernel >= 3.1.");
+DEFINE_int32(verdict_batch_latency_us, 1000,
+             "Maximal delay, in microseconds, during which a packet verdict "
+             "can be held in a verdict batch.");
+DEFINE_bool(queue_conntrack, false,
+            "Identifies connections using the conntrack information attached "
+            "by NFQUEUE to the queued packets, instead of building a local "
+            "copy of the conntrack table from conntrack events. Requires "
+            "kernel >= 3.8.");
+DEFINE_bool(save_connmark, false,
+            "Saves the final mark of definitively classified connections in "
+            "the kernel conntrack mark, so that iptables can restore it and "
+            "stop queueing these connections (cf. README).");
+DEFINE_int32(classified_cache_size, ConnTrack::kDefaultClassifiedCacheSize,
+             "Number of slots of the cache of definitively classified "
+             "connections, whose packets are marked without taking any lock "
+             "(0 disables the cache).");
+DEFINE_int32(conntracked_lifetime, ConnTrack::kDefaultConntrackedLifetime,
+             "Number of seconds after which a conntracked connection without "
+             "any packet is forgotten (normally, they are removed on conntrack "
+             "DESTROY events).");
+DEFINE_int32(unconntracked_lifetime,
+             ConnTrack::kDefaultUnconntrackedLifetime,
+             "Number of seconds after which a connection unknown to the "
+             "conntrack, and without any packet, is forgotten.");
+DEFINE_int32(buffer_budget_mb, Connection::kDefaultBufferBudgetMb,
+             "Number of megabytes all the buffers of the connections being "
+             "classified may hold; above it, the largest of these connections "
+             "are classified with --buffer_eviction_mark (0 for no limit).");
+DEFINE_int32(buffer_eviction_mark, Classifier::kNoMatch,
+             "Classification mark of the connections evicted from the buffer "
+             "budget.");
+DEFINE_int32(stats_interval, 0,
+             "Number of seconds between two logs of the connection and memory "
+             "pools statistics (0 disables them). Statistics can also be "
+             "requested with SIGUSR1.");
 DEFINE_int32(mark_mask, 0xffff,
              "Mask to use when adding the classification information to the "
              "NFQUEUE mark.");
+DEFINE_bool(url_automaton, true,
+            "Compiles the method and url regexps of the rules into automata "
+            "matching all of them in a single pass (regexps using unsupported "
+            "constructs are still matched one by one).");
+DEFINE_bool(url_prefilter, true,
+            "Only evaluates the url regexps which are not compiled into "
+            "automata when the url contains their required literal (found "
+            "with an Aho-Corasick automaton).");
+DEFINE_int32(classification_cache_size, ClassificationCache::kDefaultSize,
+             "Number of (protocol, method, url) classification results kept "
+             "in the classifier's LRU cache (0 to disable).");
 DEFINE_string(rules, "",
               "File containing the urlfilter rules. They are supposed to be in "
               "the 'mark=<mark> proto=<proto> url=<url regex> method=<method>' "
               "format (alternatively, method_re and url_maxsize can be used). "
-              "Regexps are standard unix regexpes.");
+              "Regexps are standard unix regexpes. The rules are reloaded on "
+              "SIGHUP.");
+DEFINE_string(rules_cache, "",
+              "Precompiled rule cache, built from the --rules file by "
+              "--compile_rules. When up to date, the compiled rules are loaded "
+              "from it (on startup and on reloads) instead of being parsed and "
+              "compiled again.");
+DEFINE_bool(compile_rules, false,
+            "Compiles the --rules file into the --rules_cache file, and "
+            "exits.");
+DEFINE_string(compile_url_list, "",
+              "Text url list (one host, *.domain or url prefix per line) to "
+              "compile into the --url_list_output file, used by the url_list "
+              "rules. Exits once the list is compiled.");
+DEFINE_string(url_list_output, "",
+              "Output file of --compile_url_list.");
+DEFINE_string(control_fifo, "",
+              "Named pipe from which control commands are read, one per line: "
+              "'reload' reloads the rules (as SIGHUP does), and 'stats' logs "
+              "the statistics (as SIGUSR1 does).");
 
 // Starts the conntrack management thread. Returns the thread id.
 void* conntrack_thread_starter(void* data) {
@@ -56,25 +142,94 @@ pthread_t start_conntrack_thread(ConnTrack* conntrack) {
   return thread_id;
 }
 
+// Starts the connection expiration thread. Returns the thread id.
+void* expiration_thread_starter(void* data) {
+  reinterpret_cast<ConnTrack*>(data)->RunExpiration();
+  LOG(INFO, "Expiration thread is exiting.");
+  pthread_exit(NULL);
+}
+pthread_t start_expiration_thread(ConnTrack* conntrack) {
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, 0, expiration_thread_starter, conntrack) < 0) {
+    LOG(FATAL, "Could not start the expiration thread (%s).", strerror(errno));
+  }
+
+  return thread_id;
+}
+
 // Starts the queue listener & packet processor. Returns the thread id.
 void* queuehandler_thread_starter(void* data) {
   reinterpret_cast<Queue*>(data)->Run();
   LOG(INFO, "Queue thread is exiting.");
   pthread_exit(NULL);
 }
-pthread_t start_queuehandler_thread(Queue* queue) {
+pthread_t start_queuehandler_thread(Queue* queue, int cpu) {
   pthread_t thread_id;
   if (pthread_create(&thread_id, 0, queuehandler_thread_starter, queue) < 0) {
     LOG(FATAL, "Could not start the queue thread (%s).", strerror(errno));
   }
 
+  // Pins the thread to the requested cpu, if any.
+  if (cpu >= 0) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    if (pthread_setaffinity_np(thread_id, sizeof(cpu_set), &cpu_set) != 0) {
+      LOG(WARNING, "Could not pin the queue thread to cpu %d.", cpu);
+    }
+  }
+
   return thread_id;
 }
 
-// Sets up a signal handler to gracefully stop the urlfilter on SIGQUIT/SIGINT.
+// Parses the "N-M" (or "N") queue range in @p spec. Returns false if the
+// range is not valid.
+bool parse_queue_range(const string& spec, int* first_queue, int* last_queue) {
+  char* end;
+  long first = strtol(spec.c_str(), &end, 10);
+  long last = first;
+  if (end == spec.c_str()) {
+    return false;
+  }
+  if (*end == '-') {
+    const char* last_start = end + 1;
+    last = strtol(last_start, &end, 10);
+    if (end == last_start) {
+      return false;
+    }
+  }
+  if (*end != '\0' || first < 0 || last < first || last > 0xffff) {
+    return false;
+  }
+
+  *first_queue = first;
+  *last_queue = last;
+  return true;
+}
+
+// Sets up a signal handler to gracefully stop the urlfilter on SIGQUIT/SIGINT,
+// to log the statistics on SIGUSR1, and to reload the rules on SIGHUP (by
+// waking up the reload thread through its pipe).
 ConnTrack* __signal_handler_conntrack = NULL;
-Queue* __signal_handler_queue = NULL;
+vector<Queue*> __signal_handler_queues;
+int __signal_handler_reload_fd = -1;
 void signal_handler(int signum) {
+  if (signum == SIGUSR1) {
+    if (__signal_handler_conntrack) {
+      __signal_handler_conntrack->RequestStats();
+    }
+    return;
+  }
+  if (signum == SIGHUP) {
+    if (__signal_handler_reload_fd >= 0) {
+      int saved_errno = errno;
+      if (write(__signal_handler_reload_fd, "r", 1) < 0) {
+        // The pipe is full: a reload is already pending.
+      }
+      errno = saved_errno;
+    }
+    return;
+  }
   if (signum == SIGINT || signum == SIGQUIT) {
     LOG(INFO, "Received signal %s, stopping.",
         (signum == SIGINT ? "SIGINT" : "SIGQUIT"));
@@ -82,8 +237,8 @@ void signal_handler(int signum) {
     if (__signal_handler_conntrack) {
       __signal_handler_conntrack->Stop();
     }
-    if (__signal_handler_queue) {
-      __signal_handler_queue->Stop();
+    for (uint q = 0; q < __signal_handler_queues.size(); ++q) {
+      __signal_handler_queues[q]->Stop();
     }
 
     // Restores the signal handler to its default value, so as to make sure
@@ -92,16 +247,21 @@ void signal_handler(int signum) {
   }
 }
 
-void setup_signal_handler(ConnTrack* conntrack, Queue* queue) {
+void setup_signal_handler(ConnTrack* conntrack, const vector<Queue*>& queues,
+                          int reload_fd) {
   __signal_handler_conntrack = conntrack;
-  __signal_handler_queue = queue;
+  __signal_handler_queues = queues;
+  __signal_handler_reload_fd = reload_fd;
   signal(SIGINT, &signal_handler);
   signal(SIGQUIT, &signal_handler);
+  signal(SIGUSR1, &signal_handler);
+  signal(SIGHUP, &signal_handler);
 }
 
 // Loads the classification rules from a file, parse them, and imports
-// them in the @p classifier.
-void load_rules(File* rules, Classifier* classifier) {
+// them in the @p classifier. Returns false (after logging the error) if the
+// rules are invalid.
+bool load_rules(File* rules, Classifier* classifier) {
   int nrules = 0, nline = 1;
   boost::regex proto_ftp("^ftp$", boost::regex_constants::icase);
   boost::regex proto_http("^http$", boost::regex_constants::icase);
@@ -118,8 +278,9 @@ void load_rules(File* rules, Classifier* classifier) {
     
     if (rule_map.find("mark") == rule_map.end() ||
         rule_map.find("proto") == rule_map.end()) {
-      LOG(INFO, "At line %d:", nline);
-      LOG(FATAL, "An urlfilter rule must include at least a mark and a proto.");
+      LOG(ERROR, "At line %d: an urlfilter rule must include at least a mark "
+                 "and a proto.", nline);
+      return false;
     }
     
     int32 mark = strtol(rule_map["mark"].c_str(), NULL, 10);
@@ -129,8 +290,32 @@ void load_rules(File* rules, Classifier* classifier) {
     } else if (regex_match(rule_map["proto"], proto_http)) {
       proto = ClassificationRule::HTTP;
     } else {
-      LOG(INFO, "At line %d:", nline);
-      LOG(FATAL, "Unrecognized protocol '%s'", rule_map["proto"].c_str());
+      LOG(ERROR, "At line %d: unrecognized protocol '%s'", nline,
+          rule_map["proto"].c_str());
+      return false;
+    }
+
+    // Validates the constraints, as the rule's mutators fail fatally.
+    if (rule_map.find("method") != rule_map.end() &&
+        !ClassificationRule::is_valid_regex(
+            StringPrintf("^%s$", rule_map["method"].c_str()))) {
+      LOG(ERROR, "At line %d: '%s' is not a valid method.", nline,
+          rule_map["method"].c_str());
+      return false;
+    }
+    const char* regex_keys[] = {"method_re", "url"};
+    for (int k = 0; k < 2; ++k) {
+      if (rule_map.find(regex_keys[k]) != rule_map.end() &&
+          !ClassificationRule::is_valid_regex(rule_map[regex_keys[k]])) {
+        LOG(ERROR, "At line %d: '%s' is not a valid regular expression.",
+            nline, rule_map[regex_keys[k]].c_str());
+        return false;
+      }
+    }
+    if (rule_map.find("url_maxsize") != rule_map.end() &&
+        strtol(rule_map["url_maxsize"].c_str(), NULL, 10) < 1) {
+      LOG(ERROR, "At line %d: url_maxsize must be 1 or more.", nline);
+      return false;
     }
     ClassificationRule* rule = new ClassificationRule(proto, mark);
     
@@ -147,6 +332,22 @@ void load_rules(File* rules, Classifier* classifier) {
       int max_size = strtol(rule_map["url_maxsize"].c_str(), NULL, 10);
       rule->set_url_maxsize(max_size);
     }
+    if (rule_map.find("url_prefix") != rule_map.end()) {
+      rule->set_url_prefix(rule_map["url_prefix"]);
+    }
+    if (rule_map.find("url_suffix") != rule_map.end()) {
+      rule->set_url_suffix(rule_map["url_suffix"]);
+    }
+    if (rule_map.find("url_host") != rule_map.end()) {
+      rule->set_url_host(rule_map["url_host"]);
+    }
+    if (rule_map.find("url_list") != rule_map.end() &&
+        !rule->set_url_list(rule_map["url_list"])) {
+      LOG(ERROR, "At line %d: could not open the url list '%s'.", nline,
+          rule_map["url_list"].c_str());
+      delete rule;
+      return false;
+    }
                                                 
     nrules++;
     classifier->add_rule(rule);
@@ -156,32 +357,218 @@ void load_rules(File* rules, Classifier* classifier) {
   for (uint r = 0; r < classifier->rules().size(); ++r) {
     LOG(INFO, "  (%d) %s", r, classifier->rules()[r]->str().c_str());
   }
+  return true;
+}
+
+// Loads, and compiles, the rules of the --rules file into a new Classifier
+// (from the --rules_cache if it is up to date). Returns NULL if the rules
+// can't be loaded.
+Classifier* load_classifier() {
+  if (!FLAGS_rules_cache.empty() && !FLAGS_compile_rules) {
+    Classifier* classifier = LoadRuleCache(FLAGS_rules_cache, FLAGS_rules,
+                                           FLAGS_url_automaton,
+                                           FLAGS_url_prefilter);
+    if (classifier) {
+      classifier->set_cache_size(FLAGS_classification_cache_size);
+      return classifier;
+    }
+  }
+
+  File* rules = File::Open(FLAGS_rules.c_str(), "r");
+  if (!rules) {
+    LOG(ERROR, "Could not open the rule file '%s' (%s).",
+        FLAGS_rules.c_str(), strerror(errno));
+    return NULL;
+  }
+
+  Classifier* classifier = new Classifier();
+  bool loaded = load_rules(rules, classifier);
+  rules->Close();
+  delete rules;
+  if (!loaded) {
+    classifier->Release();
+    return NULL;
+  }
+  classifier->Compile(FLAGS_url_automaton, FLAGS_url_prefilter);
+  classifier->set_cache_size(FLAGS_classification_cache_size);
+  return classifier;
+}
+
+// Reloads the rules into a new Classifier, and swaps it with the classifier
+// of the @p conntrack. On failure, the current rules are kept.
+void reload_rules(ConnTrack* conntrack) {
+  LOG(INFO, "Reloading the rules from '%s'.", FLAGS_rules.c_str());
+  Classifier* classifier = load_classifier();
+  if (!classifier) {
+    LOG(ERROR, "Could not reload the rules; keeping the current ones.");
+    return;
+  }
+  conntrack->ReplaceClassifier(classifier);
+  LOG(INFO, "New rules are active.");
+}
+
+// Starts the reload thread, which parses and compiles the rules off the packet
+// path when the @p reload_fd pipe is written to (by the SIGHUP handler), or
+// when the 'reload' command is read from the --control_fifo. Returns the
+// thread id.
+struct ReloadThreadArgs {
+  ConnTrack* conntrack;
+  int reload_fd;
+  int control_fd;
+};
+void* reload_thread_starter(void* data) {
+  ReloadThreadArgs* args = reinterpret_cast<ReloadThreadArgs*>(data);
+  string commands;
+  for (;;) {
+    pollfd fds[2] = {{args->reload_fd, POLLIN, 0},
+                     {args->control_fd, POLLIN, 0}};
+    if (poll(fds, args->control_fd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR, "Reload thread could not poll (%s).", strerror(errno));
+      break;
+    }
+
+    char buffer[256];
+    if (fds[0].revents & POLLIN) {
+      // Coalesces the pending SIGHUPs into a single reload.
+      while (read(args->reload_fd, buffer, sizeof(buffer)) > 0) {}
+      reload_rules(args->conntrack);
+    }
+    if (args->control_fd >= 0 && (fds[1].revents & POLLIN)) {
+      int received = read(args->control_fd, buffer, sizeof(buffer));
+      if (received > 0) {
+        commands.append(buffer, received);
+      }
+      size_t eol;
+      while ((eol = commands.find('\n')) != string::npos) {
+        string command = commands.substr(0, eol);
+        commands.erase(0, eol + 1);
+        if (!command.empty() && command[command.size() - 1] == '\r') {
+          command.resize(command.size() - 1);
+        }
+        if (command == "reload") {
+          reload_rules(args->conntrack);
+        } else if (command == "stats") {
+          args->conntrack->RequestStats();
+        } else if (!command.empty()) {
+          LOG(WARNING, "Unknown control command '%s'.", command.c_str());
+        }
+      }
+    }
+  }
+  pthread_exit(NULL);
+}
+pthread_t start_reload_thread(ReloadThreadArgs* args) {
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, 0, reload_thread_starter, args) < 0) {
+    LOG(FATAL, "Could not start the reload thread (%s).", strerror(errno));
+  }
+  pthread_detach(thread_id);
+
+  return thread_id;
 }
 
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
 
+  // Url list compilation mode.
+  if (!FLAGS_compile_url_list.empty()) {
+    if (FLAGS_url_list_output.empty()) {
+      LOG(FATAL, "You must specify the output file with --url_list_output.");
+    }
+    return UrlList::Compile(FLAGS_compile_url_list,
+                            FLAGS_url_list_output) ? 0 : 1;
+  }
+
   // Loads the rules into a new classifier.
-  Classifier classifier;
   if (FLAGS_rules.empty()) {
     LOG(FATAL, "You must specificy a rule file with --rules.");
   }
-  
-  scoped_ptr<File> rules(File::OpenOrDie(FLAGS_rules.c_str(), "r"));
-  load_rules(rules.get(), &classifier);
+  Classifier* classifier = load_classifier();
+  if (!classifier) {
+    LOG(FATAL, "Could not load the rules.");
+  }
+
+  // In compilation mode, only saves the compiled rules.
+  if (FLAGS_compile_rules) {
+    if (FLAGS_rules_cache.empty()) {
+      LOG(FATAL, "You must specify the output file with --rules_cache.");
+    }
+    bool written = WriteRuleCache(*classifier, FLAGS_rules, FLAGS_rules_cache);
+    classifier->Release();
+    return written ? 0 : 1;
+  }
 
   // Prepares and starts the conntrack thread.
-  ConnTrack conntrack(&classifier);
+  ConnTrack conntrack(classifier, FLAGS_queue_conntrack,
+                      FLAGS_classified_cache_size);
+  if (FLAGS_conntracked_lifetime <= 0 || FLAGS_unconntracked_lifetime <= 0) {
+    LOG(FATAL, "Connection lifetimes must be positive.");
+  }
+  conntrack.set_lifetimes(FLAGS_conntracked_lifetime,
+                          FLAGS_unconntracked_lifetime);
+  conntrack.set_stats_interval(FLAGS_stats_interval);
+  if (FLAGS_buffer_budget_mb < 0) {
+    LOG(FATAL, "The buffer budget must not be negative.");
+  }
+  int64 buffer_budget = static_cast<int64>(FLAGS_buffer_budget_mb) << 20;
+  Connection::set_buffer_budget(buffer_budget, FLAGS_buffer_eviction_mark);
   pthread_t conntrack_thread = start_conntrack_thread(&conntrack);
+  pthread_t expiration_thread = start_expiration_thread(&conntrack);
 
-  // Prepares and starts the queue thread.
-  Queue queue(FLAGS_queue, FLAGS_mark_mask, &conntrack);
-  pthread_t queue_thread = start_queuehandler_thread(&queue);
+  // Prepares and starts the queue threads, one per NFQUEUE; they all share
+  // the same conntrack table and classifier.
+  int first_queue = FLAGS_queue, last_queue = FLAGS_queue;
+  if (!FLAGS_queues.empty() &&
+      !parse_queue_range(FLAGS_queues, &first_queue, &last_queue)) {
+    LOG(FATAL, "Invalid queue range '%s' (expected 'N-M', with N <= M).",
+        FLAGS_queues.c_str());
+  }
 
-  // Sets up the signals handler.
-  setup_signal_handler(&conntrack, &queue);
+  vector<Queue*> queues;
+  for (int q = first_queue; q <= last_queue; ++q) {
+    queues.push_back(new Queue(q, FLAGS_mark_mask, &conntrack));
+    queues.back()->set_verdict_batching(FLAGS_verdict_batch_size,
+                                        FLAGS_verdict_batch_latency_us);
+    queues.back()->set_save_connmark(FLAGS_save_connmark);
+  }
 
-  // Waits for the two threads to terminate.
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  vector<pthread_t> queue_threads;
+  for (uint q = 0; q < queues.size(); ++q) {
+    int cpu = (FLAGS_queue_affinity && ncpus > 0 ? q % ncpus : -1);
+    queue_threads.push_back(start_queuehandler_thread(queues[q], cpu));
+  }
+  LOG(INFO, "Started %d queue worker(s) on NFQUEUE %d to %d.",
+      static_cast<int>(queues.size()), first_queue, last_queue);
+
+  // Starts the reload thread, and sets up the signals handler.
+  int reload_pipe[2];
+  if (pipe(reload_pipe) < 0 ||
+      fcntl(reload_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+    LOG(FATAL, "Could not create the reload pipe (%s).", strerror(errno));
+  }
+  ReloadThreadArgs reload_args = {&conntrack, reload_pipe[0], -1};
+  if (!FLAGS_control_fifo.empty()) {
+    // The fifo is also opened for writing, so that it never reaches EOF when
+    // the command writers close it.
+    reload_args.control_fd = open(FLAGS_control_fifo.c_str(), O_RDWR);
+    if (reload_args.control_fd < 0) {
+      LOG(FATAL, "Could not open the control fifo '%s' (%s).",
+          FLAGS_control_fifo.c_str(), strerror(errno));
+    }
+  }
+  start_reload_thread(&reload_args);
+  setup_signal_handler(&conntrack, queues, reload_pipe[1]);
+
+  // Waits for the threads to terminate.
   pthread_join(conntrack_thread, NULL);
-  pthread_join(queue_thread, NULL);
+  pthread_join(expiration_thread, NULL);
+  for (uint q = 0; q < queue_threads.size(); ++q) {
+    pthread_join(queue_threads[q], NULL);
+    delete queues[q];
+  }
 }